@@ -0,0 +1,246 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <glib.h>
+#include "affinity.h"
+#include "log.h"
+
+/*
+ * DVB cards deliver their data into the memory of the NUMA node their PCI
+ * device is attached to. To avoid moving every packet across the
+ * interconnect, the threads of tvoe can be pinned to CPUs (see the cpus_*
+ * options in the example config file), and the dvr buffers of every frontend
+ * are allocated on its node.
+ */
+
+static const char *role_names[AFFINITY_ROLES] = { "main", "tune", "worker" };
+
+/* Configured CPUs per role, see affinity_set() */
+static struct {
+	bool configured;
+	char *spec;
+	cpu_set_t cpus;
+} roles[AFFINITY_ROLES];
+/* CPUs tvoe was started on, used for roles without configuration */
+static cpu_set_t initial;
+
+struct thread {
+	char name[32];
+	enum affinity_role role;
+	pid_t tid;
+};
+/* Registered threads, protected by threads_lock */
+static GSList *threads;
+static GMutex threads_lock;
+
+/* Read the first line of a (sysfs) file */
+static bool read_line(const char *path, char *buf, size_t size) {
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return false;
+	bool ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+	if(ok)
+		buf[strcspn(buf, "\n")] = 0;
+	return ok;
+}
+
+/* Parse a list of CPUs ("0-3,8") and NUMA nodes ("node1") */
+static bool parse_cpus(const char *spec, cpu_set_t *set) {
+	char *copy = strdup(spec), *saveptr, *item;
+	bool ok = true;
+	for(item = strtok_r(copy, ",", &saveptr); item && ok; item = strtok_r(NULL, ",", &saveptr)) {
+		unsigned int first, last, node;
+		char buf[1024];
+		int len;
+		if(sscanf(item, "node%u%n", &node, &len) == 1 && !item[len]) {
+			char path[128];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+			/* A node without CPUs (e.g. memory only) is no valid placement */
+			ok = read_line(path, buf, sizeof(buf)) && buf[0] && parse_cpus(buf, set);
+		} else if(sscanf(item, "%u-%u%n", &first, &last, &len) == 2 && !item[len]) {
+			ok = first <= last && last < CPU_SETSIZE;
+			for(unsigned int i = first; ok && i <= last; i++)
+				CPU_SET(i, set);
+		} else if(sscanf(item, "%u%n", &first, &len) == 1 && !item[len]) {
+			ok = first < CPU_SETSIZE;
+			if(ok)
+				CPU_SET(first, set);
+		} else {
+			ok = false;
+		}
+	}
+	free(copy);
+	return ok;
+}
+
+/* Format a CPU set as a list, e.g. "0-3,8" */
+static string format_cpus(const cpu_set_t *set) {
+	string s;
+	for(int i = 0; i < CPU_SETSIZE; i++) {
+		if(!CPU_ISSET(i, set))
+			continue;
+		int j = i;
+		while(j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, set))
+			j++;
+		if(!s.empty())
+			s += ",";
+		s += std::to_string(i);
+		if(j > i)
+			s += "-" + std::to_string(j);
+		i = j;
+	}
+	return s.empty() ? "none" : s;
+}
+
+/* Find the NUMA node of a CPU, -1 if unknown */
+static int cpu_node(int cpu) {
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *d = opendir(path);
+	if(!d)
+		return -1;
+	int node = -1;
+	struct dirent *e;
+	while((e = readdir(d)) != NULL)
+		if(sscanf(e->d_name, "node%d", &node) == 1)
+			break;
+	closedir(d);
+	return node;
+}
+
+/* CPU a thread has last run on, -1 if unknown */
+static int thread_cpu(pid_t tid) {
+	char path[128], buf[1024];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	if(!read_line(path, buf, sizeof(buf)))
+		return -1;
+	/* The command name may contain spaces, start after it. processor is field 39. */
+	char *p = strrchr(buf, ')');
+	for(int field = 2; p && field < 39; field++)
+		p = strchr(p + 1, ' ');
+	return p ? atoi(p + 1) : -1;
+}
+
+bool affinity_set(enum affinity_role role, const char *cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(!parse_cpus(cpus, &set) || !CPU_COUNT(&set))
+		return false;
+	free(roles[role].spec);
+	roles[role].spec = strdup(cpus);
+	roles[role].cpus = set;
+	roles[role].configured = true;
+	return true;
+}
+
+void affinity_init(void) {
+	if(sched_getaffinity(0, sizeof(initial), &initial) < 0) {
+		logger(LOG_ERR, "Unable to get CPU affinity: %s", strerror(errno));
+		CPU_ZERO(&initial);
+		for(long i = 0; i < sysconf(_SC_NPROCESSORS_CONF) && i < CPU_SETSIZE; i++)
+			CPU_SET(i, &initial);
+	}
+	affinity_thread(AFFINITY_MAIN, "main");
+}
+
+void affinity_thread(enum affinity_role role, const char *name) {
+	/* Threads inherit the CPUs of their creator, so always set them */
+	const cpu_set_t *set = roles[role].configured ? &roles[role].cpus : &initial;
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+	if(ret)
+		logger(LOG_ERR, "Unable to set CPU affinity of %s thread to %s: %s", name,
+				format_cpus(set).c_str(), strerror(ret));
+
+	struct thread *t = new struct thread;
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->role = role;
+	t->tid = syscall(SYS_gettid);
+	g_mutex_lock(&threads_lock);
+	threads = g_slist_append(threads, t);
+	g_mutex_unlock(&threads_lock);
+}
+
+void affinity_thread_exit(void) {
+	pid_t tid = syscall(SYS_gettid);
+	g_mutex_lock(&threads_lock);
+	for(GSList *it = threads; it != NULL; it = g_slist_next(it)) {
+		struct thread *t = (struct thread *) it->data;
+		if(t->tid != tid)
+			continue;
+		threads = g_slist_delete_link(threads, it);
+		delete t;
+		break;
+	}
+	g_mutex_unlock(&threads_lock);
+}
+
+int affinity_device_node(const char *path) {
+	char device[PATH_MAX + 16], buf[32];
+	snprintf(device, sizeof(device), "%s/device", path);
+	char *real = realpath(device, NULL);
+	if(!real)
+		return -1;
+	/* USB devices have no node, but their host controller has */
+	int node = -1;
+	for(char *end = real + strlen(real); end > real; end = strrchr(real, '/')) {
+		*end = 0;
+		snprintf(device, sizeof(device), "%s/numa_node", real);
+		if(read_line(device, buf, sizeof(buf))) {
+			node = atoi(buf);
+			break;
+		}
+	}
+	free(real);
+	return node;
+}
+
+void *affinity_alloc(size_t size, int node) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+		return NULL;
+	/* The pages are allocated on first use, according to this policy */
+	unsigned long mask = node >= 0 && node < (int) sizeof(mask) * 8 ? 1UL << node : 0;
+	if(mask && syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0) < 0)
+		logger(LOG_DEBUG, "Unable to allocate memory on node %d: %s", node, strerror(errno));
+	return p;
+}
+
+int affinity_memory_node(const void *addr) {
+	int node;
+	if(syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) < 0)
+		return -1;
+	return node;
+}
+
+void send_thread_placement(function<void(string)> sendfn) {
+	sendfn("<h3>Threads</h3>"
+		"<table><tr><th>Thread</th><th>TID</th><th>Role</th><th>Configured</th>"
+		"<th>Allowed CPUs</th><th>Last CPU</th><th>Node</th></tr>");
+	g_mutex_lock(&threads_lock);
+	for(GSList *it = threads; it != NULL; it = g_slist_next(it)) {
+		struct thread *t = (struct thread *) it->data;
+		cpu_set_t set;
+		string allowed = sched_getaffinity(t->tid, sizeof(set), &set) < 0 ? "?" :
+			format_cpus(&set);
+		int cpu = thread_cpu(t->tid);
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "<tr><td>%s</td><td>%d</td><td>%s</td><td>%s</td>"
+				"<td>%s</td><td>%d</td><td>%d</td></tr>",
+				t->name, t->tid, role_names[t->role],
+				roles[t->role].configured ? roles[t->role].spec : "all",
+				allowed.c_str(), cpu, cpu >= 0 ? cpu_node(cpu) : -1);
+		sendfn(buf);
+	}
+	g_mutex_unlock(&threads_lock);
+	sendfn("</table>");
+}
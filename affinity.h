@@ -0,0 +1,63 @@
+#ifndef __INCLUDED_TVOE_AFFINITY
+#define __INCLUDED_TVOE_AFFINITY
+
+#include <cstddef>
+#include <functional>
+#include "tvoe.h"
+
+using std::function;
+
+/*
+ * CPU and NUMA placement. Every thread of tvoe has a role, the CPUs of each
+ * role can be configured. Threads of roles without configuration may run on
+ * all CPUs tvoe was started on.
+ */
+enum affinity_role {
+	AFFINITY_MAIN,		/**< Event loop: dvr input, remuxing and client output */
+	AFFINITY_TUNE,		/**< Frontend worker (tuning, opening devices) */
+	AFFINITY_WORKER,	/**< Background threads: logging, disk writers */
+	AFFINITY_ROLES
+};
+
+/**
+ * Set the CPUs of a role. Called by the config parser.
+ * @param cpus List of CPUs and NUMA nodes, e.g. "0-3,8" or "node1"
+ * @return false if the list is invalid
+ */
+bool affinity_set(enum affinity_role role, const char *cpus);
+/**
+ * Remember the initial CPU set and pin the calling (main) thread. Has to be
+ * called before any other thread is started.
+ */
+void affinity_init(void);
+/**
+ * Apply the CPUs of a role to the calling thread and register it for the
+ * placement report
+ */
+void affinity_thread(enum affinity_role role, const char *name);
+/**
+ * Unregister the calling thread, has to be called before it exits
+ */
+void affinity_thread_exit(void);
+/**
+ * Find the NUMA node of a device in sysfs, e.g. "/sys/class/dvb/dvb0.frontend0"
+ * @return Node number, -1 if unknown (or the system is not NUMA)
+ */
+int affinity_device_node(const char *path);
+/**
+ * Allocate memory on a NUMA node. The memory is never freed.
+ * @param node Preferred node, -1 for no preference
+ * @return NULL on failure
+ */
+void *affinity_alloc(size_t size, int node);
+/**
+ * @return NUMA node memory at addr is located on, -1 if unknown
+ */
+int affinity_memory_node(const void *addr);
+
+/**
+ * Send a (HTML-formatted) list of threads and their actual placement
+ */
+void send_thread_placement(function<void(string)> sendfn);
+
+#endif
@@ -0,0 +1,275 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include "capture.h"
+#include "log.h"
+#include "affinity.h"
+
+/*
+ * Raw frontend captures: The dvr callback only copies the data read into the
+ * current block and appends a record to its index. Full blocks are handed to
+ * a writer thread per capture. As for recordings, every capture has a fixed
+ * pool of blocks and drops data if the disk is too slow, so capturing never
+ * delays the event loop (which would change the data being captured). Drops
+ * are marked in the index.
+ */
+
+/* Size of the data part of a block */
+#define CAPTURE_BLOCK (1024 * 1024)
+/* Maximum number of index records per block */
+#define CAPTURE_RECORDS 8192
+/* Number of blocks per capture */
+#define CAPTURE_BLOCKS 32
+
+struct block {
+	uint8_t *data;
+	size_t len;
+	struct capture_record *records;
+	int n;
+};
+
+/* Marks the end of the capture in the queue of full blocks */
+static struct block finish;
+
+struct capture {
+	char path[512];			/**< Path without extension */
+	uint64_t limit;
+	int64_t start;			/**< Start time (real time, us) */
+	int64_t last;			/**< Time of the last record (monotonic, us) */
+	struct block *cur;
+	GAsyncQueue *full, *empty;
+	uint64_t received;		/**< Bytes read from the dvr device */
+	uint64_t dropped;		/**< Bytes dropped because no block was free */
+	bool dropping;			/**< Drop record pending */
+
+	/* Shared with the writer thread, protected by lock */
+	GMutex lock;
+	uint64_t written;
+	bool write_error;
+};
+
+static char *directory;
+/* Number of running writer threads, protected by writers_lock */
+static int writers;
+static GMutex writers_lock;
+static GCond writers_done;
+
+/************** Called in the writer threads ***************/
+
+static bool write_all(int fd, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *) data;
+	while(len) {
+		ssize_t ret = write(fd, p, len);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static int open_file(struct capture *c, const char *ext) {
+	char path[520];
+	snprintf(path, sizeof(path), "%s.%s", c->path, ext);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		logger(LOG_ERR, "[capture] Unable to open %s: %s", path, strerror(errno));
+	return fd;
+}
+
+static gpointer capture_writer(gpointer p) {
+	struct capture *c = (struct capture *) p;
+	affinity_thread(AFFINITY_WORKER, "capture_writer");
+	int data_fd = open_file(c, "ts"), index_fd = open_file(c, "idx");
+	bool ok = data_fd >= 0 && index_fd >= 0;
+	if(ok) {
+		int64_t start = c->start;
+		ok = write_all(index_fd, CAPTURE_MAGIC, 8) &&
+			write_all(index_fd, &start, sizeof(start));
+	}
+	for(;;) {
+		struct block *b = (struct block *) g_async_queue_pop(c->full);
+		if(b == &finish)
+			break;
+		if(ok) {
+			ok = write_all(data_fd, b->data, b->len) &&
+				write_all(index_fd, b->records, b->n * sizeof(struct capture_record));
+			if(!ok)
+				logger(LOG_ERR, "[capture] Write to %s failed: %s", c->path, strerror(errno));
+		}
+		g_mutex_lock(&c->lock);
+		if(ok)
+			c->written += b->len;
+		else
+			c->write_error = true;
+		g_mutex_unlock(&c->lock);
+		b->len = 0;
+		b->n = 0;
+		g_async_queue_push(c->empty, b);
+	}
+
+	if(data_fd >= 0)
+		close(data_fd);
+	if(index_fd >= 0)
+		close(index_fd);
+	for(int i = 0; i < CAPTURE_BLOCKS; i++) {
+		struct block *b = (struct block *) g_async_queue_pop(c->empty);
+		free(b->data);
+		free(b->records);
+		delete b;
+	}
+	g_async_queue_unref(c->full);
+	g_async_queue_unref(c->empty);
+	logger(LOG_INFO, "[capture] Capture %s closed, %llu bytes written", c->path,
+			(unsigned long long) c->written);
+	g_mutex_clear(&c->lock);
+	delete c;
+	g_mutex_lock(&writers_lock);
+	writers--;
+	g_cond_broadcast(&writers_done);
+	g_mutex_unlock(&writers_lock);
+	affinity_thread_exit();
+	return NULL;
+}
+
+/****************************** Main control flow ************************/
+
+/* Hand the current block to the writer thread */
+static bool push_block(struct capture *c) {
+	g_async_queue_push(c->full, c->cur);
+	c->cur = NULL;
+	g_mutex_lock(&c->lock);
+	bool error = c->write_error;
+	g_mutex_unlock(&c->lock);
+	return !error;
+}
+
+static void add_record(struct capture *c, int64_t now, int32_t len) {
+	int64_t delta = now - c->last;
+	/* Padding records for long gaps, e.g. while the frontend is idle */
+	while(delta > UINT32_MAX && c->cur->n < CAPTURE_RECORDS - 2) {
+		c->cur->records[c->cur->n++] = { UINT32_MAX, 0 };
+		delta -= UINT32_MAX;
+	}
+	c->cur->records[c->cur->n++] = { (uint32_t) MIN(delta, (int64_t) UINT32_MAX), len };
+	c->last = now;
+}
+
+bool capture_input(void *handle, const uint8_t *buf, int len) {
+	struct capture *c = (struct capture *) handle;
+	/* Reads larger than a block are recorded as several reads in a row */
+	for(; len > CAPTURE_BLOCK; buf += CAPTURE_BLOCK, len -= CAPTURE_BLOCK)
+		if(!capture_input(handle, buf, CAPTURE_BLOCK))
+			return false;
+	int64_t now = g_get_monotonic_time();
+	size_t need = MAX(len, 0);
+	/* Blocks only contain whole reads, so drops never split a record */
+	if(c->cur && (c->cur->n >= CAPTURE_RECORDS - 2 || c->cur->len + need > CAPTURE_BLOCK)
+			&& !push_block(c))
+		return false;
+	if(!c->cur && !(c->cur = (struct block *) g_async_queue_try_pop(c->empty))) {
+		/* Disk is too slow, all blocks are queued for writing */
+		if(!c->dropping)
+			logger(LOG_NOTICE, "[capture] Disk too slow, dropping data from %s", c->path);
+		c->dropping = true;
+		c->dropped += need;
+		return true;
+	}
+	if(c->dropping) {
+		add_record(c, now, -ENOBUFS);
+		c->dropping = false;
+	}
+	add_record(c, now, len);
+	if(need) {
+		memcpy(c->cur->data + c->cur->len, buf, need);
+		c->cur->len += need;
+		c->received += need;
+	}
+	return !c->limit || c->received < c->limit;
+}
+
+void capture_set_directory(const char *dir) {
+	free(directory);
+	directory = strdup(dir);
+}
+
+void *capture_open(const char *name, uint64_t limit) {
+	if(!directory) {
+		logger(LOG_ERR, "[capture] No capture directory configured");
+		return NULL;
+	}
+	struct capture *c = new struct capture;
+	char date[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+	snprintf(c->path, sizeof(c->path), "%s/capture-%s-%s", directory, name, date);
+	c->limit = limit;
+	c->start = g_get_real_time();
+	c->last = g_get_monotonic_time();
+	c->cur = NULL;
+	c->received = c->dropped = 0;
+	c->dropping = false;
+	g_mutex_init(&c->lock);
+	c->written = 0;
+	c->write_error = false;
+	c->full = g_async_queue_new();
+	c->empty = g_async_queue_new();
+	for(int i = 0; i < CAPTURE_BLOCKS; i++) {
+		struct block *b = new struct block;
+		b->data = (uint8_t *) malloc(CAPTURE_BLOCK);
+		b->records = (struct capture_record *) malloc(CAPTURE_RECORDS * sizeof(struct capture_record));
+		if(!b->data || !b->records) {
+			logger(LOG_ERR, "[capture] Unable to allocate buffers");
+			abort();
+		}
+		b->len = 0;
+		b->n = 0;
+		g_async_queue_push(c->empty, b);
+	}
+	g_mutex_lock(&writers_lock);
+	writers++;
+	g_mutex_unlock(&writers_lock);
+	g_thread_unref(g_thread_new("capture_writer", capture_writer, c));
+	logger(LOG_INFO, "[capture] Capturing to %s", c->path);
+	return c;
+}
+
+void capture_close(void *handle) {
+	struct capture *c = (struct capture *) handle;
+	if(c->cur)
+		g_async_queue_push(c->full, c->cur);
+	c->cur = NULL;
+	if(c->dropped)
+		logger(LOG_NOTICE, "[capture] %llu bytes dropped from %s",
+				(unsigned long long) c->dropped, c->path);
+	/* The writer thread frees the capture */
+	g_async_queue_push(c->full, &finish);
+}
+
+void capture_wait(void) {
+	g_mutex_lock(&writers_lock);
+	while(writers)
+		g_cond_wait(&writers_done, &writers_lock);
+	g_mutex_unlock(&writers_lock);
+}
+
+void capture_describe(void *handle, char *buf, size_t size) {
+	struct capture *c = (struct capture *) handle;
+	g_mutex_lock(&c->lock);
+	uint64_t written = c->written;
+	bool error = c->write_error;
+	g_mutex_unlock(&c->lock);
+	snprintf(buf, size, "capturing to %s.ts: %.1f MB read, %.1f MB written, %.1f MB dropped%s",
+			c->path, c->received / 1e6, written / 1e6, c->dropped / 1e6,
+			error ? ", write error" : "");
+}
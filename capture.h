@@ -0,0 +1,65 @@
+#ifndef __INCLUDED_TVOE_CAPTURE
+#define __INCLUDED_TVOE_CAPTURE
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Raw frontend captures. The data read from the dvr device is written
+ * unmodified to NAME.ts, the result of every read() to NAME.idx:
+ *
+ * Header:  8 bytes magic "TVOECAP1", 8 bytes start time (us since the epoch)
+ * Records: struct capture_record, one per read
+ *
+ * All fields are in host byte order. Replaying the records in order, sleeping
+ * delta us before each one and reading len bytes from NAME.ts (if len > 0),
+ * reproduces the input of mpeg_input() including its timing.
+ */
+#define CAPTURE_MAGIC "TVOECAP1"
+
+struct capture_record {
+	uint32_t delta;		/**< Time since the previous record (in us) */
+	/**
+	 * Number of bytes read, or -errno if the read failed (-EOVERFLOW for
+	 * demuxer buffer overflows, -ETIMEDOUT for dvr timeouts, -ENOBUFS if
+	 * data was dropped from the capture because the disk was too slow).
+	 * 0 for padding records if more than 2^32 us have elapsed.
+	 */
+	int32_t len;
+};
+
+/**
+ * Set the directory captures are written to. Called by the config parser.
+ */
+void capture_set_directory(const char *directory);
+/**
+ * Start a capture
+ * @param name Prefix for the file names
+ * @param limit Stop after this many bytes of data, 0 for no limit
+ * @return Capture handle, NULL on error (e.g. no directory configured)
+ */
+void *capture_open(const char *name, uint64_t limit);
+/**
+ * Record the result of a read on the dvr device. Does not block, the data is
+ * written by a separate thread.
+ * @param handle Handle returned by capture_open()
+ * @param buf Data read, NULL if len <= 0
+ * @param len Number of bytes read, or -errno
+ * @return false if the capture should be closed (limit reached, write error)
+ */
+bool capture_input(void *handle, const uint8_t *buf, int len);
+/**
+ * Stop a capture. The remaining data is written in the background.
+ * @param handle Handle returned by capture_open()
+ */
+void capture_close(void *handle);
+/**
+ * Wait until all closed captures are written completely
+ */
+void capture_wait(void);
+/**
+ * Describe the state of a capture (file name, amount of data) for status pages
+ */
+void capture_describe(void *handle, char *buf, size_t size);
+
+#endif
@@ -1,27 +1,338 @@
 #include <stdio.h>
 #include <errno.h>
+#include <assert.h>
 #include <string.h>
 #include <glib.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <libdvbv5/dvb-file.h>
 #include "channels.h"
+#include "affinity.h"
 #include "log.h"
-#include "http.h"
 #include "mpeg.h"
+#include "tvoe.h"
 
-int parse_channels(const char *file) {
+/*
+ * Channel index: Services can be looked up by SID, by transport stream ID and
+ * SID (SIDs are only unique per transport stream), and by normalized name.
+ * Services on the same transponder share a struct mux, whose number is
+ * stored in struct tune, so the MPEG module can match services to tuned
+ * transponders without comparing tuning parameters.
+ *
+ * On a reload, a new index is built by a separate thread (parsing a large
+ * channel list takes a while) and swapped in by the main thread. Lookups only
+ * read the current index, so the thread can take over the transponder
+ * numbers from it. Transponders keep their numbers, so new clients still
+ * share the frontends tuned to them.
+ */
+
+/* A transponder */
+struct mux {
+	unsigned int id;		/**< Number, see struct tune */
+	struct tune t;			/**< Tuning parameters, sid is 0 */
+	GSList *channels;		/**< Services, in order of the channel list */
+};
+
+struct channel {
+	char *name;
+	char *key;				/**< Normalized name, see normalize() */
+	unsigned int tsid;		/**< Transport stream ID, 0 if unknown */
+	struct tune t;
+	struct mux *mux;
+};
+
+struct channel_index {
+	GHashTable *by_sid;		/**< First service with a SID */
+	GHashTable *by_tsid;	/**< Services by tsid << 16 | sid */
+	GHashTable *by_name;	/**< Services by normalized name */
+	GHashTable *muxes;		/**< Transponders by tuning parameters, see mux_key() */
+	GHashTable *by_freq;	/**< Transponders by frequency (MHz) << 1 | polarization */
+	GSList *mux_list;		/**< Transponders, in order of the channel list */
+	int channels;
+	unsigned int last_id;	/**< Highest transponder number used so far */
+	struct channel_index *prev;	/**< Index replaced by this one, while building it */
+};
+
+static struct channel_index *idx;
+
+/* Configured channel lists, see channels_add() */
+static GSList *channel_files;
+/* Directory for cached channel lists, NULL to disable. Set by config parser */
+char *channels_cache = NULL;
+
+/*
+ * Parsing a large channel list with libdvbv5 takes a while, so the result is
+ * cached in a binary file: A cache_header, the path of the channel list and
+ * a cache_entry for every service, followed by its name. The cache is only
+ * used if the modification time and size of the channel list are unchanged.
+ */
+#define CACHE_MAGIC "tvoech1"
+
+struct cache_header {
+	char magic[8];
+	int64_t mtime, mtime_nsec;
+	int64_t size;
+	uint32_t pathlen;
+	uint32_t count;
+};
+
+struct cache_entry {
+	uint32_t sid, tsid;
+	uint32_t delivery_system, frequency, symbol_rate, inversion, fec, polarization;
+	uint32_t namelen;
+};
+
+/*
+ * Normalize a channel name for lookups: Lower case, every run of spaces and
+ * punctuation is replaced by a single dash, e.g. "Das Erste HD" becomes
+ * "das-erste-hd". Non-ASCII characters are kept as they are.
+ */
+static void normalize(const char *name, char *out, size_t size) {
+	size_t len = 0;
+	for(const char *p = name; *p && len + 1 < size; p++) {
+		unsigned char ch = *p;
+		if(g_ascii_isalnum(ch) || ch >= 0x80)
+			out[len++] = g_ascii_tolower(ch);
+		else if(len && out[len - 1] != '-')
+			out[len++] = '-';
+	}
+	while(len && out[len - 1] == '-')
+		len--;
+	out[len] = 0;
+}
+
+static void mux_key(const struct tune *t, char *buf, size_t size) {
+	snprintf(buf, size, "%u/%u/%u/%d", t->delivery_system, t->dvbs.frequency,
+			t->dvbs.symbol_rate, t->dvbs.polarization);
+}
+
+static unsigned int freq_key(unsigned int mhz, bool polarization) {
+	return mhz << 1 | polarization;
+}
+
+/* Create an index, taking over the transponder numbers of prev (if any) */
+static struct channel_index *index_new(struct channel_index *prev) {
+	struct channel_index *i = new struct channel_index;
+	i->by_sid = g_hash_table_new(g_direct_hash, g_direct_equal);
+	i->by_tsid = g_hash_table_new(g_direct_hash, g_direct_equal);
+	i->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+	i->muxes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	i->by_freq = g_hash_table_new(g_direct_hash, g_direct_equal);
+	i->mux_list = NULL;
+	i->channels = 0;
+	i->last_id = prev ? prev->last_id : 0;
+	i->prev = prev;
+	return i;
+}
+
+static void index_free(struct channel_index *i) {
+	for(GSList *it = i->mux_list; it != NULL; it = g_slist_next(it)) {
+		struct mux *m = (struct mux *) it->data;
+		for(GSList *c_it = m->channels; c_it != NULL; c_it = g_slist_next(c_it)) {
+			struct channel *c = (struct channel *) c_it->data;
+			free(c->name);
+			free(c->key);
+			delete c;
+		}
+		g_slist_free(m->channels);
+		delete m;
+	}
+	g_slist_free(i->mux_list);
+	g_hash_table_destroy(i->by_sid);
+	g_hash_table_destroy(i->by_tsid);
+	g_hash_table_destroy(i->by_name);
+	g_hash_table_destroy(i->muxes);
+	g_hash_table_destroy(i->by_freq);
+	delete i;
+}
+
+/* Add a service to the index, and to its transponder */
+static void index_add(struct channel_index *i, const char *name, unsigned int tsid, struct tune t) {
+	char key[128];
+	mux_key(&t, key, sizeof(key));
+	struct mux *m = (struct mux *) g_hash_table_lookup(i->muxes, key);
+	if(!m) {
+		struct mux *prev = i->prev ? (struct mux *) g_hash_table_lookup(i->prev->muxes, key) : NULL;
+		m = new struct mux;
+		m->id = prev ? prev->id : ++i->last_id;
+		m->t = t;
+		m->t.sid = 0;
+		m->t.transponder = m->id;
+		m->channels = NULL;
+		g_hash_table_insert(i->muxes, g_strdup(key), m);
+		i->mux_list = g_slist_prepend(i->mux_list, m);
+		gpointer fkey = GUINT_TO_POINTER(freq_key(t.dvbs.frequency / 1000, t.dvbs.polarization));
+		if(!g_hash_table_contains(i->by_freq, fkey))
+			g_hash_table_insert(i->by_freq, fkey, m);
+	}
+
+	struct channel *c = new struct channel;
+	c->name = strdup(name ? name : "");
+	normalize(c->name, key, sizeof(key));
+	c->key = strdup(key);
+	c->tsid = tsid;
+	c->t = t;
+	c->t.transponder = m->id;
+	c->mux = m;
+	m->channels = g_slist_prepend(m->channels, c);
+	i->channels++;
+
+	struct channel *other = (struct channel *) g_hash_table_lookup(i->by_sid, GUINT_TO_POINTER(t.sid));
+	if(!other)
+		g_hash_table_insert(i->by_sid, GUINT_TO_POINTER(t.sid), c);
+	else if(other->mux != m)
+		logger(LOG_NOTICE, "Service ID %u is used by \"%s\" and \"%s\" on different transponders, "
+				"/by-sid/%u serves \"%s\"", t.sid, other->name, c->name, t.sid, other->name);
+	if(tsid && !g_hash_table_contains(i->by_tsid, GUINT_TO_POINTER(tsid << 16 | t.sid)))
+		g_hash_table_insert(i->by_tsid, GUINT_TO_POINTER(tsid << 16 | t.sid), c);
+	if(!c->key[0])
+		return;
+	other = (struct channel *) g_hash_table_lookup(i->by_name, c->key);
+	if(!other)
+		g_hash_table_insert(i->by_name, c->key, c);
+	else
+		logger(LOG_NOTICE, "Channel name \"%s\" is used more than once, /by-name/%s serves SID %u",
+				c->name, c->key, other->t.sid);
+}
+
+/*
+ * Put the lists of transponders and services into channel list order, once
+ * all services have been added
+ */
+static void index_finish(struct channel_index *i) {
+	i->mux_list = g_slist_reverse(i->mux_list);
+	for(GSList *it = i->mux_list; it != NULL; it = g_slist_next(it)) {
+		struct mux *m = (struct mux *) it->data;
+		m->channels = g_slist_reverse(m->channels);
+	}
+}
+
+/* Append a service to the contents of a cache file */
+static void cache_append(string *buf, const char *name, unsigned int tsid, const struct tune *t) {
+	struct cache_entry e;
+	e.sid = t->sid;
+	e.tsid = tsid;
+	e.delivery_system = t->delivery_system;
+	e.frequency = t->dvbs.frequency;
+	e.symbol_rate = t->dvbs.symbol_rate;
+	e.inversion = t->dvbs.inversion;
+	e.fec = t->dvbs.fec;
+	e.polarization = t->dvbs.polarization;
+	e.namelen = name ? strlen(name) : 0;
+	buf->append((const char *) &e, sizeof(e));
+	buf->append(name ? name : "", e.namelen);
+}
+
+/* Cache file of a channel list, e.g. "/var/cache/tvoe/_etc_tvoe_channels.conf" */
+static string cache_path(const char *file) {
+	string path = string(channels_cache) + "/" + file;
+	for(size_t i = strlen(channels_cache) + 1; i < path.size(); i++)
+		if(path[i] == '/')
+			path[i] = '_';
+	return path;
+}
+
+/* Import a channel list from its cache file, if it is up to date */
+static bool load_cache(struct channel_index *i, const char *file, const struct stat *st) {
+	string path = cache_path(file);
+	FILE *f = fopen(path.c_str(), "rb");
+	if(!f)
+		return false;
+	string data;
+	char buf[65536];
+	size_t len;
+	while((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, len);
+	fclose(f);
+
+	struct cache_header h;
+	if(data.size() < sizeof(h))
+		return false;
+	memcpy(&h, data.data(), sizeof(h));
+	size_t start = sizeof(h) + h.pathlen, pos = start;
+	if(memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) || h.mtime != st->st_mtim.tv_sec ||
+			h.mtime_nsec != st->st_mtim.tv_nsec || h.size != st->st_size ||
+			pos > data.size() || data.compare(sizeof(h), h.pathlen, file))
+		return false;
+	/* Check the entries before adding any of them */
+	for(uint32_t n = 0; n < h.count; n++) {
+		struct cache_entry e;
+		if(pos + sizeof(e) > data.size())
+			return false;
+		memcpy(&e, data.data() + pos, sizeof(e));
+		pos += sizeof(e) + e.namelen;
+	}
+	if(pos != data.size()) {
+		logger(LOG_NOTICE, "Ignoring invalid channel cache \"%s\"", path.c_str());
+		return false;
+	}
+
+	for(pos = start; pos < data.size(); ) {
+		struct cache_entry e;
+		memcpy(&e, data.data() + pos, sizeof(e));
+		struct tune t;
+		memset(&t, 0, sizeof(t));
+		t.sid = e.sid;
+		t.delivery_system = e.delivery_system;
+		t.dvbs.frequency = e.frequency;
+		t.dvbs.symbol_rate = e.symbol_rate;
+		t.dvbs.inversion = e.inversion;
+		t.dvbs.fec = e.fec;
+		t.dvbs.polarization = e.polarization;
+		index_add(i, data.substr(pos + sizeof(e), e.namelen).c_str(), e.tsid, t);
+		pos += sizeof(e) + e.namelen;
+	}
+	logger(LOG_INFO, "Imported %u channels from \"%s\" (cached in \"%s\")", h.count, file,
+			path.c_str());
+	return true;
+}
+
+/* Write the cache file of a channel list. It is replaced atomically. */
+static void write_cache(const char *file, const struct stat *st, const string &entries, uint32_t count) {
+	string path = cache_path(file), tmp = path + ".tmp";
+	struct cache_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	h.mtime = st->st_mtim.tv_sec;
+	h.mtime_nsec = st->st_mtim.tv_nsec;
+	h.size = st->st_size;
+	h.pathlen = strlen(file);
+	h.count = count;
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if(!f) {
+		logger(LOG_ERR, "Unable to write channel cache \"%s\": %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(file, 1, h.pathlen, f) == h.pathlen &&
+		fwrite(entries.data(), 1, entries.size(), f) == entries.size();
+	ok = fclose(f) == 0 && ok;
+	if(!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+		logger(LOG_ERR, "Unable to write channel cache \"%s\": %s", path.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+	}
+}
+
+/* Import a channel list into an index, from its cache file if possible */
+static int parse_channels(struct channel_index *i, const char *file) {
 	/*
 	 * dvb_read_file() does not provide error reporting beyond
 	 * returning NULL, so let's do some basic sanity checks
 	 * before trying to open the file
 	 */
+	struct stat st;
 	FILE *f = fopen(file, "r");
-	if(!f) {
+	if(!f || fstat(fileno(f), &st) < 0) {
 		logger(LOG_ERR, "Unable to open channels/zap file \"%s\": %s",
-			strerror(errno));
+			file, strerror(errno));
+		if(f)
+			fclose(f);
 		return -1;
 	}
 	fclose(f);
+	if(channels_cache && load_cache(i, file, &st))
+		return 0;
 	struct dvb_file *dfile = dvb_read_file(file);
 	if(!dfile) {
 		/* XXX - but we can't do better at the moment. */
@@ -32,6 +343,8 @@ int parse_channels(const char *file) {
 	logger(LOG_INFO, "Parsed channels config (\"%s\"), importing stations", file);
 	struct dvb_entry *cur = dfile->first_entry;
 	int cnt;
+	string entries;
+	uint32_t cached = 0;
 	/*
 	 * Iterate over channels in zap file
 	 */
@@ -76,11 +389,167 @@ int parse_channels(const char *file) {
 					cur->channel);
 			}
 		}
-		http_add_channel(cur->channel, cur->service_id, s);
+		index_add(i, cur->channel, cur->transport_id, s);
+		cache_append(&entries, cur->channel, cur->transport_id, &s);
+		cached++;
 next:
 		cur = cur->next;
 	}
+	dvb_file_free(dfile);
 	logger(LOG_INFO, "Successfully imported channels from \"%s\". "
 		"Added a total of %d channels.", file, cnt);
+	if(channels_cache)
+		write_cache(file, &st, entries, cached);
 	return 0;
 }
+
+void channels_add(const char *file) {
+	channel_files = g_slist_append(channel_files, strdup(file));
+}
+
+void channels_clear(void) {
+	g_slist_free_full(channel_files, free);
+	channel_files = NULL;
+}
+
+/*
+ * Build a new index from the channel lists in files, taking over the transponder
+ * numbers of the current one. Only reads the current index, so it can be
+ * called in a separate thread.
+ * @return New index, NULL if a channel list could not be parsed
+ */
+static struct channel_index *index_build(GSList *files) {
+	struct channel_index *i = index_new(idx);
+	for(GSList *it = files; it != NULL; it = g_slist_next(it)) {
+		/* Several channel lists can be configured, they share the index */
+		if(parse_channels(i, (const char *) it->data) < 0) {
+			index_free(i);
+			return NULL;
+		}
+	}
+	index_finish(i);
+	i->prev = NULL;
+	return i;
+}
+
+/* Replace the current index by i. Called in the main thread. */
+static void index_swap(struct channel_index *i) {
+	/* Lookups only return copies of the entries, so the old index can go */
+	if(idx) {
+		logger(LOG_INFO, "Replacing channel index: %d services on %u transponders (was %d on %u)",
+				i->channels, g_hash_table_size(i->muxes), idx->channels,
+				g_hash_table_size(idx->muxes));
+		index_free(idx);
+	}
+	idx = i;
+}
+
+int channels_load(void) {
+	struct channel_index *i = index_build(channel_files);
+	if(!i)
+		return -1;
+	index_swap(i);
+	return 0;
+}
+
+/* Index built in the background, see channels_load_async() */
+struct load_job {
+	GSList *files;				/**< Copy of channel_files */
+	struct channel_index *i;	/**< Result, NULL on failure */
+	void (*done)(int ret, void *ptr);
+	void *ptr;
+};
+
+/* libevent callback: The index has been built, swap it in */
+static void load_done_cb(evutil_socket_t fd, short events, void *p) {
+	struct load_job *j = (struct load_job *) p;
+	if(j->i)
+		index_swap(j->i);
+	g_slist_free_full(j->files, free);
+	j->done(j->i ? 0 : -1, j->ptr);
+	delete j;
+}
+
+static gpointer load_worker(gpointer p) {
+	struct load_job *j = (struct load_job *) p;
+	affinity_thread(AFFINITY_WORKER, "channels");
+	j->i = index_build(j->files);
+	affinity_thread_exit();
+	assert(event_base_once(evbase, -1, EV_TIMEOUT, load_done_cb, j, NULL) != -1);
+	return NULL;
+}
+
+void channels_load_async(void (*done)(int ret, void *ptr), void *ptr) {
+	struct load_job *j = new struct load_job;
+	j->files = NULL;
+	for(GSList *it = channel_files; it != NULL; it = g_slist_next(it))
+		j->files = g_slist_append(j->files, strdup((const char *) it->data));
+	j->i = NULL;
+	j->done = done;
+	j->ptr = ptr;
+	g_thread_unref(g_thread_new("channels", load_worker, j));
+}
+
+bool channel_find_sid(unsigned int sid, struct tune *t) {
+	struct channel *c = idx ? (struct channel *) g_hash_table_lookup(idx->by_sid,
+			GUINT_TO_POINTER(sid)) : NULL;
+	if(c)
+		*t = c->t;
+	return c != NULL;
+}
+
+bool channel_find_tsid(unsigned int tsid, unsigned int sid, struct tune *t) {
+	struct channel *c = idx && tsid <= 0xffff ? (struct channel *) g_hash_table_lookup(
+			idx->by_tsid, GUINT_TO_POINTER(tsid << 16 | sid)) : NULL;
+	if(c)
+		*t = c->t;
+	return c != NULL;
+}
+
+bool channel_find_name(const char *name, struct tune *t) {
+	char key[128];
+	normalize(name, key, sizeof(key));
+	struct channel *c = idx ? (struct channel *) g_hash_table_lookup(idx->by_name, key) : NULL;
+	if(c)
+		*t = c->t;
+	return c != NULL;
+}
+
+bool channel_find_transponder(const char *spec, struct tune *t) {
+	unsigned int freq;
+	char pol;
+	if(sscanf(spec, "%u%c", &freq, &pol) != 2 || (pol != 'h' && pol != 'v') || !idx)
+		return false;
+	struct mux *m = (struct mux *) g_hash_table_lookup(idx->by_freq,
+			GUINT_TO_POINTER(freq_key(freq, pol == 'h')));
+	if(m)
+		*t = m->t;
+	return m != NULL;
+}
+
+void send_channel_list(function<void(string)> sendfn) {
+	sendfn(
+		"<!DOCTYPE html>"
+		"<html lang=\"de\">"
+		"<head><title>tvoe channel list</title></head>"
+		"<body>");
+	for(GSList *it = idx ? idx->mux_list : NULL; it != NULL; it = g_slist_next(it)) {
+		struct mux *m = (struct mux *) it->data;
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "<h3>%u MHz %c, %u kS/s (/by-transponder/%u%c)</h3><ul>",
+				m->t.dvbs.frequency / 1000, m->t.dvbs.polarization ? 'h' : 'v',
+				m->t.dvbs.symbol_rate / 1000, m->t.dvbs.frequency / 1000,
+				m->t.dvbs.polarization ? 'h' : 'v');
+		sendfn(buf);
+		for(GSList *c_it = m->channels; c_it != NULL; c_it = g_slist_next(c_it)) {
+			struct channel *c = (struct channel *) c_it->data;
+			gchar *name = g_markup_escape_text(c->name, -1);
+			snprintf(buf, sizeof(buf), "<li> %s: /by-sid/%u, /by-tsid/%u/%u, /by-name/%s",
+					name, c->t.sid, c->tsid, c->t.sid, c->key);
+			g_free(name);
+			sendfn(buf);
+		}
+		sendfn("</ul>");
+	}
+	sendfn("</body></html>");
+}
@@ -1,10 +1,63 @@
 #ifndef __INCLUDED_TVOE_CHANNELS
 #define __INCLUDED_TVOE_CHANNELS
 
+#include "frontend.h"
+
+/**
+ * Add a channel list (channels.conf in "zap" format) to be imported by
+ * channels_load(). Called by the config parser.
+ */
+extern void channels_add(const char *file);
+/**
+ * Forget the configured channel lists, before the configuration is reloaded
+ */
+extern void channels_clear(void);
+/**
+ * Parse the configured channel lists (or load them from the cache, see
+ * channels_cache in the example config file) and build the channel index.
+ * An existing index is only replaced if all lists could be parsed.
+ * @return 0 on success, -1 if a channel list could not be parsed
+ */
+extern int channels_load(void);
+/**
+ * Like channels_load(), but the channel lists are parsed by a separate thread
+ * so the event loop keeps running. The new index is swapped in by the main
+ * thread, which then calls done. Only one load may run at a time, and the
+ * channel lists must not be changed until it is done.
+ * @param done Called in the main thread with the result of the load, see
+ * channels_load()
+ */
+extern void channels_load_async(void (*done)(int ret, void *ptr), void *ptr);
+/**
+ * Look up the tuning parameters of a service by its service ID. If the SID
+ * is used on several transponders, the first one in the channel list is
+ * returned.
+ * @param t Tuning parameters, only valid if true is returned
+ * @return true if the service is known
+ */
+extern bool channel_find_sid(unsigned int sid, struct tune *t);
+/**
+ * Look up the tuning parameters of a service by transport stream ID and
+ * service ID
+ * @return true if the service is known
+ */
+extern bool channel_find_tsid(unsigned int tsid, unsigned int sid, struct tune *t);
+/**
+ * Look up the tuning parameters of a service by name. Case, spaces and
+ * punctuation are ignored, e.g. "das-erste-hd" finds "Das Erste HD".
+ * @return true if the service is known
+ */
+extern bool channel_find_name(const char *name, struct tune *t);
+/**
+ * Look up the tuning parameters of a transponder
+ * @param spec Transponder frequency (in MHz) and polarization, e.g. "11836h"
+ * @param t Tuning parameters, only valid if true is returned
+ * @return true if at least one channel on this transponder is known
+ */
+extern bool channel_find_transponder(const char *spec, struct tune *t);
 /**
- * Parse the channels.conf in "channelsconf" and add the appropriate
- * HTTP callbacks
+ * Send a (HTML-formatted) list of all transponders and their services
  */
-extern int parse_channels(const char *channelsconf);
+extern void send_channel_list(function<void(string)> sendfn);
 
 #endif
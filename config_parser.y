@@ -6,10 +6,17 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <string.h>
 #include "http.h"
 #include "frontend.h"
 #include "channels.h"
+#include "udp.h"
+#include "timeshift.h"
+#include "record.h"
+#include "capture.h"
+#include "affinity.h"
+#include "log.h"
 
 extern FILE *yyin;
 extern int yylineno;
@@ -18,14 +25,50 @@ extern char *logfile;
 extern int use_syslog;
 extern int loglevel;
 extern size_t dmxbuf;
+extern size_t dvr_readsize;
+extern int dvr_buffers;
+extern int flush_size;
+extern int flush_delay;
+extern bool use_io_uring;
 extern int http_port;
+extern char *channels_cache;
+extern bool eit_schedule;
+
+/*
+ * Set while reloading the configuration (see reload_config()). Parse errors
+ * are logged instead of terminating tvoe then, and settings which can only
+ * be changed by a restart (outputs, recordings, listener, threads) are
+ * ignored.
+ */
+bool reloading = false;
+bool parse_failed = false;
 
 /* Temporary variables needed while parsing */
 static struct lnb l;
 static int adapter = -1, frontend = 0;
+static struct {
+	char *group, *transponder;
+	int port, sid, ttl;
+	bool rtp, paced, ondemand;
+} mc = { NULL, NULL, 0, 0, 1, false, false, false };
+static struct {
+	char *directory;
+	int size;
+	bool watched;
+} ts = { NULL, 1024, true };
+static struct {
+	char *name;
+	int sid, duration;
+	time_t start;
+} rec = { NULL, 0, 0, 0 };
 
 void yyerror(const char *str)
 {
+	if(reloading) {
+		logger(LOG_ERR, "Parse error on line %d: %s", yylineno, str);
+		parse_failed = true;
+		return;
+	}
 	fprintf(stderr, "Parse error on line %d: %s\n", yylineno, str);
 	exit(EXIT_FAILURE);
 }
@@ -45,12 +88,17 @@ extern "C" {
 int yywrap(void)
 {
 	fclose(yyin);
+	yyin = NULL;
         return 1;
 }
 
 }
 
 void init_parser() {
+	memset(&l, 0, sizeof(l));
+	adapter = -1;
+	frontend = 0;
+	parse_failed = false;
 }
 
 %}
@@ -64,15 +112,24 @@ void init_parser() {
 %token<text> STRING
 %token<num> NUMBER
 %token<num> YESNO
-%token SEMICOLON HTTPLISTEN FRONTEND ADAPTER LOF1 LOF2 SLOF CHANNELSCONF
-%token LOGFILE USESYSLOG LOGLEVEL CLIENTBUF DMXBUF
+%token SEMICOLON HTTPLISTEN FRONTEND ADAPTER LOF1 LOF2 SLOF CHANNELSCONF CHANNELSCACHE
+%token LOGFILE USESYSLOG LOGLEVEL CLIENTBUF DMXBUF EITSCHEDULE
+%token MULTICAST GROUP PORT SID TRANSPONDER RTP PACED TTL ONDEMAND
+%token TIMESHIFT DIRECTORY SIZE WATCHED
+%token DVRREADSIZE DVRBUFFERS
+%token FLUSHSIZE FLUSHDELAY
+%token IOURING
+%token CPUSMAIN CPUSTUNE CPUSWORKERS
+%token RECORDINGS RECORD START DURATION NAME
+%token CAPTURES
 
 %%
 
 statements: 
 		    | statements statement SEMICOLON;
-statement: http | frontend | channels | logfile | syslog |
-		 loglevel | clientbuf | dmxbuf;
+statement: http | frontend | channels | channelscache | logfile | syslog |
+		 loglevel | clientbuf | dmxbuf | dvrreadsize | dvrbuffers |
+		 flushsize | flushdelay | iouring | cpus | eitschedule | multicast | timeshift | recordings | record | captures;
 
 clientbuf: CLIENTBUF NUMBER {
 	printf("NOTICE: clientbuf size is ignored in newer getstream versions");
@@ -84,6 +141,52 @@ dmxbuf: DMXBUF NUMBER {
 	dmxbuf = $2;
 }
 
+dvrreadsize: DVRREADSIZE NUMBER {
+	if($2 < 188 || $2 % 188)
+		parse_error("dvr read size must be a multiple of 188 bytes");
+	if($2 > DVR_MAX_READSIZE)
+		parse_error("dvr read size must not exceed %d bytes", DVR_MAX_READSIZE);
+	dvr_readsize = $2;
+}
+
+dvrbuffers: DVRBUFFERS NUMBER {
+	if($2 < 0 || $2 > 32)
+		parse_error("Number of dvr buffers must be between 0 and 32");
+	dvr_buffers = $2;
+}
+
+flushsize: FLUSHSIZE NUMBER {
+	if($2 < 0 || $2 > 512)
+		parse_error("HTTP flush size must be between 0 and 512 KB");
+	flush_size = $2 * 1024;
+}
+
+flushdelay: FLUSHDELAY NUMBER {
+	if($2 < 1 || $2 > 1000)
+		parse_error("HTTP flush delay must be between 1 and 1000 ms");
+	flush_delay = $2;
+}
+
+iouring: IOURING YESNO {
+	if(!reloading)
+		use_io_uring = $2;
+}
+
+cpus: CPUSMAIN STRING {
+	if(!reloading && !affinity_set(AFFINITY_MAIN, $2))
+		parse_error("Invalid CPU list %s", $2);
+} | CPUSTUNE STRING {
+	if(!reloading && !affinity_set(AFFINITY_TUNE, $2))
+		parse_error("Invalid CPU list %s", $2);
+} | CPUSWORKERS STRING {
+	if(!reloading && !affinity_set(AFFINITY_WORKER, $2))
+		parse_error("Invalid CPU list %s", $2);
+}
+
+eitschedule: EITSCHEDULE YESNO {
+	eit_schedule = $2;
+}
+
 loglevel: LOGLEVEL NUMBER {
 	loglevel = $2;
 	if(loglevel < 0 || loglevel > 4)
@@ -91,22 +194,27 @@ loglevel: LOGLEVEL NUMBER {
 }
 
 logfile: LOGFILE STRING {
-	logfile = strdup($2);
+	if(!reloading)
+		logfile = strdup($2);
 }
 
 syslog: USESYSLOG YESNO {
-	use_syslog = $2;
+	if(!reloading)
+		use_syslog = $2;
 }
 
 http: HTTPLISTEN NUMBER {
-	http_port = $2;
+	if(!reloading)
+		http_port = $2;
 }
 
 channels: CHANNELSCONF STRING {
-	if(parse_channels($2)) {
-		parse_error("parse_channels() failed");
-		exit(EXIT_FAILURE);
-	}
+	channels_add($2);
+}
+
+channelscache: CHANNELSCACHE STRING {
+	free(channels_cache);
+	channels_cache = strdup($2);
 }
 
 frontend: FRONTEND '{' frontendoptions '}' {
@@ -141,3 +249,115 @@ lof2: LOF2 NUMBER SEMICOLON {
 slof: SLOF NUMBER SEMICOLON {
 	l.slof = $2;
 }
+
+multicast: MULTICAST '{' multicastoptions '}' {
+	if(!mc.group || !mc.port)
+		parse_error("multicast block needs a group and a port");
+	if(!mc.sid == !mc.transponder)
+		parse_error("multicast block needs either a sid or a transponder");
+	if(!reloading && udp_add_output(mc.group, mc.port, mc.sid, mc.transponder, mc.rtp,
+				mc.paced, mc.ttl, mc.ondemand) != 0)
+		parse_error("Unable to add multicast output");
+	free(mc.group);
+	free(mc.transponder);
+	mc.group = mc.transponder = NULL;
+	mc.port = mc.sid = 0;
+	mc.ttl = 1;
+	mc.rtp = mc.paced = mc.ondemand = false;
+}
+multicastoptions: | multicastoptions multicastoption;
+multicastoption: mc_group | mc_port | mc_sid | mc_transponder | mc_rtp | mc_paced |
+			   mc_ttl | mc_ondemand;
+mc_group: GROUP STRING SEMICOLON {
+	mc.group = strdup($2);
+}
+mc_port: PORT NUMBER SEMICOLON {
+	if($2 <= 0 || $2 > 65535)
+		parse_error("Invalid port number %d", $2);
+	mc.port = $2;
+}
+mc_sid: SID NUMBER SEMICOLON {
+	mc.sid = $2;
+}
+mc_transponder: TRANSPONDER STRING SEMICOLON {
+	mc.transponder = strdup($2);
+}
+mc_rtp: RTP YESNO SEMICOLON {
+	mc.rtp = $2;
+}
+mc_paced: PACED YESNO SEMICOLON {
+	mc.paced = $2;
+}
+mc_ttl: TTL NUMBER SEMICOLON {
+	mc.ttl = $2;
+}
+mc_ondemand: ONDEMAND YESNO SEMICOLON {
+	mc.ondemand = $2;
+}
+
+timeshift: TIMESHIFT '{' timeshiftoptions '}' {
+	if(!ts.directory)
+		parse_error("timeshift block needs a directory");
+	if(ts.size <= 0)
+		parse_error("Invalid timeshift size %d", ts.size);
+	if(!reloading)
+		timeshift_configure(ts.directory, ts.size, ts.watched);
+	free(ts.directory);
+	ts.directory = NULL;
+}
+timeshiftoptions: | timeshiftoptions timeshiftoption;
+timeshiftoption: ts_directory | ts_size | ts_watched | ts_sid;
+ts_directory: DIRECTORY STRING SEMICOLON {
+	ts.directory = strdup($2);
+}
+ts_size: SIZE NUMBER SEMICOLON {
+	ts.size = $2;
+}
+ts_watched: WATCHED YESNO SEMICOLON {
+	ts.watched = $2;
+}
+ts_sid: SID NUMBER SEMICOLON {
+	if(!reloading)
+		timeshift_add_service($2);
+}
+
+recordings: RECORDINGS STRING {
+	if(!reloading)
+		record_set_directory($2);
+}
+
+captures: CAPTURES STRING {
+	if(!reloading)
+		capture_set_directory($2);
+}
+
+record: RECORD '{' recordoptions '}' {
+	if(!rec.sid || !rec.name || !rec.start || !rec.duration)
+		parse_error("record block needs a sid, name, start and duration");
+	if(!reloading && record_add(rec.sid, rec.start, rec.duration * 60, rec.name) < 0)
+		parse_error("Invalid recording %s", rec.name);
+	free(rec.name);
+	rec.name = NULL;
+	rec.sid = rec.duration = 0;
+	rec.start = 0;
+}
+recordoptions: | recordoptions recordoption;
+recordoption: rec_sid | rec_name | rec_start | rec_duration;
+rec_sid: SID NUMBER SEMICOLON {
+	rec.sid = $2;
+}
+rec_name: NAME STRING SEMICOLON {
+	rec.name = strdup($2);
+}
+rec_start: START STRING SEMICOLON {
+	struct tm tm;
+	memset(&tm, 0x0, sizeof(tm));
+	char *end = strptime($2, "%Y-%m-%d %H:%M", &tm);
+	if(!end || *end)
+		parse_error("Invalid start time %s, expected YYYY-MM-DD HH:MM", $2);
+	tm.tm_isdst = -1;
+	rec.start = mktime(&tm);
+}
+rec_duration: DURATION NUMBER SEMICOLON {
+	rec.duration = $2;
+}
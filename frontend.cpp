@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/dvb/frontend.h>
 #include <linux/dvb/dmx.h>
 
@@ -22,10 +23,20 @@
 #include "frontend.h"
 #include "log.h"
 #include "mpeg.h"
+#include "capture.h"
+#include "uring.h"
+#include "affinity.h"
 #include "tvoe.h"
 
 /* Size of demux buffer. Set by config parser, 0 means default */
 size_t dmxbuf = 0;
+/* Size of a read on the dvr device (or of a mapped buffer). Set by config parser */
+size_t dvr_readsize = 1024 * 188;
+/*
+ * Number of mmap'ed dvr buffers. 0 (default) means read() is used. Set by
+ * config parser.
+ */
+int dvr_buffers = 0;
 
 static GList *idle_fe, *used_fe;
 /*
@@ -37,6 +48,36 @@ static GMutex queue_lock;
 static void dvr_callback(evutil_socket_t fd, short int flags, void *arg);
 static void fe_open_failed(evutil_socket_t fd, short int flags, void *arg);
 
+/* Maximum number of mmap'ed dvr buffers */
+#define DVR_MAX_BUFFERS 32
+/* Timeout for data on the dvr device (in s) */
+#define DVR_TIMEOUT 3
+
+/* Number of frontends added */
+static int n_frontends;
+/* Configured frontends, probed by frontend_init() */
+static GList *configured_fe;
+/* Frontends added while reloading the configuration, see frontend_reload() */
+static GList *reload_fe;
+static bool started;
+/*
+ * Number of probes still running and of frontends found so far, protected by
+ * probe_lock. probe_done is signalled when either changes.
+ */
+static int probes_running, probes_total, probes_ok;
+/* Handed over frontends which are still being probed, protected by probe_lock */
+static int adopt_pending;
+static GMutex probe_lock;
+static GCond probe_done;
+/*
+ * Number of dvr buffers registered with io_uring, one for each frontend
+ * configured on startup. Frontends added later use read().
+ */
+static int uring_bufs;
+/* Reads still to be stopped by frontend_pause_reads(), and its callback */
+static int pause_pending;
+static void (*pause_done)(void);
+
 enum fe_state {
 	state_idle,			/**< Frontend is currently not in use */
 	state_tuning,		/**< The frontend worker thread has queued tuning the frontend */
@@ -47,6 +88,7 @@ enum fe_state {
 struct frontend {
 	struct tune in;		/**< Associated transponder, if applicable */
 	struct lnb lnb;		/**< Attached LNB */
+	struct lnb conf_lnb;/**< Configured LNB, applied on the next tune */
 	struct {
 		int len;
 		uint8_t caps[32];
@@ -61,6 +103,28 @@ struct frontend {
 	int state;			/**< Frontend currently in use */
 	GMutex lock;		/**< Lock for synchronizing worker thread */
 	const char *name;	/**< Human-readable frontend/demod name */
+	void *capture;		/**< Raw capture of the dvr input, if any (see capture.c) */
+	uint8_t *buf;		/**< Buffer for read() on the dvr file handle */
+	struct {
+		int count;		/**< Number of mapped buffers, 0 if read() is used */
+		uint8_t *data[DVR_MAX_BUFFERS];
+		size_t length[DVR_MAX_BUFFERS];
+	} mmap;
+	uint64_t discontinuities;	/**< Mapped buffers with lost data */
+	int index;			/**< Number of the frontend, for the io_uring buffer */
+	int node;			/**< NUMA node of the adapter, -1 if unknown */
+	bool uring;			/**< dvr reads are done using io_uring */
+	struct uring_op rd;	/**< Current io_uring read */
+	bool reading;		/**< rd is in flight or its completion is processed, protected by lock */
+	bool cancelled;		/**< Frontend is being released, rd is not requeued */
+	bool paused;		/**< rd is not requeued until frontend_resume_reads() */
+	GCond idle;			/**< Signalled when reading is cleared */
+	bool removed;		/**< Removed from the configuration, protected by queue_lock */
+	struct {
+		bool valid;
+		int fe_fd, dmx_fd, dvr_fd;
+		struct tune in;
+	} handover;			/**< Still tuned by the previous process, see frontend_adopt() */
 };
 
 /** Compute program frequency based on transponder frequency
@@ -97,12 +161,102 @@ static GAsyncQueue *work_queue;
 
 /************** Called in the frontend worker threads ***************/
 
+/* Unmap the dvr buffers, if any */
+static void dvr_unmap(struct frontend *fe) {
+	for(int i = 0; i < fe->mmap.count; i++)
+		munmap(fe->mmap.data[i], fe->mmap.length[i]);
+	fe->mmap.count = 0;
+}
+
+/*
+ * Map dvr buffers of the kernel's DVB streaming API, so the data can be
+ * processed in place instead of being copied by read(). Returns false if the
+ * driver (or kernel) does not support this, the caller has to reopen the dvr
+ * device then.
+ */
+static bool dvr_map(struct frontend *fe) {
+#ifdef DMX_REQBUFS
+	struct dmx_requestbuffers req;
+	req.count = MIN(dvr_buffers, DVR_MAX_BUFFERS);
+	req.size = dvr_readsize;
+	if(ioctl(fe->dvr_fd, DMX_REQBUFS, &req) < 0 || req.count == 0) {
+		logger(LOG_INFO, "Frontend %d/%d does not support mmap'ed dvr buffers, using read()",
+				fe->adapter, fe->frontend);
+		return false;
+	}
+	for(unsigned int i = 0; i < req.count && i < DVR_MAX_BUFFERS; i++) {
+		struct dmx_buffer b;
+		memset(&b, 0, sizeof(b));
+		b.index = i;
+		if(ioctl(fe->dvr_fd, DMX_QUERYBUF, &b) < 0)
+			goto err;
+		void *data = mmap(NULL, b.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fe->dvr_fd, b.offset);
+		if(data == MAP_FAILED)
+			goto err;
+		fe->mmap.data[i] = (uint8_t *) data;
+		fe->mmap.length[i] = b.length;
+		fe->mmap.count = i + 1;
+		if(ioctl(fe->dvr_fd, DMX_QBUF, &b) < 0)
+			goto err;
+	}
+	logger(LOG_DEBUG, "Frontend %d/%d: Using %d mmap'ed dvr buffers of %u bytes",
+			fe->adapter, fe->frontend, fe->mmap.count, req.size);
+	return true;
+err:
+	logger(LOG_ERR, "Unable to map dvr buffers of frontend %d/%d: %s, using read()",
+			fe->adapter, fe->frontend, strerror(errno));
+	dvr_unmap(fe);
+#endif
+	return false;
+}
+
+/* Watch the dvr fd using libevent, with a timeout if no data arrives */
+static bool dvr_add_event(struct frontend *fe) {
+	fcntl(fe->dvr_fd, F_SETFL, fcntl(fe->dvr_fd, F_GETFL) | O_NONBLOCK);
+	struct event *ev = event_new(evbase, fe->dvr_fd, EV_READ | EV_PERSIST, dvr_callback, fe);
+	struct timeval tv = { DVR_TIMEOUT, 0 };
+	if(event_add(ev, &tv)) {
+		event_free(ev);
+		return false;
+	}
+	fe->event = ev;
+	return true;
+}
+
+/*
+ * Queue the next io_uring read on the dvr fd. It is cancelled after
+ * DVR_TIMEOUT, like the libevent callback.
+ */
+static bool dvr_submit(struct frontend *fe) {
+	/* io_uring waits for data itself, a non-blocking fd would fail with EAGAIN */
+	fcntl(fe->dvr_fd, F_SETFL, fcntl(fe->dvr_fd, F_GETFL) & ~O_NONBLOCK);
+	g_mutex_lock(&fe->lock);
+	fe->reading = uring_read(&fe->rd, fe->dvr_fd, fe->index, dvr_readsize, DVR_TIMEOUT * 1000);
+	bool ok = fe->reading;
+	g_mutex_unlock(&fe->lock);
+	return ok;
+}
+
+/* Start reading from the dvr fd */
+static bool dvr_start(struct frontend *fe) {
+	/* Read using io_uring, if available (the mapped buffers need DQBUF) */
+	if(fe->index < uring_bufs && !fe->mmap.count) {
+		fe->event = NULL;
+		fe->uring = true;
+		if(dvr_submit(fe))
+			return true;
+		logger(LOG_ERR, "Unable to queue io_uring read on frontend %d/%d, using read()",
+				fe->adapter, fe->frontend);
+		fe->uring = false;
+	}
+	return dvr_add_event(fe);
+}
+
 /*
  * Open frontend descriptors
  */
 static bool open_fe(struct frontend *fe) {
-	struct event *ev;
-	struct timeval tv;
 
 	/* Open frontend, demuxer and DVR output */
 	char path_fe[512], path_dmx[512], path_dvr[512];
@@ -115,26 +269,34 @@ static bool open_fe(struct frontend *fe) {
 		goto dmx_err;
 	if((fe->dvr_fd = open(path_dvr, O_RDONLY | O_NONBLOCK)) < 0)
 		goto dvr_err;
+	if(dvr_buffers && !dvr_map(fe)) {
+		/* The device might be left in streaming mode, start over */
+		close(fe->dvr_fd);
+		if((fe->dvr_fd = open(path_dvr, O_RDONLY | O_NONBLOCK)) < 0)
+			goto dvr_err;
+	}
+	if(!fe->mmap.count && !fe->buf && !(fe->buf = (uint8_t *) affinity_alloc(dvr_readsize, fe->node)))
+		goto buf_err;
 
-	/* Add libevent callback for TS input */
-	ev = event_new(evbase, fe->dvr_fd, EV_READ | EV_PERSIST, dvr_callback, fe);
-	tv = { 3, 0 }; // 3s timeout
-	if(event_add(ev, &tv)) {
+	/* Add libevent callback (or io_uring read) for TS input */
+	if(!dvr_start(fe)) {
 		logger(LOG_ERR, "Adding frontend to libevent failed.");
+		dvr_unmap(fe);
 		close(fe->fe_fd);
 		close(fe->dmx_fd);
 		close(fe->dvr_fd);
 		assert(event_base_once(evbase, -1, EV_TIMEOUT, fe_open_failed, fe, NULL) != -1);
 		return false;
 	}
-	fe->event = ev;
 
 	return true;
 
+buf_err:
+	close(fe->dvr_fd);
 dvr_err:
 	close(fe->dmx_fd);
 dmx_err:
-	close(fe->dvr_fd);
+	close(fe->fe_fd);
 fe_err:
 	logger(LOG_ERR, "Failed to open frontend (%d/%d): %s", fe->adapter,
 			fe->frontend, strerror(errno));
@@ -214,20 +376,32 @@ static bool tune_to_fe(struct frontend *fe) {
 }
 
 static void release_fe(struct frontend *fe) {
+	/* An io_uring read still uses the fd and buffer until it is cancelled */
+	g_mutex_lock(&fe->lock);
+	while(fe->reading)
+		g_cond_wait(&fe->idle, &fe->lock);
+	fe->cancelled = false;
+	fe->paused = false;
+	fe->uring = false;
+	g_mutex_unlock(&fe->lock);
+	dvr_unmap(fe);
 	close(fe->fe_fd);
 	close(fe->dmx_fd);
 	close(fe->dvr_fd);
 	fe->state = state_idle;
 	g_mutex_lock(&queue_lock);
-	idle_fe = g_list_append(idle_fe, fe);
+	if(!fe->removed)
+		idle_fe = g_list_append(idle_fe, fe);
 	g_mutex_unlock(&queue_lock);
-	logger(LOG_INFO, "Released frontend %d/%d", fe->adapter, fe->frontend);
+	logger(LOG_INFO, fe->removed ? "Released frontend %d/%d, removed from the configuration" :
+			"Released frontend %d/%d", fe->adapter, fe->frontend);
 }
 
 /*
  * Frontend worker thread main routine
  */
 static void *tune_worker(void *ptr) {
+	affinity_thread(AFFINITY_TUNE, "tune_worker");
 	for(;;) {
 		struct work *w = (struct work *) g_async_queue_pop(work_queue);
 		struct frontend *fe = w->fe;
@@ -256,19 +430,192 @@ static void *tune_worker(void *ptr) {
 	return NULL;
 }
 
+/*
+ * Query frontend for capabililties and make sure
+ * that it provides a supported delivery subsystem
+ * (DVB-S/S2, currently)
+ */
+static bool probe_fe(struct frontend *fe) {
+	int adapter = fe->adapter, frontend = fe->frontend;
+	char path_fe[512];
+	snprintf(path_fe, sizeof(path_fe), "/dev/dvb/adapter%d/frontend%d", adapter, frontend);
+	int fd = open(path_fe, O_RDONLY);
+	if(fd < 0) {
+		logger(LOG_ERR, "Unable to open frontend adapter%d/frontend%d: %s",
+			adapter, frontend, strerror(errno));
+		return false;
+	}
+	/* Query basic frontend information */
+	struct dvb_frontend_info info;
+	if(ioctl(fd, FE_GET_INFO, &info)) {
+		logger(LOG_ERR, "Unable to query frontend adapter%d/frontend%d information: %s",
+			adapter, frontend, strerror(errno));
+		close(fd);
+		return false;
+	}
+	logger(LOG_DEBUG, "Attaching frontend adapter%d/frontend%d (%s)",
+			adapter, frontend, info.name);
+	/*
+	 * Query delivery subsystems supported
+	 */
+	struct dtv_property prop;
+	struct dtv_properties props = {
+		.num = 1,
+		.props = &prop
+	};
+	prop.cmd = DTV_ENUM_DELSYS;
+	if(ioctl(fd, FE_GET_PROPERTY, &props) < 0) {
+		logger(LOG_ERR, "Unable to query frontend adapter%d/frontend%d for capabilities: %s",
+			adapter, frontend, strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	/* prop.u.buffer now contains a list of supported delivery subsystems */
+	bool known = false;
+	for(unsigned int i = 0; i < prop.u.buffer.len; ++i) {
+		if(prop.u.buffer.data[i] == SYS_DVBS || prop.u.buffer.data[i] == SYS_DVBS2)
+			known = true;
+		logger(LOG_DEBUG, "Frontend adapter%d/frontend%d supports delivery subsystem %d",
+			adapter, frontend, prop.u.buffer.data[i]);
+	}
+	if(!known) {
+		logger(LOG_ERR, "Frontend adapter%d/frontend%d supports %d delivery subsystem, but none of them are supported by tvoe :-/.",
+			adapter, frontend, prop.u.buffer.len);
+		return false;
+	}
+
+	/* Copy list of frontend capabilities */
+	fe->caps.len = prop.u.buffer.len;
+	for(unsigned int i = 0; i < prop.u.buffer.len; ++i)
+		fe->caps.caps[i] = prop.u.buffer.data[i];
+	fe->name = strdup(info.name);
+	logger(LOG_INFO, "Frontend adapter%d/frontend%d (%s) attached",
+			adapter, frontend, info.name);
+	return true;
+}
+
+/*
+ * Probe thread main routine. Slow devices (e.g. USB) may take a while to
+ * open and answer, so every frontend is probed in its own thread and can be
+ * used as soon as it is done.
+ */
+static void *probe_worker(void *ptr) {
+	struct frontend *fe = (struct frontend *) ptr;
+	affinity_thread(AFFINITY_TUNE, "probe");
+	bool ok = probe_fe(fe);
+	g_mutex_lock(&probe_lock);
+	if(ok) {
+		g_mutex_lock(&queue_lock);
+		/* The configuration might have been reloaded in the meantime */
+		if(!fe->removed)
+			idle_fe = g_list_append(idle_fe, fe);
+		g_mutex_unlock(&queue_lock);
+		probes_ok++;
+	}
+	if(fe->handover.valid)
+		adopt_pending--;
+	if(!--probes_running)
+		logger(LOG_INFO, "%d of %d frontends available", probes_ok, probes_total);
+	g_cond_broadcast(&probe_done);
+	g_mutex_unlock(&probe_lock);
+	affinity_thread_exit();
+	return NULL;
+}
+
 /****************************** Main control flow ************************/
 
 void frontend_init(void) {
 	work_queue = g_async_queue_new();
 	g_mutex_init(&queue_lock);
+	/*
+	 * Allocate the dvr buffers on the node of the adapter (the pages are only
+	 * used once the frontend is read from). With io_uring, every frontend
+	 * reads into its own registered buffer.
+	 */
+	struct iovec *iov = new struct iovec[n_frontends];
+	bool complete = true;
+	for(GList *it = g_list_first(configured_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		fe->buf = (uint8_t *) affinity_alloc(dvr_readsize, fe->node);
+		complete = complete && fe->buf;
+		iov[fe->index].iov_base = fe->buf;
+		iov[fe->index].iov_len = dvr_readsize;
+	}
+	if(complete && uring_register_buffers(iov, n_frontends))
+		uring_bufs = n_frontends;
+	delete[] iov;
 	/* Start tuning thread */
 	g_thread_new("tune_worker", tune_worker, NULL);
+
+	/*
+	 * Probe all frontends in parallel. Clients can be served as soon as the
+	 * first one is available, the others are added once they are done.
+	 */
+	g_mutex_init(&probe_lock);
+	g_cond_init(&probe_done);
+	probes_running = probes_total = n_frontends;
+	for(GList *it = g_list_first(configured_fe); it != NULL; it = it->next)
+		if(((struct frontend *) it->data)->handover.valid)
+			adopt_pending++;
+	for(GList *it = g_list_first(configured_fe); it != NULL; it = it->next)
+		g_thread_unref(g_thread_new("probe", probe_worker, it->data));
+	started = true;
+	g_mutex_lock(&probe_lock);
+	/* Frontends handed over by the previous process are needed right away */
+	while((!probes_ok || adopt_pending) && probes_running)
+		g_cond_wait(&probe_done, &probe_lock);
+	if(!probes_ok)
+		logger(LOG_ERR, "No usable frontend found");
+	g_mutex_unlock(&probe_lock);
+}
+
+/* Pass the result of a read on the dvr fd to the capture, if any */
+static void capture_read(struct frontend *fe, const uint8_t *buf, int len) {
+	if(fe->capture && !capture_input(fe->capture, buf, len)) {
+		logger(LOG_INFO, "Capture of frontend %d/%d finished", fe->adapter, fe->frontend);
+		capture_close(fe->capture);
+		fe->capture = NULL;
+	}
+}
+
+/* Process mapped dvr buffers in place and requeue them */
+static void dvr_dequeue(struct frontend *fe) {
+#ifdef DMX_REQBUFS
+	/* Don't starve the other events if data arrives faster than we process it */
+	for(int i = 0; i < fe->mmap.count; i++) {
+		struct dmx_buffer b;
+		memset(&b, 0, sizeof(b));
+		if(ioctl(fe->dvr_fd, DMX_DQBUF, &b) < 0) {
+			if(errno != EAGAIN) {
+				capture_read(fe, NULL, -errno);
+				logger(LOG_ERR, "Unable to dequeue dvr buffer on frontend %d/%d: %s",
+						fe->adapter, fe->frontend, strerror(errno));
+			}
+			return;
+		}
+		if(b.flags & DMX_BUFFER_FLAG_DISCONTINUITY_DETECTED)
+			fe->discontinuities++;
+		/* Don't trust the driver to stay within the buffers we mapped */
+		size_t len = b.index < (unsigned int) fe->mmap.count ?
+			MIN(b.bytesused, MIN(fe->mmap.length[b.index], DVR_MAX_READSIZE)) : 0;
+		if(len) {
+			uint8_t *data = fe->mmap.data[b.index];
+			capture_read(fe, data, len);
+			mpeg_input(fe->mpeg_handle, data, len);
+		}
+		if(ioctl(fe->dvr_fd, DMX_QBUF, &b) < 0) {
+			logger(LOG_ERR, "Unable to requeue dvr buffer on frontend %d/%d: %s",
+					fe->adapter, fe->frontend, strerror(errno));
+			return;
+		}
+	}
+#endif
 }
 
 /* libevent callback for data on dvr fd */
 static void dvr_callback(evutil_socket_t fd, short int flags, void *arg) {
 	struct frontend *fe = (struct frontend *) arg;
-	unsigned char buf[1024 * 188];
 
 	/* We still might get spurious events from disabled frontends */
 	if(fe->state != state_active)
@@ -277,28 +624,135 @@ static void dvr_callback(evutil_socket_t fd, short int flags, void *arg) {
 	if(flags & EV_TIMEOUT) {
 		logger(LOG_ERR, "Timeout reading data from frontend %d/%d", fe->adapter,
 				fe->frontend);
+		capture_read(fe, NULL, -ETIMEDOUT);
 		mpeg_notify_timeout(fe->mpeg_handle);
 		return;
 	}
 
-	int n = read(fd, buf, sizeof(buf));
+	if(fe->mmap.count) {
+		dvr_dequeue(fe);
+		return;
+	}
+
+	int n = read(fd, fe->buf, dvr_readsize);
 	if(n <= 0) {
+		capture_read(fe, NULL, n < 0 ? -errno : 0);
 		logger(LOG_ERR, "Invalid read on frontend %d/%d: %s",
 				fe->adapter, fe->frontend, strerror(errno));
 		return;
 	}
-	mpeg_input(fe->mpeg_handle, buf, n);
+	capture_read(fe, fe->buf, n);
+	mpeg_input(fe->mpeg_handle, fe->buf, n);
+}
+
+/*
+ * io_uring callback: A read on the dvr fd has finished, or was cancelled due
+ * to the timeout or the frontend being released. reading stays set while the
+ * data is processed, so release_fe() does not close the fd in the meantime.
+ */
+static void dvr_uring_cb(void *arg, int res) {
+	struct frontend *fe = (struct frontend *) arg;
+	bool paused = fe->paused;
+
+	/* We might still get data while tuning, drop it */
+	if(!fe->cancelled && fe->state == state_active) {
+		if(res == -ECANCELED) {
+			/* Reads cancelled by frontend_pause_reads() did not time out */
+			if(!paused) {
+				logger(LOG_ERR, "Timeout reading data from frontend %d/%d", fe->adapter,
+						fe->frontend);
+				capture_read(fe, NULL, -ETIMEDOUT);
+				mpeg_notify_timeout(fe->mpeg_handle);
+			}
+		} else if(res <= 0) {
+			capture_read(fe, NULL, res);
+			logger(LOG_ERR, "Invalid read on frontend %d/%d: %s",
+					fe->adapter, fe->frontend, strerror(-res));
+		} else {
+			capture_read(fe, fe->buf, res);
+			mpeg_input(fe->mpeg_handle, fe->buf, res);
+		}
+	}
+
+	/* Processing the data (or the timeout) may have released the frontend */
+	if(!fe->cancelled && !paused) {
+		if(dvr_submit(fe))
+			return;
+		logger(LOG_ERR, "Unable to queue io_uring read on frontend %d/%d, using read()",
+				fe->adapter, fe->frontend);
+		fe->uring = false;
+		if(!dvr_add_event(fe))
+			logger(LOG_ERR, "Adding frontend to libevent failed.");
+		return;
+	}
+	g_mutex_lock(&fe->lock);
+	fe->reading = false;
+	g_cond_broadcast(&fe->idle);
+	g_mutex_unlock(&fe->lock);
+	if(paused && !--pause_pending && pause_done) {
+		void (*done)(void) = pause_done;
+		pause_done = NULL;
+		done();
+	}
+}
+
+static bool same_transponder(const struct tune *a, const struct tune *b) {
+	return a->delivery_system == b->delivery_system &&
+		a->dvbs.frequency == b->dvbs.frequency &&
+		a->dvbs.symbol_rate == b->dvbs.symbol_rate &&
+		a->dvbs.polarization == b->dvbs.polarization;
+}
+
+/*
+ * Continue using a frontend handed over by the previous process, it is still
+ * tuned to the transponder. Called with queue_lock held.
+ */
+static struct frontend *resume_fe(struct tune s, void *ptr) {
+	GList *it = g_list_first(idle_fe);
+	while(it != NULL && !(((struct frontend *) it->data)->handover.valid &&
+				same_transponder(&((struct frontend *) it->data)->handover.in, &s)))
+		it = it->next;
+	if(!it)
+		return NULL;
+	struct frontend *fe = (struct frontend *) (it->data);
+	fe->fe_fd = fe->handover.fe_fd;
+	fe->dmx_fd = fe->handover.dmx_fd;
+	fe->dvr_fd = fe->handover.dvr_fd;
+	fe->handover.valid = false;
+	fe->in = s;
+	fe->lnb = fe->conf_lnb;
+	fe->mpeg_handle = ptr;
+	fe->event = NULL;
+	fe->state = state_active;
+	if(!dvr_start(fe)) {
+		logger(LOG_ERR, "Unable to resume frontend %d/%d, retuning", fe->adapter, fe->frontend);
+		close(fe->fe_fd);
+		close(fe->dmx_fd);
+		close(fe->dvr_fd);
+		fe->state = state_idle;
+		return NULL;
+	}
+	idle_fe = g_list_remove(idle_fe, fe);
+	used_fe = g_list_append(used_fe, fe);
+	logger(LOG_INFO, "Resumed frontend %d/%d", fe->adapter, fe->frontend);
+	return fe;
 }
 
 /* Tune to a new, previously unknown transponder */
 void *frontend_acquire(struct tune s, void *ptr) {
 	// Get new idle frontend from queue
 	g_mutex_lock(&queue_lock);
+	struct frontend *resumed = resume_fe(s, ptr);
+	if(resumed) {
+		g_mutex_unlock(&queue_lock);
+		return resumed;
+	}
 	GList *it = g_list_first(idle_fe);
 	bool found = false;
 	while(it != NULL && found == false) {
 		struct frontend *fe = (struct frontend *) (it->data);
-		for(int i = 0; i < fe->caps.len; ++i)
+		/* Still tuned by the previous process, see frontend_adopt_done() */
+		for(int i = 0; i < fe->caps.len && !fe->handover.valid; ++i)
 			if(fe->caps.caps[i] == s.delivery_system)
 				found = true;
 		if(!found)
@@ -314,6 +768,7 @@ void *frontend_acquire(struct tune s, void *ptr) {
 
 	struct frontend *fe = (struct frontend *) (it->data);
 	fe->in = s;
+	fe->lnb = fe->conf_lnb;
 	fe->mpeg_handle = ptr;
 	fe->event = NULL;
 
@@ -351,6 +806,16 @@ void frontend_release(void *ptr) {
 	if(fe->event != NULL) {
 		event_del(fe->event);
 		event_free(fe->event);
+		fe->event = NULL;
+	}
+	/* The read is not requeued, release_fe() waits for it to finish */
+	if(fe->uring) {
+		g_mutex_lock(&fe->lock);
+		fe->cancelled = true;
+		bool reading = fe->reading;
+		g_mutex_unlock(&fe->lock);
+		if(reading)
+			uring_cancel(&fe->rd);
 	}
 
 	used_fe = g_list_remove(used_fe, fe);
@@ -371,73 +836,244 @@ static void fe_open_failed(evutil_socket_t fd, short int flags, void *arg) {
 }
 
 int frontend_add(int adapter, int frontend, struct lnb l) {
-	/*
-	 * Query frontend for capabililties and make sure
-	 * that it provides a supported delivery subsystem
-	 * (DVB-S/S2, currently)
-	 */
-	char path_fe[512];
-	snprintf(path_fe, sizeof(path_fe), "/dev/dvb/adapter%d/frontend%d", adapter, frontend);
-	int fd = open(path_fe, O_RDONLY);
-	if(fd < 0) {
-		logger(LOG_ERR, "Unable to open frontend adapter%d/frontend%d: %s",
-			adapter, frontend, strerror(errno));
-		return -1;
+	struct frontend *fe = new struct frontend;
+	fe->caps.len = 0;
+	fe->lnb = fe->conf_lnb = l;
+	fe->adapter = adapter;
+	fe->frontend = frontend;
+	fe->state = state_idle;
+	fe->capture = NULL;
+	fe->buf = NULL;
+	fe->mmap.count = 0;
+	fe->discontinuities = 0;
+	fe->index = n_frontends++;
+	char path[512];
+	snprintf(path, sizeof(path), "/sys/class/dvb/dvb%d.frontend%d", adapter, frontend);
+	if((fe->node = affinity_device_node(path)) >= 0)
+		logger(LOG_DEBUG, "Frontend adapter%d/frontend%d is attached to NUMA node %d",
+				adapter, frontend, fe->node);
+	fe->uring = fe->reading = fe->cancelled = fe->paused = false;
+	fe->rd.cb = dvr_uring_cb;
+	fe->rd.arg = fe;
+	g_mutex_init(&fe->lock);
+	g_cond_init(&fe->idle);
+	fe->name = "";
+	fe->removed = false;
+	fe->handover.valid = false;
+	if(started)
+		reload_fe = g_list_append(reload_fe, fe);
+	else
+		configured_fe = g_list_append(configured_fe, fe);
+	return 0;
+}
+
+/* Free a frontend which has never been probed */
+static void frontend_free(struct frontend *fe) {
+	g_mutex_clear(&fe->lock);
+	g_cond_clear(&fe->idle);
+	delete fe;
+}
+
+/*
+ * Remove a frontend from the configuration. Idle frontends are dropped
+ * immediately, busy ones once their clients are gone (see release_fe()). The
+ * frontend is not freed, the worker threads might still use it.
+ */
+static void frontend_remove(struct frontend *fe) {
+	configured_fe = g_list_remove(configured_fe, fe);
+	g_mutex_lock(&queue_lock);
+	fe->removed = true;
+	bool idle = g_list_find(idle_fe, fe) != NULL;
+	idle_fe = g_list_remove(idle_fe, fe);
+	g_mutex_unlock(&queue_lock);
+	if(fe->capture) {
+		capture_close(fe->capture);
+		fe->capture = NULL;
 	}
-	/* Query basic frontend information */
-	struct dvb_frontend_info info;
-	if(ioctl(fd, FE_GET_INFO, &info)) {
-		logger(LOG_ERR, "Unable to query frontend adapter%d/frontend%d information: %s",
-			adapter, frontend, strerror(errno));
-		close(fd);
-		return -1;
+	if(g_list_find(used_fe, fe))
+		logger(LOG_INFO, "Frontend %d/%d removed from the configuration, dropping it once it is idle",
+				fe->adapter, fe->frontend);
+	else
+		logger(LOG_INFO, "Frontend %d/%d removed from the configuration%s", fe->adapter,
+				fe->frontend, idle ? "" : " (not available)");
+}
+
+void frontend_reload(bool apply) {
+	GList *added = reload_fe;
+	reload_fe = NULL;
+	if(!apply) {
+		for(GList *it = g_list_first(added); it != NULL; it = it->next)
+			frontend_free((struct frontend *) it->data);
+		g_list_free(added);
+		return;
 	}
-	logger(LOG_DEBUG, "Attaching frontend adapter%d/frontend%d (%s)",
-			adapter, frontend, info.name);
-	/*
-	 * Query delivery subsystems supported
-	 */
-	struct dtv_property prop;
-	struct dtv_properties props = {
-		.num = 1,
-		.props = &prop
-	};
-	prop.cmd = DTV_ENUM_DELSYS;
-	if(ioctl(fd, FE_GET_PROPERTY, &props) < 0) {
-		logger(LOG_ERR, "Unable to query frontend adapter%d/frontend%d for capabilities: %s",
-			adapter, frontend, strerror(errno));
-		close(fd);
-		return -1;
+
+	/* Keep frontends which are still configured, update their LNB */
+	for(GList *it = g_list_first(configured_fe); it != NULL; ) {
+		struct frontend *fe = (struct frontend *) it->data;
+		it = it->next;
+		GList *match = g_list_first(added);
+		while(match && (((struct frontend *) match->data)->adapter != fe->adapter ||
+					((struct frontend *) match->data)->frontend != fe->frontend))
+			match = match->next;
+		if(!match) {
+			frontend_remove(fe);
+			continue;
+		}
+		struct frontend *conf = (struct frontend *) match->data;
+		fe->conf_lnb = conf->conf_lnb;
+		added = g_list_delete_link(added, match);
+		frontend_free(conf);
 	}
-	close(fd);
-	/* prop.u.buffer now contains a list of supported delivery subsystems */
-	bool known = false;
-	for(unsigned int i = 0; i < prop.u.buffer.len; ++i) {
-		if(prop.u.buffer.data[i] == SYS_DVBS || prop.u.buffer.data[i] == SYS_DVBS2)
-			known = true;
-		logger(LOG_DEBUG, "Frontend adapter%d/frontend%d supports delivery subsystem %d",
-			adapter, frontend, prop.u.buffer.data[i]);
+
+	/* Probe new frontends in the background */
+	for(GList *it = g_list_first(added); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) it->data;
+		logger(LOG_INFO, "Frontend %d/%d added to the configuration", fe->adapter, fe->frontend);
+		configured_fe = g_list_append(configured_fe, fe);
+		g_mutex_lock(&probe_lock);
+		probes_running++;
+		probes_total++;
+		g_mutex_unlock(&probe_lock);
+		g_thread_unref(g_thread_new("probe", probe_worker, fe));
 	}
-	if(!known) {
-		logger(LOG_ERR, "Frontend adapter%d/frontend%d supports %d delivery subsystem, but none of them are supported by tvoe :-/.",
-			adapter, frontend);
-		return -1;
+	g_list_free(added);
+}
+
+/* Find a frontend by its adapter and frontend number in a list */
+static struct frontend *find_frontend(GList *list, int adapter, int frontend) {
+	for(GList *it = g_list_first(list); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		if(fe->adapter == adapter && fe->frontend == frontend)
+			return fe;
 	}
+	return NULL;
+}
 
-	struct frontend *fe = new struct frontend;
-	/* Copy list of frontend capabilities */
-	fe->caps.len = prop.u.buffer.len;
-	for(unsigned int i = 0; i < prop.u.buffer.len; ++i)
-		fe->caps.caps[i] = prop.u.buffer.data[i];
-	fe->lnb = l;
-	fe->adapter = adapter;
-	fe->frontend = frontend;
-	fe->state = state_idle;
-	g_mutex_init(&fe->lock);
-	idle_fe = g_list_append(idle_fe, fe);
-	logger(LOG_INFO, "Frontend adapter%d/frontend%d (%s) attached",
-			adapter, frontend, info.name);
-	fe->name = strdup(info.name);
+void frontend_pause_reads(void (*done)(void)) {
+	pause_pending = 0;
+	pause_done = NULL;
+	for(GList *it = g_list_first(used_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		if(!fe->uring || fe->cancelled || fe->paused)
+			continue;
+		g_mutex_lock(&fe->lock);
+		bool reading = fe->reading;
+		g_mutex_unlock(&fe->lock);
+		if(!reading)
+			continue;
+		/* dvr_uring_cb() does not requeue it, and calls done once all are stopped */
+		fe->paused = true;
+		pause_pending++;
+		uring_cancel(&fe->rd);
+	}
+	if(pause_pending)
+		pause_done = done;
+	else
+		done();
+}
+
+void frontend_resume_reads(void) {
+	for(GList *it = g_list_first(used_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		if(!fe->paused)
+			continue;
+		fe->paused = false;
+		if(fe->cancelled || dvr_submit(fe))
+			continue;
+		logger(LOG_ERR, "Unable to queue io_uring read on frontend %d/%d, using read()",
+				fe->adapter, fe->frontend);
+		fe->uring = false;
+		if(!dvr_add_event(fe))
+			logger(LOG_ERR, "Adding frontend to libevent failed.");
+	}
+}
+
+void frontend_handover(function<void(int adapter, int frontend, const struct tune *t,
+			const int *fds)> fn) {
+	for(GList *it = g_list_first(used_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		/* The state of mapped buffers can not be handed over */
+		if(fe->state != state_active || fe->mmap.count)
+			continue;
+		/*
+		 * A read still in flight (frontend tuned after frontend_pause_reads())
+		 * would take data from the new process
+		 */
+		g_mutex_lock(&fe->lock);
+		bool reading = fe->reading;
+		g_mutex_unlock(&fe->lock);
+		if(reading) {
+			logger(LOG_NOTICE, "Frontend %d/%d is still being read from, not handing it over",
+					fe->adapter, fe->frontend);
+			continue;
+		}
+		int fds[3] = { fe->fe_fd, fe->dmx_fd, fe->dvr_fd };
+		fn(fe->adapter, fe->frontend, &fe->in, fds);
+	}
+}
+
+bool frontend_adopt(int adapter, int frontend, const struct tune *t, const int *fds) {
+	struct frontend *fe = find_frontend(configured_fe, adapter, frontend);
+	if(!fe || fe->handover.valid)
+		return false;
+	fe->handover.valid = true;
+	fe->handover.fe_fd = fds[0];
+	fe->handover.dmx_fd = fds[1];
+	fe->handover.dvr_fd = fds[2];
+	fe->handover.in = *t;
+	return true;
+}
+
+void frontend_adopt_done(void) {
+	g_mutex_lock(&queue_lock);
+	for(GList *it = g_list_first(configured_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		if(!fe->handover.valid)
+			continue;
+		logger(LOG_INFO, "Frontend %d/%d was handed over without clients, closing it",
+				fe->adapter, fe->frontend);
+		close(fe->handover.fe_fd);
+		close(fe->handover.dmx_fd);
+		close(fe->handover.dvr_fd);
+		fe->handover.valid = false;
+	}
+	g_mutex_unlock(&queue_lock);
+}
+
+void frontend_stop_captures(void) {
+	for(GList *it = g_list_first(configured_fe); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		if(fe->capture) {
+			capture_close(fe->capture);
+			fe->capture = NULL;
+		}
+	}
+	capture_wait();
+}
+
+int frontend_capture(int adapter, int frontend, bool start, uint64_t limit) {
+	g_mutex_lock(&queue_lock);
+	struct frontend *fe = find_frontend(idle_fe, adapter, frontend);
+	if(!fe)
+		fe = find_frontend(used_fe, adapter, frontend);
+	g_mutex_unlock(&queue_lock);
+	if(!fe)
+		return -1;
+	if(!start) {
+		if(!fe->capture)
+			return -1;
+		capture_close(fe->capture);
+		fe->capture = NULL;
+		return 0;
+	}
+	if(fe->capture)
+		return -2;
+	char name[32];
+	snprintf(name, sizeof(name), "a%df%d", adapter, frontend);
+	if(!(fe->capture = capture_open(name, limit)))
+		return -3;
+	logger(LOG_INFO, "Capturing frontend %d/%d", adapter, frontend);
 	return 0;
 }
 
@@ -459,6 +1095,10 @@ void send_transponder_list(function<void(string)> sendfn) {
 			snprintf(buf, sizeof(buf), "<li> adapter%d/frontend%d (%s)",
 				fe->adapter, fe->frontend, fe->name);
 			sendfn(buf);
+			if(fe->capture) {
+				capture_describe(fe->capture, buf, sizeof(buf));
+				sendfn(string(", ") + buf);
+			}
 			it = it->next;
 		}
 		g_mutex_unlock(&queue_lock);
@@ -476,6 +1116,26 @@ void send_transponder_list(function<void(string)> sendfn) {
 			snprintf(buf, sizeof(buf), "<li> adapter%d/frontend%d (%s)",
 				fe->adapter, fe->frontend, fe->name);
 			sendfn(buf);
+			if(fe->state == state_active) {
+				uint64_t resyncs, bytes;
+				mpeg_get_resyncs(fe->mpeg_handle, &resyncs, &bytes);
+				snprintf(buf, sizeof(buf), ", %llu TS resyncs (%llu bytes skipped)",
+					(unsigned long long) resyncs, (unsigned long long) bytes);
+				sendfn(buf);
+			}
+			if(fe->state == state_active && fe->uring)
+				sendfn(", io_uring");
+			if(fe->removed)
+				sendfn(", removed once idle");
+			if(fe->state == state_active && fe->mmap.count) {
+				snprintf(buf, sizeof(buf), ", %d mmap'ed dvr buffers, %llu discontinuities",
+					fe->mmap.count, (unsigned long long) fe->discontinuities);
+				sendfn(buf);
+			}
+			if(fe->capture) {
+				capture_describe(fe->capture, buf, sizeof(buf));
+				sendfn(string(", ") + buf);
+			}
 			it = it->next;
 		}
 		g_mutex_unlock(&queue_lock);
@@ -484,3 +1144,29 @@ void send_transponder_list(function<void(string)> sendfn) {
 
 	sendfn("</body></html>");
 }
+
+/* Send a row of the placement table for every frontend of a list */
+static void send_placement(GList *list, function<void(string)> sendfn) {
+	for(GList *it = g_list_first(list); it != NULL; it = it->next) {
+		struct frontend *fe = (struct frontend *) (it->data);
+		const char *input = fe->state != state_active ? "idle" :
+			fe->mmap.count ? "mmap" : fe->uring ? "io_uring" : "read()";
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "<tr><td>adapter%d/frontend%d</td><td>%s</td>"
+				"<td>%d</td><td>%d</td><td>%s</td></tr>",
+				fe->adapter, fe->frontend, fe->name, fe->node,
+				fe->buf ? affinity_memory_node(fe->buf) : -1, input);
+		sendfn(buf);
+	}
+}
+
+void send_frontend_placement(function<void(string)> sendfn) {
+	sendfn("<h3>Frontends</h3>"
+		"<table><tr><th>Frontend</th><th>Name</th><th>Adapter node</th>"
+		"<th>Buffer node</th><th>Input</th></tr>");
+	g_mutex_lock(&queue_lock);
+	send_placement(idle_fe, sendfn);
+	g_mutex_unlock(&queue_lock);
+	send_placement(used_fe, sendfn);
+	sendfn("</table>");
+}
@@ -2,6 +2,7 @@
 #define __INCLUDED_TVOE_FRONTEND
 
 #include <cstdbool>
+#include <cstdint>
 #include <functional>
 #include "tvoe.h"
 
@@ -21,6 +22,8 @@ struct tune {
 	} dvbs;
 	/** Service ID requested */
 	unsigned int sid;
+	/** Number of the transponder in the channel index (see channels.cpp), 0 if unknown */
+	unsigned int transponder;
 //	};
 };
 
@@ -29,6 +32,12 @@ struct lnb {
 	size_t dmxbuf;
 };
 
+/**
+ * Maximum size of a read on the dvr device (5577 packets, just below 1 MB).
+ * Captures and client buffers are sized to take a complete read.
+ */
+#define DVR_MAX_READSIZE (1024 * 1024 / 188 * 188)
+
 /**
  * Tune to a specific transponder. This function selects a new, current unused
  * frontend and tunes to the specified frequency. dvr_callback will be called
@@ -47,15 +56,73 @@ void frontend_release(void *ptr);
 /**
  * Add a new DVB-S frontend on /dev/dvb/adapterX/frontendY, X and Y are
  * specified by the caller, and sets the parameters of the attached LNB.
- * No error handling is performed if the frontend does not exists or is in use,
- * subscribe_to_frontend() will fail at some point then. (This behaviour might
- * change in the future)
+ * The frontend is probed by frontend_init(), it is not used if it does not
+ * exist or does not support DVB-S/S2.
  * @param adapter Adapter number
  * @param frontend Frontend number
+ * @return 0
  */
 int frontend_add(int adapter, int frontend, struct lnb l);
 /**
- * Initialize the frontend management subsystem
+ * Apply or discard the frontends added by the config parser while reloading
+ * the configuration. Frontends which are no longer configured are removed,
+ * busy ones once they are released. New frontends are probed in the
+ * background, the LNB settings of existing ones are used on their next tune.
+ * @param apply Apply (true) or discard (false) the new configuration
+ */
+void frontend_reload(bool apply);
+/**
+ * Stop the io_uring dvr reads before handing the frontends over: Cancels the
+ * reads in flight and calls done (from the event loop, or right away if no
+ * read is in flight) once none of them is requeued anymore. Data read in the
+ * meantime is still processed.
+ */
+void frontend_pause_reads(void (*done)(void));
+/**
+ * Continue the reads stopped by frontend_pause_reads(), if the upgrade failed
+ */
+void frontend_resume_reads(void);
+/**
+ * Pass every tuned frontend to fn, for handing it over to a new process (see
+ * upgrade.h): Its adapter and frontend number, the transponder and the
+ * frontend, demux and dvr file descriptors. Frontends using mapped dvr
+ * buffers are skipped.
+ */
+void frontend_handover(function<void(int adapter, int frontend, const struct tune *t,
+			const int *fds)> fn);
+/**
+ * Take over a frontend tuned by the previous process. Has to be called before
+ * frontend_init(). The frontend is used without retuning by the first client
+ * requesting the transponder.
+ * @param fds Frontend, demux and dvr file descriptors
+ * @return false if the frontend is not configured (the caller closes the fds)
+ */
+bool frontend_adopt(int adapter, int frontend, const struct tune *t, const int *fds);
+/**
+ * Close the frontends taken over which have not been used by any client
+ */
+void frontend_adopt_done(void);
+/**
+ * Stop all captures and wait until their files are written, before exiting
+ */
+void frontend_stop_captures(void);
+/**
+ * Start or stop a raw capture of the dvr input of a frontend (see capture.h).
+ * The capture runs until it is stopped, regardless of the frontend being
+ * tuned or idle in the meantime.
+ * @param adapter Adapter number
+ * @param frontend Frontend number
+ * @param start Start (true) or stop (false) capturing
+ * @param limit Stop after this many bytes, 0 for no limit
+ * @return 0 on success, -1 if there is no such frontend (or capture, if
+ * stopping), -2 if the frontend is already captured, -3 if the capture could
+ * not be started
+ */
+int frontend_capture(int adapter, int frontend, bool start, uint64_t limit);
+/**
+ * Initialize the frontend management subsystem and probe the configured
+ * frontends in the background. Returns as soon as the first frontend is
+ * available (or all of them failed).
  */
 void frontend_init(void);
 
@@ -63,5 +130,10 @@ void frontend_init(void);
  * Send a (HTML-formatted) list of current idle/used transponders
  */
 void send_transponder_list(function<void(string)> sendfn);
+/**
+ * Send a (HTML-formatted) table of the NUMA placement of the frontends and
+ * their dvr buffers
+ */
+void send_frontend_placement(function<void(string)> sendfn);
 
 #endif
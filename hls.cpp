@@ -0,0 +1,420 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <glib.h>
+#include <event.h>
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/psi.h>
+#include "hls.h"
+#include "channels.h"
+#include "mpeg.h"
+#include "log.h"
+#include "tvoe.h"
+
+/*
+ * HLS output: For every service requested via HLS, a segmenter is registered
+ * with the MPEG module like a single HTTP client. It cuts the remuxed service
+ * into segments at video random access points and keeps the most recent ones
+ * in memory. Playlist and segment requests of all viewers are answered from
+ * this cache, so additional viewers do not cost any additional remuxing.
+ *
+ * Each segment starts with the most recent PAT and PMT, so that it can be
+ * decoded on its own. Segments are reference counted: a segment evicted from
+ * the cache stays valid until all HTTP clients have finished sending it.
+ *
+ * Segmenters are stopped if their service has not been requested for
+ * HLS_IDLE_TIMEOUT seconds.
+ */
+
+/* Segments are cut at the first random access point after HLS_SEGMENT_MIN
+ * seconds, but never get longer than HLS_SEGMENT_MAX seconds */
+#define HLS_SEGMENT_MIN 2
+#define HLS_SEGMENT_MAX 6
+/* Maximum segment size, in case the PCR is broken */
+#define HLS_SEGMENT_SIZE (16 * 1024 * 1024)
+/* Number of segments cached per service, and number of them in the playlist.
+ * The older ones are kept for clients that are a bit late. */
+#define HLS_SEGMENTS 6
+#define HLS_PLAYLIST_SEGMENTS 4
+/* Time after which unused segmenters are stopped (in s) */
+#define HLS_IDLE_TIMEOUT 30
+/* Services without any video are cut at audio PES starts if no video
+ * packet is seen within this time after the first PCR (in s) */
+#define HLS_VIDEO_WAIT 1
+
+/* Number of PSI PIDs (PAT and PMT) cached, and maximum packets per table */
+#define HLS_PSI_PIDS 4
+#define HLS_PSI_PACKETS 6
+
+/* PCRs are 33 bits of 90 kHz base plus 9 bits of 27 MHz extension */
+#define PCR_WRAP ((UINT64_C(1) << 33) * 300)
+
+struct hls_segment {
+	int refcount;
+	unsigned int seq;		/**< Media sequence number */
+	double duration;		/**< Duration in seconds, from the PCR */
+	uint8_t *data;
+	size_t len;
+};
+
+/* Last complete table seen on a PSI PID, and the one currently received */
+struct psi_cache {
+	uint16_t pid;
+	uint8_t cur[HLS_PSI_PACKETS * TS_SIZE];
+	int cur_packets, cur_needed;
+	uint8_t last[HLS_PSI_PACKETS * TS_SIZE];
+	int last_packets;
+};
+
+struct hls_stream;
+/* Parked playlist request */
+struct hls_waiter {
+	struct hls_stream *s;
+	void (*cb)(void *, const string *);
+	void *ptr;
+};
+
+struct hls_stream {
+	unsigned int sid;
+	void *mpeg_handle;		/**< Handle returned by mpeg_register() */
+	/** Cached segments, oldest first */
+	struct hls_segment *segments[HLS_SEGMENTS];
+	int n_segments;
+	unsigned int next_seq;
+	/** Segment currently being built, only valid if started is set */
+	uint8_t *buf;
+	size_t len, size;
+	bool started;
+	/** PCR tracking: PID carrying the PCR (-1 if none seen yet), first PCR,
+	 * PCR at the start of the current segment and last PCR */
+	int pcr_pid;
+	uint64_t first_pcr, seg_pcr, last_pcr;
+	bool video_seen;
+	struct psi_cache psi[HLS_PSI_PIDS];
+	int n_psi;
+	/** Parked playlist requests (struct hls_waiter) */
+	GSList *waiters;
+	time_t last_access;
+	struct event *idleev;
+};
+
+/* Active segmenters, indexed by SID */
+static GHashTable *streams;
+
+static void stream_free(struct hls_stream *s);
+
+static time_t now(void) {
+	struct timeval tv;
+	event_base_gettimeofday_cached(evbase, &tv);
+	return tv.tv_sec;
+}
+
+static double pcr_delta(uint64_t from, uint64_t to) {
+	return (double) ((to + PCR_WRAP - from) % PCR_WRAP) / 27000000.0;
+}
+
+void hls_segment_put(void *ref) {
+	struct hls_segment *seg = (struct hls_segment *) ref;
+	if(--seg->refcount)
+		return;
+	free(seg->data);
+	g_slice_free1(sizeof(struct hls_segment), seg);
+}
+
+/* Build the playlist, containing the most recent segments */
+static string build_playlist(struct hls_stream *s) {
+	int first = s->n_segments > HLS_PLAYLIST_SEGMENTS ?
+		s->n_segments - HLS_PLAYLIST_SEGMENTS : 0;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "#EXTM3U\n#EXT-X-VERSION:3\n"
+			"#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%u\n",
+			HLS_SEGMENT_MAX, s->segments[first]->seq);
+	string playlist = buf;
+	for(int i = first; i < s->n_segments; i++) {
+		snprintf(buf, sizeof(buf), "#EXTINF:%.3f,\n%u.ts\n",
+				s->segments[i]->duration, s->segments[i]->seq);
+		playlist += buf;
+	}
+	return playlist;
+}
+
+/* Answer all parked playlist requests, with NULL on failure */
+static void notify_waiters(struct hls_stream *s, const string *playlist) {
+	GSList *waiters = s->waiters;
+	s->waiters = NULL;
+	for(GSList *it = waiters; it != NULL; it = g_slist_next(it)) {
+		struct hls_waiter *w = (struct hls_waiter *) it->data;
+		w->cb(w->ptr, playlist);
+		g_slice_free1(sizeof(struct hls_waiter), w);
+	}
+	g_slist_free(waiters);
+}
+
+/*
+ * Remember the most recent complete table on a PSI PID. The number of
+ * packets of a table is determined from the section length in its first
+ * packet.
+ */
+static void cache_psi(struct hls_stream *s, const uint8_t *pkt) {
+	uint16_t pid = ts_get_pid(pkt);
+	struct psi_cache *p = NULL;
+	for(int i = 0; i < s->n_psi; i++)
+		if(s->psi[i].pid == pid)
+			p = &s->psi[i];
+	if(!p) {
+		if(s->n_psi == HLS_PSI_PIDS)
+			return;
+		p = &s->psi[s->n_psi++];
+		p->pid = pid;
+		p->cur_packets = p->cur_needed = p->last_packets = 0;
+	}
+	if(ts_get_unitstart(pkt)) {
+		const uint8_t *section = ts_section(pkt);
+		size_t offset = section - pkt;
+		if(offset + PSI_HEADER_SIZE > TS_SIZE)
+			return;
+		size_t bytes = offset + PSI_HEADER_SIZE + psi_get_length(section);
+		p->cur_needed = 1;
+		if(bytes > TS_SIZE)
+			p->cur_needed += (bytes - TS_SIZE + TS_SIZE - TS_HEADER_SIZE - 1) /
+				(TS_SIZE - TS_HEADER_SIZE);
+		p->cur_packets = 0;
+		if(p->cur_needed > HLS_PSI_PACKETS) {
+			p->cur_needed = 0;
+			return;
+		}
+	} else if(!p->cur_needed) {
+		return;
+	}
+	memcpy(p->cur + p->cur_packets++ * TS_SIZE, pkt, TS_SIZE);
+	if(p->cur_packets == p->cur_needed) {
+		memcpy(p->last, p->cur, p->cur_packets * TS_SIZE);
+		p->last_packets = p->cur_packets;
+		p->cur_needed = 0;
+	}
+}
+
+/* Check whether a PAT and at least one PMT have been cached */
+static bool psi_ready(struct hls_stream *s) {
+	bool pat = false, pmt = false;
+	for(int i = 0; i < s->n_psi; i++) {
+		if(!s->psi[i].last_packets)
+			continue;
+		if(s->psi[i].pid == 0)
+			pat = true;
+		else
+			pmt = true;
+	}
+	return pat && pmt;
+}
+
+static void segment_append(struct hls_stream *s, const uint8_t *data, size_t len) {
+	if(s->len + len > s->size) {
+		s->size = MAX(s->size * 2, s->len + len);
+		s->buf = (uint8_t *) realloc(s->buf, s->size);
+	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+}
+
+/* Start a new segment with the cached PAT and PMT */
+static void segment_begin(struct hls_stream *s) {
+	s->started = true;
+	s->buf = NULL;
+	s->len = s->size = 0;
+	s->seg_pcr = s->last_pcr;
+	for(int i = 0; i < s->n_psi; i++)
+		if(s->psi[i].pid == 0)
+			segment_append(s, s->psi[i].last, s->psi[i].last_packets * TS_SIZE);
+	for(int i = 0; i < s->n_psi; i++)
+		if(s->psi[i].pid != 0)
+			segment_append(s, s->psi[i].last, s->psi[i].last_packets * TS_SIZE);
+}
+
+/* Move the current segment into the cache, evicting the oldest one */
+static void segment_finish(struct hls_stream *s, double duration) {
+	struct hls_segment *seg = (struct hls_segment *) g_slice_alloc(sizeof(struct hls_segment));
+	seg->refcount = 1;
+	seg->seq = s->next_seq++;
+	seg->duration = duration;
+	seg->data = s->buf;
+	seg->len = s->len;
+	s->buf = NULL;
+	s->started = false;
+
+	if(s->n_segments == HLS_SEGMENTS) {
+		hls_segment_put(s->segments[0]);
+		memmove(s->segments, s->segments + 1, (HLS_SEGMENTS - 1) * sizeof(s->segments[0]));
+		s->n_segments--;
+	}
+	s->segments[s->n_segments++] = seg;
+	logger(LOG_DEBUG, "[HLS %u] Segment %u complete: %.3f s, %zu bytes", s->sid,
+			seg->seq, seg->duration, seg->len);
+
+	if(s->waiters) {
+		string playlist = build_playlist(s);
+		notify_waiters(s, &playlist);
+	}
+}
+
+static void hls_packet(struct hls_stream *s, const uint8_t *pkt) {
+	uint16_t pid = ts_get_pid(pkt);
+	int pid_class = mpeg_get_pid_class(s->mpeg_handle, pid);
+	bool af = ts_has_adaptation(pkt) && ts_get_adaptation(pkt);
+
+	if(pid_class == PID_CLASS_PSI)
+		cache_psi(s, pkt);
+	if(pid_class == PID_CLASS_VIDEO)
+		s->video_seen = true;
+	if(af && tsaf_has_pcr(pkt) && (s->pcr_pid < 0 || pid == s->pcr_pid)) {
+		s->last_pcr = tsaf_get_pcr(pkt) * 300 + tsaf_get_pcrext(pkt);
+		if(s->pcr_pid < 0) {
+			s->pcr_pid = pid;
+			s->first_pcr = s->last_pcr;
+		}
+	}
+
+	/* Segments start at video random access points, or at audio PES starts
+	 * for radio services */
+	bool cut;
+	if(s->video_seen)
+		cut = pid_class == PID_CLASS_VIDEO && ts_get_unitstart(pkt) && af &&
+			tsaf_has_randomaccess(pkt);
+	else
+		cut = pid_class == PID_CLASS_AUDIO && ts_get_unitstart(pkt);
+
+	if(s->started) {
+		double duration = pcr_delta(s->seg_pcr, s->last_pcr);
+		if((cut && duration >= HLS_SEGMENT_MIN) || duration >= HLS_SEGMENT_MAX ||
+				s->len + TS_SIZE > HLS_SEGMENT_SIZE) {
+			segment_finish(s, duration);
+			segment_begin(s);
+		}
+	} else {
+		if(!cut || s->pcr_pid < 0 || !psi_ready(s))
+			return;
+		if(!s->video_seen && pcr_delta(s->first_pcr, s->last_pcr) < HLS_VIDEO_WAIT)
+			return;
+		segment_begin(s);
+	}
+	segment_append(s, pkt, TS_SIZE);
+}
+
+/* Callback for new MPEG-TS data, see mpeg_register() */
+static void hls_input(void *p, const uint8_t *buf, size_t bufsize) {
+	struct hls_stream *s = (struct hls_stream *) p;
+	for(size_t i = 0; i + TS_SIZE <= bufsize; i += TS_SIZE)
+		hls_packet(s, buf + i);
+}
+
+/* Called by the MPEG module if the frontend failed */
+static void hls_timeout(void *p) {
+	struct hls_stream *s = (struct hls_stream *) p;
+	logger(LOG_NOTICE, "[HLS %u] Frontend failed, stopping segmenter", s->sid);
+	stream_free(s);
+}
+
+/* libevent callback: Stop segmenters that are no longer used */
+static void idle_cb(evutil_socket_t fd, short events, void *p) {
+	struct hls_stream *s = (struct hls_stream *) p;
+	if(now() - s->last_access < HLS_IDLE_TIMEOUT || s->waiters)
+		return;
+	logger(LOG_INFO, "[HLS %u] No more viewers, stopping segmenter", s->sid);
+	stream_free(s);
+}
+
+/* Find the segmenter of a service, starting it if start is set */
+static struct hls_stream *stream_get(unsigned int sid, bool start) {
+	if(!streams)
+		streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+	struct hls_stream *s = (struct hls_stream *)
+		g_hash_table_lookup(streams, GINT_TO_POINTER(sid));
+	if(s || !start)
+		return s;
+
+	struct tune t;
+	if(!channel_find_sid(sid, &t)) {
+		logger(LOG_INFO, "[HLS %u] Unknown service", sid);
+		return NULL;
+	}
+	s = (struct hls_stream *) g_slice_alloc(sizeof(struct hls_stream));
+	s->sid = sid;
+	s->n_segments = 0;
+	s->next_seq = 0;
+	s->buf = NULL;
+	s->len = s->size = 0;
+	s->started = false;
+	s->pcr_pid = -1;
+	s->video_seen = false;
+	s->n_psi = 0;
+	s->waiters = NULL;
+	s->last_access = now();
+	s->mpeg_handle = mpeg_register(t, NULL, hls_input, hls_timeout, s);
+	if(!s->mpeg_handle) {
+		logger(LOG_NOTICE, "[HLS %u] Unable to start segmenter: mpeg_register() failed", sid);
+		g_slice_free1(sizeof(struct hls_stream), s);
+		return NULL;
+	}
+	s->idleev = event_new(evbase, -1, EV_PERSIST, idle_cb, s);
+	struct timeval tv = { HLS_IDLE_TIMEOUT / 2, 0 };
+	event_add(s->idleev, &tv);
+	g_hash_table_insert(streams, GINT_TO_POINTER(sid), s);
+	logger(LOG_INFO, "[HLS %u] Segmenter started", sid);
+	return s;
+}
+
+static void stream_free(struct hls_stream *s) {
+	g_hash_table_remove(streams, GINT_TO_POINTER(s->sid));
+	mpeg_unregister(s->mpeg_handle);
+	event_free(s->idleev);
+	notify_waiters(s, NULL);
+	for(int i = 0; i < s->n_segments; i++)
+		hls_segment_put(s->segments[i]);
+	free(s->buf);
+	g_slice_free1(sizeof(struct hls_stream), s);
+}
+
+void *hls_playlist(unsigned int sid, void (*cb)(void *ptr, const string *playlist),
+		void *ptr) {
+	struct hls_stream *s = stream_get(sid, true);
+	if(!s) {
+		cb(ptr, NULL);
+		return NULL;
+	}
+	s->last_access = now();
+	if(s->n_segments) {
+		string playlist = build_playlist(s);
+		cb(ptr, &playlist);
+		return NULL;
+	}
+	struct hls_waiter *w = (struct hls_waiter *) g_slice_alloc(sizeof(struct hls_waiter));
+	w->s = s;
+	w->cb = cb;
+	w->ptr = ptr;
+	s->waiters = g_slist_prepend(s->waiters, w);
+	return w;
+}
+
+void hls_cancel(void *handle) {
+	struct hls_waiter *w = (struct hls_waiter *) handle;
+	w->s->waiters = g_slist_remove(w->s->waiters, w);
+	g_slice_free1(sizeof(struct hls_waiter), w);
+}
+
+void *hls_segment_get(unsigned int sid, unsigned int seq, const uint8_t **data,
+		size_t *len) {
+	struct hls_stream *s = stream_get(sid, false);
+	if(!s)
+		return NULL;
+	s->last_access = now();
+	for(int i = 0; i < s->n_segments; i++) {
+		struct hls_segment *seg = s->segments[i];
+		if(seg->seq != seq)
+			continue;
+		seg->refcount++;
+		*data = seg->data;
+		*len = seg->len;
+		return seg;
+	}
+	return NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef __INCLUDED_TVOE_HLS
+#define __INCLUDED_TVOE_HLS
+
+#include <cstdint>
+#include <cstddef>
+#include "tvoe.h"
+
+/**
+ * Request the HLS playlist of a service, starting its segmenter if
+ * necessary. If a segment is already available, cb is called before this
+ * function returns. Otherwise, the request is parked until the first
+ * segment is complete.
+ * @param sid Service ID
+ * @param cb Called with the playlist, or NULL if the service is unknown or
+ * no tuner is available
+ * @param ptr Argument for cb
+ * @return Handle for hls_cancel() if the request was parked, NULL if cb has
+ * already been called
+ */
+void *hls_playlist(unsigned int sid, void (*cb)(void *ptr, const string *playlist),
+		void *ptr);
+/**
+ * Cancel a parked playlist request, e.g. because the client went away
+ * @param handle Handle returned by hls_playlist()
+ */
+void hls_cancel(void *handle);
+/**
+ * Get a reference to a cached segment. The segment data stays valid until the
+ * reference is dropped using hls_segment_put().
+ * @param sid Service ID
+ * @param seq Media sequence number of the segment
+ * @param data Segment data, only valid if a reference is returned
+ * @param len Segment length in bytes
+ * @return Reference to the segment, NULL if the segment is not cached
+ */
+void *hls_segment_get(unsigned int sid, unsigned int seq, const uint8_t **data,
+		size_t *len);
+/**
+ * Drop a segment reference obtained by hls_segment_get()
+ */
+void hls_segment_put(void *ref);
+
+#endif
@@ -1,5 +1,8 @@
 #include <glib.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <cstring>
 #include <fcntl.h>
 #include <cerrno>
@@ -7,28 +10,67 @@
 #include <event2/http.h>
 #include <unistd.h>
 #include <cassert>
+#include <bitstream/mpeg/ts.h>
 #include "frontend.h"
 #include "log.h"
 #include "mpeg.h"
 #include "http.h"
+#include "udp.h"
+#include "hls.h"
+#include "timeshift.h"
+#include "record.h"
+#include "uring.h"
+#include "affinity.h"
+#include "channels.h"
+#include "upgrade.h"
 #include "tvoe.h"
 
 /* Client buffer size: Set by config parser */
-#define TS_SIZE 188
 #define CLIENTBUF 8192 * TS_SIZE
 
+/*
+ * Overload handling: Above OVERLOAD_HIGH bytes of pending data, auxiliary
+ * packets (EIT, teletext, subtitles) are dropped. If the buffer overflows,
+ * all payload except PSI and PCR is skipped until the next video random
+ * access point (audio packet start for radio services) arrives while the
+ * fill level is below OVERLOAD_LOW.
+ * Clients that stay overloaded for more than OVERLOAD_TIMEOUT seconds are
+ * disconnected.
+ */
+#define OVERLOAD_LOW (CLIENTBUF / 4)
+#define OVERLOAD_HIGH (CLIENTBUF / 2)
+#define OVERLOAD_TIMEOUT 10
+
+/*
+ * Socket tuning: Every PACING_INTERVAL seconds, the socket of a streaming
+ * client is adapted to the measured bitrate of its stream. The kernel paces
+ * the output at PACING_HEADROOM percent above the bitrate (the streams are
+ * VBR), smoothing out the bursts caused by large dvr reads. The send buffer
+ * holds about SNDBUF_TIME ms of data, and at most NOTSENT_TIME ms of unsent
+ * data are queued in the kernel. Everything beyond that stays in our client
+ * buffer, where overload handling applies.
+ */
+#define PACING_INTERVAL 5
+#define PACING_HEADROOM 150
+#define SNDBUF_TIME 500
+#define SNDBUF_MIN (64 * 1024)
+#define NOTSENT_TIME 100
+#define NOTSENT_MIN (16 * 1024)
+
+/*
+ * Write coalescing: Stream data is sent once flush_size bytes are pending, or
+ * flush_delay ms after the first unsent byte was queued, whichever comes
+ * first. This avoids a send() for every few packets at low bitrates. Clients
+ * requesting ?latency=low get every write right away. Set by config parser.
+ */
+int flush_size = 32 * 1024;
+int flush_delay = 20;
+
 /* Handle for the HTTP base used by tvoe */
 //struct evhttp *httpd;
 static struct event httpd;
 static int listenSock;
 
-/* List of served URLs, with member struct */
-struct url {
-	char *text; /* URL to be served */
-	struct tune t;
-};
-static GSList *urls;
-
 struct http_output {
 	struct tune *t;
 	void *handle;
@@ -41,27 +83,70 @@ struct http_client {
 
 	/* For input line reading */
 	int readoff;
-	char buf[512];
+	char buf[HTTP_REQUEST_SIZE];
 
 	char clientname[INET6_ADDRSTRLEN];
+	char url[HTTP_REQUEST_SIZE];	/**< Request URL, replayed after an upgrade */
 	void *mpeg_handle;
+	void *udp_handle;		/**< RTP unicast session, see udp_add_session() */
 	bool timeout;
 	bool shutdown;
 	bool reading;
+	bool resumed;			/**< Handed over by the previous process, see http_resume_client() */
 
 	/* Client output buffer and read/insert position */
 	char writebuf[CLIENTBUF];
 	int cb_inptr, cb_outptr, fill;
+
+	/* Write coalescing, see flush_size */
+	struct event *flushev;	/**< Flush deadline */
+	int flush_size;			/**< Send once this many bytes are pending, 0: immediately */
+	bool lowlatency;		/**< Client requested ?latency=low */
+	bool write_pending;		/**< writeev is added */
+	bool flush_armed;		/**< flushev is added */
+	uint64_t sends;			/**< Send syscalls */
+	uint64_t sent;			/**< Bytes sent */
+
+	/* io_uring, see client_submit() */
+	struct uring_op send_op;
+	bool sending;			/**< send_op is in flight */
+	bool closed;			/**< Terminated while sending, freed by client_sent() */
+
+	/* Overload state */
+	bool skipping;			/**< Waiting for the next video random access point */
+	bool video_seen;		/**< Video packets seen while overloaded, else radio */
+	time_t overload_since;	/**< Start of the current overload period, 0 if none */
+	uint64_t shed;			/**< Auxiliary packets dropped */
+	uint64_t skipped;		/**< Packets dropped while skipping */
+
+	/* Socket tuning */
+	struct event *pacingev;	/**< Periodically adapts the socket to the bitrate */
+	uint64_t bitrate;		/**< Bitrate the socket is tuned for (bit/s) */
+
+	/* HLS */
+	void *hls_wait;			/**< Parked playlist request, see hls_playlist() */
+	const uint8_t *body;	/**< Sent after the buffered data, e.g. a cached segment */
+	size_t body_len, body_off;
+	void *body_ref;			/**< Segment reference, see hls_segment_get() */
+
+	/* Timeshift */
+	void *ts_watch;			/**< Handle returned by timeshift_watch() */
+	void *ts_reader;		/**< Handle returned by timeshift_open() */
 };
 
-void http_add_channel(const char *name, int sid, struct tune t) {
-	char text[128];
-	snprintf(text, sizeof(text), "/by-sid/%d", sid);
-	struct url *u = (struct url *) g_slice_alloc(sizeof(struct url));
-	u->t = t;
-	u->text = strdup(text);
-	urls = g_slist_prepend(urls, u);
-}
+/* List of all connected clients, for the status page */
+static GSList *clients;
+
+/*
+ * Sends in flight (including those of closed clients), and the state of
+ * http_pause_sends(). Sends still in flight after HANDOVER_SEND_WAIT ms are
+ * cancelled, so that a stalled client does not block the upgrade.
+ */
+#define HANDOVER_SEND_WAIT 1000
+static int sends_inflight;
+static bool sends_paused;
+static void (*sends_done)(void);
+static struct event *sends_timer;
 
 static void terminate_client(struct http_client *c) {
 	logger(LOG_INFO, "[%s] Terminating connection", c->clientname);
@@ -69,9 +154,29 @@ static void terminate_client(struct http_client *c) {
 	event_del(c->writeev);
 	event_free(c->readev);
 	event_free(c->writeev);
+	event_free(c->flushev);
+	if(c->pacingev)
+		event_free(c->pacingev);
 	close(c->fd);
 	if(c->mpeg_handle)
 		mpeg_unregister(c->mpeg_handle);
+	if(c->udp_handle)
+		udp_remove_session(c->udp_handle);
+	if(c->hls_wait)
+		hls_cancel(c->hls_wait);
+	if(c->body_ref)
+		hls_segment_put(c->body_ref);
+	if(c->ts_reader)
+		timeshift_close(c->ts_reader);
+	if(c->ts_watch)
+		timeshift_unwatch(c->ts_watch);
+	clients = g_slist_remove(clients, c);
+	/* The kernel might still read from the buffer, see client_sent() */
+	if(c->sending) {
+		c->closed = true;
+		uring_cancel(&c->send_op);
+		return;
+	}
 	g_slice_free1(sizeof(struct http_client), c);
 }
 
@@ -80,19 +185,72 @@ void client_timeout(evutil_socket_t sock, short event, void *p) {
 	terminate_client(c);
 }
 
-static void client_senddata(void *p, const uint8_t *buf, uint16_t bufsize) {
+/* Schedule disconnect of a client in the main control flow */
+static void client_drop(struct http_client *c) {
+	event_base_once(evbase, -1, EV_TIMEOUT, client_timeout, c, NULL);
+	c->timeout = true;
+}
+
+static void client_submit(struct http_client *c);
+
+/*
+ * Wait for the client socket to become writable, then send. With io_uring,
+ * the data is submitted right away instead.
+ */
+static void client_want_write(struct http_client *c) {
+	if(c->flush_armed) {
+		event_del(c->flushev);
+		c->flush_armed = false;
+	}
+	if(uring_active() && c->fill && !c->write_pending) {
+		client_submit(c);
+		return;
+	}
+	if(!c->write_pending) {
+		event_add(c->writeev, NULL);
+		c->write_pending = true;
+	}
+}
+
+/* libevent callback: Flush deadline of a client expired */
+static void client_flush_cb(evutil_socket_t fd, short events, void *p) {
 	struct http_client *c = (struct http_client *) p;
+	c->flush_armed = false;
+	client_want_write(c);
+}
+
+/*
+ * Schedule sending the buffered data: Right away if enough data is pending,
+ * otherwise when the flush deadline expires
+ */
+static void client_schedule(struct http_client *c) {
+	/* Data queued while sending is handled once the send is finished */
+	if(c->write_pending || c->sending)
+		return;
+	if(c->fill >= c->flush_size) {
+		client_want_write(c);
+	} else if(!c->flush_armed) {
+		struct timeval tv = { flush_delay / 1000, (flush_delay % 1000) * 1000 };
+		event_add(c->flushev, &tv);
+		c->flush_armed = true;
+	}
+}
+
+/* Start coalescing writes, once the response header is queued */
+static void client_coalesce(struct http_client *c) {
+	c->flush_size = c->lowlatency ? 0 : flush_size;
+}
+
+/* Insert data into client ringbuffer. */
+static void client_queue(struct http_client *c, const uint8_t *buf, size_t bufsize) {
 	if(c->timeout)
 		return;
-	if(c->fill + bufsize > CLIENTBUF) {
+	if(c->fill + bufsize > (size_t) CLIENTBUF) {
 		logger(LOG_INFO, "[%s] Client buffer overrun, terminating connection", c->clientname);
-		/* Schedule client disconnect in main control flow. */
-		event_base_once(evbase, -1, EV_TIMEOUT, client_timeout, c, NULL);
-		c->timeout = true;
+		client_drop(c);
 		return;
 	}
-	/* Insert data into client ringbuffer */
-	if(CLIENTBUF - c->cb_inptr <= bufsize) {
+	if((size_t) (CLIENTBUF - c->cb_inptr) <= bufsize) {
 		/* Wraparound */
 		int chunk_a = CLIENTBUF - c->cb_inptr;
 		memcpy(c->writebuf + c->cb_inptr, buf, chunk_a);
@@ -105,7 +263,639 @@ static void client_senddata(void *p, const uint8_t *buf, uint16_t bufsize) {
 		c->cb_inptr += bufsize;
 	}
 	c->fill += bufsize;
-	event_add(c->writeev, NULL);
+	client_schedule(c);
+}
+
+/*
+ * Decide whether a single TS packet is forwarded to an overloaded client.
+ * See OVERLOAD_HIGH for the policy.
+ */
+static bool client_admit(struct http_client *c, const uint8_t *pkt) {
+	int pid_class = mpeg_get_pid_class(c->mpeg_handle, ts_get_pid(pkt));
+	bool fits = c->fill + TS_SIZE <= CLIENTBUF;
+
+	if(pid_class == PID_CLASS_VIDEO)
+		c->video_seen = true;
+
+	if(c->skipping) {
+		/* Radio services have no video, every audio frame can be decoded */
+		bool rap;
+		if(c->video_seen)
+			rap = pid_class == PID_CLASS_VIDEO && ts_get_unitstart(pkt) &&
+				ts_has_adaptation(pkt) && ts_get_adaptation(pkt) &&
+				tsaf_has_randomaccess(pkt);
+		else
+			rap = pid_class == PID_CLASS_AUDIO && ts_get_unitstart(pkt);
+		if(rap && c->fill < OVERLOAD_LOW) {
+			logger(LOG_DEBUG, "[%s] Resuming output at random access point", c->clientname);
+			c->skipping = false;
+			c->overload_since = 0;
+			return true;
+		}
+		bool pcr = ts_has_adaptation(pkt) && ts_get_adaptation(pkt) &&
+			tsaf_has_pcr(pkt);
+		if(fits && (pid_class == PID_CLASS_PSI || pcr))
+			return true;
+		c->skipped++;
+		return false;
+	}
+	if(pid_class == PID_CLASS_AUX) {
+		c->shed++;
+		return false;
+	}
+	if(!fits) {
+		logger(LOG_INFO, "[%s] Client buffer overrun, skipping to next random access point",
+				c->clientname);
+		c->skipping = true;
+		c->skipped++;
+		return false;
+	}
+	return true;
+}
+
+static void client_senddata(void *p, const uint8_t *buf, size_t bufsize) {
+	struct http_client *c = (struct http_client *) p;
+	if(c->timeout)
+		return;
+	if(!c->skipping && c->fill + bufsize <= (size_t) OVERLOAD_HIGH) {
+		/* The client has recovered, a new overload period starts from scratch */
+		c->overload_since = 0;
+		client_queue(c, buf, bufsize);
+		return;
+	}
+
+	struct timeval now;
+	event_base_gettimeofday_cached(evbase, &now);
+	if(!c->overload_since)
+		c->overload_since = now.tv_sec;
+	else if(now.tv_sec - c->overload_since > OVERLOAD_TIMEOUT) {
+		logger(LOG_INFO, "[%s] Client is persistently lagging, terminating connection",
+				c->clientname);
+		client_drop(c);
+		return;
+	}
+
+	for(size_t i = 0; i + TS_SIZE <= bufsize; i += TS_SIZE)
+		if(client_admit(c, buf + i))
+			client_queue(c, buf + i, TS_SIZE);
+}
+
+/*
+ * Send a (HTML-formatted) list of connected clients and their overload
+ * counters
+ */
+static void send_client_list(struct http_client *out) {
+	const char *header =
+		"<!DOCTYPE html>"
+		"<html lang=\"de\">"
+		"<head><title>tvoe client list</title></head>"
+		"<body>"
+		"<h3>List of connected clients</h3>"
+		"<table><tr><th>Client</th><th>URL</th><th>Buffered</th>"
+		"<th>Dropped (aux)</th><th>Dropped (skip)</th><th>Bitrate (kbit/s)</th>"
+		"<th>Sent (MB)</th><th>Syscalls/MB</th></tr>";
+	client_queue(out, (const uint8_t *) header, strlen(header));
+	for(GSList *it = clients; it != NULL; it = g_slist_next(it)) {
+		struct http_client *c = (struct http_client *) it->data;
+		char buf[1024];
+		/* The URL is chosen by the client */
+		gchar *url = g_markup_escape_text(c->url, -1);
+		snprintf(buf, sizeof(buf), "<tr><td>%s</td><td>%s</td><td>%d%s</td>"
+				"<td>%llu</td><td>%llu</td><td>%llu</td><td>%.1f</td><td>%.0f</td></tr>",
+				c->clientname, url, c->fill, c->skipping ? " (skipping)" : "",
+				(unsigned long long) c->shed, (unsigned long long) c->skipped,
+				(unsigned long long) c->bitrate / 1000, c->sent / 1e6,
+				c->sent ? c->sends * 1e6 / c->sent : 0.0);
+		g_free(url);
+		client_queue(out, (const uint8_t *) buf, strlen(buf));
+	}
+	const char *footer = "</table></body></html>";
+	client_queue(out, (const uint8_t *) footer, strlen(footer));
+}
+
+/*
+ * Get the value of parameter key from a query string, e.g. "a=1&b=2"
+ * @return true if the parameter is present
+ */
+static bool query_get(const char *query, const char *key, char *buf, size_t size) {
+	size_t keylen = strlen(key);
+	for(const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+		if(strncmp(p, key, keylen) || p[keylen] != '=')
+			continue;
+		snprintf(buf, size, "%.*s", (int) strcspn(p + keylen + 1, "&"), p + keylen + 1);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Parse the query string of a stream request into an elementary stream
+ * filter, e.g. "audio=deu,eng&no-teletext".
+ * @return true if the query requests any stream selection
+ */
+static bool parse_filter(char *query, struct mpeg_filter *f) {
+	char *saveptr, *param;
+	bool filtered = false;
+	memset(f, 0x0, sizeof(struct mpeg_filter));
+	for(param = strtok_r(query, "&", &saveptr); param;
+			param = strtok_r(NULL, "&", &saveptr)) {
+		if(!strncmp(param, "audio=", 6)) {
+			char *saveptr2, *lang;
+			for(lang = strtok_r(param + 6, ",", &saveptr2); lang &&
+					f->n_audio < (int) (sizeof(f->audio) / sizeof(f->audio[0]));
+					lang = strtok_r(NULL, ",", &saveptr2))
+				snprintf(f->audio[f->n_audio++], sizeof(f->audio[0]), "%s", lang);
+			filtered = true;
+		} else if(!strcmp(param, "no-teletext")) {
+			f->no_teletext = filtered = true;
+		} else if(!strcmp(param, "no-subtitles")) {
+			f->no_subtitles = filtered = true;
+		} else if(!strcmp(param, "no-ac3")) {
+			f->no_ac3 = filtered = true;
+		}
+	}
+	return filtered;
+}
+
+/* Decode percent-encoded characters in place, e.g. "Das%20Erste" */
+static void url_decode(char *s) {
+	char *out = s;
+	for(; *s; s++) {
+		unsigned int ch;
+		if(*s == '%' && g_ascii_isxdigit(s[1]) && g_ascii_isxdigit(s[2]) &&
+				sscanf(s + 1, "%2x", &ch) == 1) {
+			*out++ = ch;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = 0;
+}
+
+/*
+ * Look up the service of a single service request, i.e. /by-sid/SID,
+ * /by-tsid/TSID/SID or /by-name/NAME
+ */
+static bool find_channel(char *url, struct tune *t) {
+	unsigned int tsid, sid;
+	int len;
+	if(!strncmp(url, "/by-sid/", 8))
+		return sscanf(url + 8, "%u%n", &sid, &len) == 1 && !url[8 + len] &&
+			channel_find_sid(sid, t);
+	if(!strncmp(url, "/by-tsid/", 9))
+		return sscanf(url + 9, "%u/%u%n", &tsid, &sid, &len) == 2 && !url[9 + len] &&
+			channel_find_tsid(tsid, sid, t);
+	if(!strncmp(url, "/by-name/", 9)) {
+		url_decode(url + 9);
+		return channel_find_name(url + 9, t);
+	}
+	return false;
+}
+
+/*
+ * Look up the services of a /by-sids/ request, e.g. "28106,28107"
+ * @return Number of services found, or -1 if a service is unknown, requested
+ * twice or not on the same transponder as the other ones
+ */
+static int find_services(char *spec, struct tune *t, uint16_t *sids, int max) {
+	char *saveptr, *sid;
+	int n = 0;
+	for(sid = strtok_r(spec, ",", &saveptr); sid; sid = strtok_r(NULL, ",", &saveptr)) {
+		struct tune cur;
+		if(n == max || !channel_find_sid(atoi(sid), &cur) ||
+				(n && cur.transponder != t->transponder))
+			return -1;
+		/* Duplicates would show up twice in the PAT */
+		for(int i = 0; i < n; i++)
+			if(sids[i] == atoi(sid))
+				return -1;
+		*t = cur;
+		sids[n++] = atoi(sid);
+	}
+	return n;
+}
+
+/*
+ * libevent callback: Adapt pacing rate and buffer sizes of the client socket
+ * to the current bitrate of the stream. Only done if the bitrate changed
+ * notably, to avoid needless syscalls.
+ */
+static void client_pacing_cb(evutil_socket_t fd, short events, void *p) {
+	struct http_client *c = (struct http_client *) p;
+	uint64_t rate = mpeg_get_bitrate(c->mpeg_handle);
+	if(!rate || (rate > c->bitrate - c->bitrate / 8 && rate < c->bitrate + c->bitrate / 8))
+		return;
+	c->bitrate = rate;
+	uint64_t bytes = rate / 8;
+#ifdef SO_MAX_PACING_RATE
+	uint64_t pacing = bytes * PACING_HEADROOM / 100;
+	unsigned int pacing_rate = pacing > UINT32_MAX ? UINT32_MAX : pacing;
+	if(setsockopt(c->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate, sizeof(pacing_rate)) < 0)
+		logger(LOG_DEBUG, "[%s] Unable to set pacing rate: %s", c->clientname, strerror(errno));
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = MAX(bytes * NOTSENT_TIME / 1000, NOTSENT_MIN);
+	if(setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+		logger(LOG_DEBUG, "[%s] Unable to set TCP_NOTSENT_LOWAT: %s", c->clientname, strerror(errno));
+#endif
+	int sndbuf = MIN(MAX(bytes * SNDBUF_TIME / 1000, SNDBUF_MIN), CLIENTBUF);
+	if(setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+		logger(LOG_DEBUG, "[%s] Unable to set send buffer size: %s", c->clientname, strerror(errno));
+	logger(LOG_DEBUG, "[%s] Stream bitrate %llu kbit/s, socket tuned", c->clientname,
+			(unsigned long long) rate / 1000);
+}
+
+/*
+ * Finish a stream request: Store the MPEG handle returned by mpeg_register()
+ * and send the appropriate response header
+ */
+static void client_register(struct http_client *c, void *handle) {
+	/* The response has been sent by the previous process */
+	if(c->resumed && !handle) {
+		logger(LOG_NOTICE, "[%s] Unable to resume stream: mpeg_register() failed", c->clientname);
+		client_drop(c);
+		return;
+	}
+	if(!(c->mpeg_handle = handle)) {
+		logger(LOG_NOTICE, "HTTP: Unable to fulfill request: mpeg_register() failed");
+		const char *response = "HTTP/1.1 503 No tuner available to fulfil your request\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+	if(!c->resumed)
+		client_queue(c, (const uint8_t *) response, strlen(response));
+	client_coalesce(c);
+	c->pacingev = event_new(evbase, -1, EV_PERSIST, client_pacing_cb, c);
+	struct timeval tv = { PACING_INTERVAL, 0 };
+	event_add(c->pacingev, &tv);
+}
+
+/* Called if the RTP session of a client failed, see udp_add_session() */
+static void client_session_ended(void *p) {
+	struct http_client *c = (struct http_client *) p;
+	logger(LOG_INFO, "[%s] RTP session ended", c->clientname);
+	if(!c->timeout)
+		client_drop(c);
+}
+
+/* Check whether the client connected from the local host */
+static bool client_local(struct http_client *c) {
+	/* IPv4 clients show up as IPv4-mapped IPv6 addresses */
+	return !strcmp(c->clientname, "::1") || !strncmp(c->clientname, "127.", 4) ||
+		!strncmp(c->clientname, "::ffff:127.", 11);
+}
+
+/* Administrative requests, only accepted from the local host */
+static bool admin_request(const char *url) {
+	return !strcmp(url, "/upgrade") || !strcmp(url, "/reload") ||
+		!strncmp(url, "/capture/", 9) || !strncmp(url, "/record/add", 11) ||
+		!strncmp(url, "/record/stop/", 13) || !strncmp(url, "/multicast/", 11);
+}
+
+/*
+ * Start a paced RTP unicast session for a /rtp/by-sid/ request. The session
+ * lasts as long as the HTTP connection. dest is "host:port", "[host]:port" or
+ * ":port". To avoid being abused for traffic reflection, we only send to the
+ * requesting host.
+ */
+static void client_start_session(struct http_client *c, unsigned int sid,
+		char *dest, const struct mpeg_filter *f) {
+	const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+	char *host = dest, *sep = strrchr(dest, ':');
+	int port = sep ? atoi(sep + 1) : 0;
+	struct tune t;
+	if(sep)
+		*sep = 0;
+	if(*host == '[' && sep && sep[-1] == ']') {
+		host++;
+		sep[-1] = 0;
+	}
+	if(!*host)
+		host = c->clientname;
+	/* IPv4 clients show up as IPv4-mapped IPv6 addresses */
+	bool own = !strcmp(host, c->clientname) || (!strncmp(c->clientname, "::ffff:", 7) &&
+			!strcmp(host, c->clientname + 7));
+	if(port <= 0 || port > 65535) {
+		response = "HTTP/1.1 400 Missing or invalid destination\r\n\r\n";
+	} else if(!own) {
+		logger(LOG_NOTICE, "[%s] Refusing RTP session to foreign host %s", c->clientname, host);
+		response = "HTTP/1.1 403 RTP sessions can only be sent to the requesting host\r\n\r\n";
+	} else if(!channel_find_sid(sid, &t)) {
+		response = "HTTP/1.1 404 Unknown service\r\n\r\n";
+	} else if(!(c->udp_handle = udp_add_session(host, port, sid, f,
+					client_session_ended, c))) {
+		logger(LOG_NOTICE, "HTTP: Unable to fulfill request: udp_add_session() failed");
+		response = "HTTP/1.1 503 No tuner available to fulfil your request\r\n\r\n";
+	}
+	client_queue(c, (const uint8_t *) response, strlen(response));
+	if(!c->udp_handle)
+		c->shutdown = true;
+}
+
+/*
+ * Schedule a recording via the HTTP API. Parameters: sid, duration (in
+ * minutes), name and optionally start (Unix time, default: now).
+ */
+static void client_record(struct http_client *c, const char *query) {
+	char sid[16], duration[16], start[32] = "0", name[64];
+	const char *response = "HTTP/1.1 400 Invalid recording request\r\n\r\n";
+	if(query_get(query, "sid", sid, sizeof(sid)) &&
+			query_get(query, "duration", duration, sizeof(duration)) &&
+			query_get(query, "name", name, sizeof(name))) {
+		query_get(query, "start", start, sizeof(start));
+		int id = record_add(atoi(sid), strtoll(start, NULL, 10), atoi(duration) * 60, name);
+		if(id >= 0) {
+			char buf[64];
+			logger(LOG_INFO, "[%s] Scheduled recording %d", c->clientname, id);
+			snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n\r\n%d\n", id);
+			client_queue(c, (const uint8_t *) buf, strlen(buf));
+			c->shutdown = true;
+			return;
+		}
+		if(id == -2)
+			response = "HTTP/1.1 503 No recording directory configured\r\n\r\n";
+	}
+	client_queue(c, (const uint8_t *) response, strlen(response));
+	c->shutdown = true;
+}
+
+/* Timeshift reader callbacks, see timeshift_open() */
+static void client_timeshift_data(void *p, const uint8_t *buf, size_t bufsize) {
+	client_queue((struct http_client *) p, buf, bufsize);
+}
+static bool client_timeshift_ready(void *p) {
+	struct http_client *c = (struct http_client *) p;
+	return !c->timeout && c->fill < OVERLOAD_LOW;
+}
+
+/* Called by the HLS module with the requested playlist, NULL on failure */
+static void client_playlist_cb(void *p, const string *playlist) {
+	struct http_client *c = (struct http_client *) p;
+	c->hls_wait = NULL;
+	c->shutdown = true;
+	if(!playlist) {
+		const char *response = "HTTP/1.1 503 Service not available\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		return;
+	}
+	char header[256];
+	snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/vnd.apple.mpegurl\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Access-Control-Allow-Origin: *\r\n\r\n", playlist->size());
+	client_queue(c, (const uint8_t *) header, strlen(header));
+	client_queue(c, (const uint8_t *) playlist->c_str(), playlist->size());
+}
+
+/*
+ * Handle an HLS request, path is e.g. "28106/index.m3u8" or "28106/42.ts".
+ * Playlist requests are parked until the first segment is available.
+ * Segments are sent directly from the segment cache.
+ */
+static void client_hls(struct http_client *c, const char *path) {
+	unsigned int sid, seq;
+	char suffix[16];
+	if(sscanf(path, "%u/%15s", &sid, suffix) == 2 && !strcmp(suffix, "index.m3u8")) {
+		c->hls_wait = hls_playlist(sid, client_playlist_cb, c);
+		return;
+	}
+	const uint8_t *data;
+	size_t len;
+	if(sscanf(path, "%u/%u.%15s", &sid, &seq, suffix) == 3 && !strcmp(suffix, "ts") &&
+			(c->body_ref = hls_segment_get(sid, seq, &data, &len))) {
+		char header[256];
+		snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: video/mp2t\r\n"
+				"Content-Length: %zu\r\n"
+				"Access-Control-Allow-Origin: *\r\n\r\n", len);
+		c->body = data;
+		c->body_len = len;
+		c->body_off = 0;
+		client_queue(c, (const uint8_t *) header, strlen(header));
+		c->shutdown = true;
+		return;
+	}
+	const char *response = "HTTP/1.1 404 Not found\r\n\r\n";
+	client_queue(c, (const uint8_t *) response, strlen(response));
+	c->shutdown = true;
+}
+
+static void upgrade_cb(evutil_socket_t fd, short events, void *arg) {
+	upgrade_start();
+}
+
+/* Answer a request, or start streaming for it */
+static void client_request(struct http_client *c, char *url) {
+	/* Find matching SID/URL and add client to callback list */
+	logger(LOG_INFO, "[%s] GET %s", c->clientname, url);
+	snprintf(c->url, sizeof(c->url), "%s", url);
+	if(!strcmp(url, "/status/transponders.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		send_transponder_list([&](string s) {
+			client_queue(c, (const uint8_t *) s.c_str(), s.size());
+		});
+		c->shutdown = true;
+		return;
+	}
+	if(!strcmp(url, "/status/clients.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		send_client_list(c);
+		c->shutdown = true;
+		return;
+	}
+	if(!strcmp(url, "/status/outputs.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		send_output_list([&](string s) {
+			client_queue(c, (const uint8_t *) s.c_str(), s.size());
+		});
+		c->shutdown = true;
+		return;
+	}
+	if(!strcmp(url, "/status/channels.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		send_channel_list([&](string s) {
+			client_queue(c, (const uint8_t *) s.c_str(), s.size());
+		});
+		c->shutdown = true;
+		return;
+	}
+	if(!strcmp(url, "/status/placement.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n"
+			"<!DOCTYPE html>"
+			"<html lang=\"de\">"
+			"<head><title>tvoe CPU and NUMA placement</title></head>"
+			"<body>";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		auto send = [&](string s) {
+			client_queue(c, (const uint8_t *) s.c_str(), s.size());
+		};
+		send_thread_placement(send);
+		send_frontend_placement(send);
+		send("</body></html>");
+		c->shutdown = true;
+		return;
+	}
+	if(!strcmp(url, "/status/recordings.html")) {
+		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		send_recording_list([&](string s) {
+			client_queue(c, (const uint8_t *) s.c_str(), s.size());
+		});
+		c->shutdown = true;
+		return;
+	}
+	if(admin_request(url) && !client_local(c)) {
+		logger(LOG_NOTICE, "[%s] Refusing %s from remote host", c->clientname, url);
+		const char *response = "HTTP/1.1 403 Only allowed from localhost\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* Binary upgrade, started once the response has been sent */
+	if(!strcmp(url, "/upgrade")) {
+		const char *response = "HTTP/1.1 202 Upgrade started\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		struct timeval tv = { 0, 100000 };
+		event_base_once(evbase, -1, EV_TIMEOUT, upgrade_cb, NULL, &tv);
+		return;
+	}
+	/* Reload the configuration file. The channel lists are loaded in the
+	 * background, errors are only logged. */
+	if(!strcmp(url, "/reload")) {
+		const char *response = reload_config() ? "HTTP/1.1 202 Reload started\r\n\r\n" :
+			"HTTP/1.1 500 Invalid configuration or reload running, see log\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* Stop recordings, e.g. /record/stop/3 */
+	if(!strncmp(url, "/record/stop/", 13)) {
+		const char *response = record_stop(atoi(url + 13)) ?
+			"HTTP/1.1 200 OK\r\n\r\n" : "HTTP/1.1 404 No such recording\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* On-demand outputs, e.g. /multicast/start/239.1.1.1:5000 */
+	if(!strncmp(url, "/multicast/start/", 17) || !strncmp(url, "/multicast/stop/", 16)) {
+		bool start = !strncmp(url, "/multicast/start/", 17);
+		const char *response = udp_request(url + (start ? 17 : 16), start) ?
+			"HTTP/1.1 200 OK\r\n\r\n" : "HTTP/1.1 404 No such on-demand output\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* Optional stream selection, e.g. /by-sid/28106?audio=deu&no-teletext */
+	struct mpeg_filter filter;
+	bool filtered = false;
+	char dest[INET6_ADDRSTRLEN + 8] = "", param[16];
+	int offset = 0;
+	uint64_t limit = 0;
+	char *query = strchr(url, '?');
+	if(query) {
+		*query++ = 0;
+		query_get(query, "dest", dest, sizeof(dest));
+		if(query_get(query, "offset", param, sizeof(param)))
+			offset = atoi(param);
+		if(query_get(query, "latency", param, sizeof(param)))
+			c->lowlatency = !strcmp(param, "low");
+		if(query_get(query, "limit", param, sizeof(param)))
+			limit = strtoull(param, NULL, 10) * 1000000;
+		/* Recording API, e.g. /record/add?sid=28106&duration=90&name=tatort */
+		if(!strcmp(url, "/record/add")) {
+			client_record(c, query);
+			return;
+		}
+		filtered = parse_filter(query, &filter);
+	}
+	/* Raw frontend captures, e.g. /capture/start/0/1?limit=500 */
+	if(!strncmp(url, "/capture/start/", 15) || !strncmp(url, "/capture/stop/", 14)) {
+		bool start = !strncmp(url, "/capture/start/", 15);
+		int adapter, frontend;
+		const char *response = "HTTP/1.1 400 Invalid capture request\r\n\r\n";
+		if(sscanf(url + (start ? 15 : 14), "%d/%d", &adapter, &frontend) == 2) {
+			switch(frontend_capture(adapter, frontend, start, limit)) {
+				case 0: response = "HTTP/1.1 200 OK\r\n\r\n"; break;
+				case -1: response = "HTTP/1.1 404 No such frontend or capture\r\n\r\n"; break;
+				case -2: response = "HTTP/1.1 409 Frontend is already captured\r\n\r\n"; break;
+				default: response = "HTTP/1.1 503 Unable to start capture\r\n\r\n"; break;
+			}
+		}
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* HLS playlists and segments, e.g. /hls/28106/index.m3u8 */
+	if(!strncmp(url, "/hls/", 5)) {
+		client_hls(c, url + 5);
+		return;
+	}
+	/* Paced RTP unicast session, e.g. /rtp/by-sid/28106?dest=192.168.1.20:5004 */
+	if(!strncmp(url, "/rtp/by-sid/", 12)) {
+		client_start_session(c, atoi(url + 12), dest, filtered ? &filter : NULL);
+		return;
+	}
+	/* Complete transponder, e.g. /by-transponder/11836h */
+	if(!strncmp(url, "/by-transponder/", 16)) {
+		struct tune t;
+		if(channel_find_transponder(url + 16, &t)) {
+			client_register(c, mpeg_register_multi(t, NULL, 0, client_senddata,
+					(void (*) (void *)) terminate_client, c));
+			return;
+		}
+	}
+	/* Multiple services of one transponder, e.g. /by-sids/28106,28107 */
+	if(!strncmp(url, "/by-sids/", 9)) {
+		struct tune t;
+		uint16_t sids[16];
+		int n = find_services(url + 9, &t, sids, sizeof(sids) / sizeof(sids[0]));
+		if(n > 0) {
+			client_register(c, mpeg_register_multi(t, sids, n, client_senddata,
+					(void (*) (void *)) terminate_client, c));
+			return;
+		}
+		logger(LOG_INFO, "[%s] Requested services are unknown, duplicate or not on the same transponder",
+				c->clientname);
+		const char *response = "HTTP/1.1 400 Services unknown, duplicate or not on the same transponder\r\n\r\n";
+		client_queue(c, (const uint8_t *) response, strlen(response));
+		c->shutdown = true;
+		return;
+	}
+	/* Single services, e.g. /by-sid/28106, /by-tsid/1101/28106 or /by-name/das-erste-hd */
+	struct tune t;
+	if(find_channel(url, &t)) {
+		logger(LOG_DEBUG, "Found requested URL");
+		/* Timeshift, e.g. /by-sid/28106?offset=-300 */
+		if(offset) {
+			c->ts_reader = timeshift_open(t.sid, offset, client_timeshift_data,
+					client_timeshift_ready, (void (*) (void *)) terminate_client, c);
+			const char *response = c->ts_reader ? "HTTP/1.1 200 OK\r\n\r\n" :
+				"HTTP/1.1 404 Service is not recorded\r\n\r\n";
+			client_queue(c, (const uint8_t *) response, strlen(response));
+			if(c->ts_reader)
+				client_coalesce(c);
+			else
+				c->shutdown = true;
+			return;
+		}
+		/* Register this client with the MPEG module */
+		client_register(c, mpeg_register(t, filtered ? &filter : NULL,
+					client_senddata, (void (*) (void *)) terminate_client, c));
+		if(c->mpeg_handle)
+			c->ts_watch = timeshift_watch(t.sid);
+		return;
+	}
+	logger(LOG_INFO, "Client %s requested invalid URL %s, terminating connection", c->clientname, url);
+	terminate_client(c);
 }
 
 static void handle_readev(evutil_socket_t fd, short events, void *p) {
@@ -131,7 +921,7 @@ static void handle_readev(evutil_socket_t fd, short events, void *p) {
 	if(c->readoff == sizeof(c->buf) - 1) {
 		logger(LOG_INFO, "[%s] Client request has exceeded input buffer size", c->clientname);
 		const char *response = "HTTP/1.1 400 Maximum request size exceeded\r\n\r\n";
-		client_senddata(c, (const uint8_t *) response, strlen(response));
+		client_queue(c, (const uint8_t *) response, strlen(response));
 		c->shutdown = true;
 		return;
 	}
@@ -156,92 +946,191 @@ static void handle_readev(evutil_socket_t fd, short events, void *p) {
 		terminate_client(c);
 		return;
 	}
-	/* Find matching SID/URL and add client to callback list */
-	logger(LOG_INFO, "[%s] GET %s", c->clientname, url);
-	if(!strcmp(url, "/status/transponders.html")) {
-		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
-		client_senddata(c, (const uint8_t *) response, strlen(response));
-		send_transponder_list([&](string s) {
-			client_senddata(c, (const uint8_t *) s.c_str(), s.size());
-		});
-		c->shutdown = true;
-		return;
-	}
-	for(GSList *it = urls; it != NULL; it = g_slist_next(it)) {
-		struct url *u = (struct url *) it->data;
-		if(strcmp(u->text, url))
-			continue;
-		logger(LOG_DEBUG, "Found requested URL");
-		/* Register this client with the MPEG module */
-		if(!(c->mpeg_handle = mpeg_register(u->t, client_senddata, (void (*) (void *)) terminate_client, c))) {
-			logger(LOG_NOTICE, "HTTP: Unable to fulfill request: mpeg_register() failed");
-			const char *response = "HTTP/1.1 503 No tuner available to fulfil your request\r\n\r\n";
-			client_senddata(c, (const uint8_t *) response, strlen(response));
-			c->shutdown = true;
+	client_request(c, url);
+}
+
+static int min(int a, int b) {
+	return a < b ? a : b;
+}
+/* Send the attached body, after all buffered data has been sent */
+static void client_sendbody(struct http_client *c) {
+	ssize_t res = send(c->fd, c->body + c->body_off, c->body_len - c->body_off, 0);
+	if(res < 0) {
+		if(errno == EAGAIN) {
+			client_want_write(c);
 			return;
 		}
-		const char *response = "HTTP/1.1 200 OK\r\n\r\n";
-		client_senddata(c, (const uint8_t *) response, strlen(response));
+		logger(LOG_INFO, "[%s] Send error, terminating connection (%s)", c->clientname, strerror(errno));
+		terminate_client(c);
 		return;
 	}
-	logger(LOG_INFO, "Client %s requested invalid URL %s, terminating connection", c->clientname, url);
-	terminate_client(c);
+	c->sends++;
+	c->sent += res;
+	c->body_off += res;
+	if(c->body_off < c->body_len) {
+		client_want_write(c);
+		return;
+	}
+	hls_segment_put(c->body_ref);
+	c->body = NULL;
+	c->body_ref = NULL;
+	if(c->shutdown)
+		terminate_client(c);
 }
 
-static int min(int a, int b) {
-	return a < b ? a : b;
+/*
+ * Describe the buffered data. Both parts of the ring buffer are sent at once
+ * if it wraps around.
+ * @return Number of iovecs used
+ */
+static int client_iov(struct http_client *c, struct iovec *iov) {
+	iov[0].iov_base = c->writebuf + c->cb_outptr;
+	iov[0].iov_len = min(c->fill, CLIENTBUF - c->cb_outptr);
+	if(iov[0].iov_len == (size_t) c->fill)
+		return 1;
+	iov[1].iov_base = c->writebuf;
+	iov[1].iov_len = c->fill - iov[0].iov_len;
+	return 2;
+}
+
+/* Remove sent data from the ring buffer */
+static void client_consume(struct http_client *c, size_t len) {
+	c->sends++;
+	c->sent += len;
+	c->cb_outptr = (c->cb_outptr + len) % CLIENTBUF;
+	c->fill -= len;
+}
+
+/*
+ * io_uring callback: A send of buffered data has finished. Data queued in
+ * the meantime is sent (or scheduled) now.
+ */
+static void client_send_done(struct http_client *c, int res) {
+	c->sending = false;
+	if(c->closed) {
+		g_slice_free1(sizeof(struct http_client), c);
+		return;
+	}
+	/* Cancelled by http_pause_sends(), the data is still buffered */
+	if(sends_paused && (res == -ECANCELED || res == -EINTR))
+		return;
+	if(res == -EAGAIN) {
+		/* Current kernels wait for socket space themselves, older ones may
+		 * return EAGAIN for non-blocking sockets */
+		event_add(c->writeev, NULL);
+		c->write_pending = true;
+		return;
+	}
+	if(res < 0) {
+		logger(LOG_INFO, "[%s] Send error, terminating connection (%s)", c->clientname, strerror(-res));
+		terminate_client(c);
+		return;
+	}
+	client_consume(c, res);
+	if(c->fill)
+		client_schedule(c);
+	else if(c->body)
+		client_want_write(c);
+	else if(c->shutdown)
+		terminate_client(c);
 }
+
+static void client_sent(void *p, int res) {
+	client_send_done((struct http_client *) p, res);
+	if(--sends_inflight || !sends_done)
+		return;
+	void (*done)(void) = sends_done;
+	sends_done = NULL;
+	event_free(sends_timer);
+	sends_timer = NULL;
+	done();
+}
+
+/* Send the buffered data using io_uring */
+static void client_submit(struct http_client *c) {
+	/* Paused sends are submitted by http_resume_sends() */
+	if(c->sending || sends_paused)
+		return;
+	struct iovec iov[2];
+	int iovcnt = client_iov(c, iov);
+	if(!uring_send(&c->send_op, c->fd, iov, iovcnt)) {
+		/* Submission queue is full, send when the socket is writable */
+		event_add(c->writeev, NULL);
+		c->write_pending = true;
+		return;
+	}
+	c->sending = true;
+	sends_inflight++;
+}
+
 static void handle_writeev(evutil_socket_t fd, short events, void *p) {
 	/* Send buffered data to client */
 	struct http_client *c = (struct http_client *) p;
-	int tosend = min(c->fill, CLIENTBUF - c->cb_outptr);
-	ssize_t res = send(fd, c->writebuf + c->cb_outptr, tosend, 0);
+	c->write_pending = false;
+	if(!c->fill && c->body) {
+		client_sendbody(c);
+		return;
+	}
+	struct iovec iov[2];
+	struct msghdr msg;
+	memset(&msg, 0x0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = client_iov(c, iov);
+	ssize_t res = sendmsg(fd, &msg, 0);
 	if(res < 0) {
-		if(errno == EAGAIN)
+		if(errno == EAGAIN) {
+			client_want_write(c);
 			return;
+		}
 		logger(LOG_INFO, "[%s] Send error, terminating connection (%s)", c->clientname, strerror(errno));
 		terminate_client(c);
 		return;
 	}
-	c->cb_outptr += res;
-	c->fill -= res;
-	if(c->cb_outptr == CLIENTBUF)
-		c->cb_outptr = 0;
-	if(c->fill)
-		event_add(c->writeev, NULL);
+	client_consume(c, res);
+	if(c->fill || c->body)
+		client_want_write(c);
 	else if(c->shutdown) /* Socket is in shutdown state and all data has already been sent */
 		terminate_client(c);
 }
 
-void http_connect_cb(evutil_socket_t sock, short foo, void *p) {
-	logger(LOG_DEBUG, "New connection on socket");
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-	int clientsock = accept(sock, (struct sockaddr *) &addr, &addrlen);
-	if(clientsock < 0) {
-		logger(LOG_INFO, "accept() returned %d: %s", clientsock, strerror(errno));
-		return;
-	}
+/* Set up a new client on a connected socket, NULL on failure */
+static struct http_client *client_new(int clientsock) {
 	evutil_make_socket_nonblocking(clientsock);
 	struct http_client *c = (struct http_client *) g_slice_alloc(sizeof(struct http_client));
 	c->readoff = 0;
 	c->cb_inptr = c->cb_outptr = c->fill = 0;
+	c->flush_size = 0;
+	c->lowlatency = c->write_pending = c->flush_armed = false;
+	c->sends = c->sent = 0;
+	c->send_op.cb = client_sent;
+	c->send_op.arg = c;
+	c->sending = c->closed = false;
+	c->skipping = false;
+	c->video_seen = false;
+	c->overload_since = 0;
+	c->shed = c->skipped = 0;
+	c->pacingev = NULL;
+	c->bitrate = 0;
+	c->hls_wait = NULL;
+	c->body = NULL;
+	c->body_len = c->body_off = 0;
+	c->body_ref = NULL;
+	c->ts_watch = c->ts_reader = NULL;
+	c->url[0] = 0;
+	c->clientname[0] = 0;
 	c->timeout = false;
 	c->shutdown = false;
 	c->reading = true;
+	c->resumed = false;
 	c->fd = clientsock;
 	c->mpeg_handle = NULL;
-	int ret = getnameinfo((struct sockaddr *) &addr, addrlen, c->clientname, INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) < 0;
-	if(ret < 0) {
-		logger(LOG_ERR, "getnameinfo() failed: %s", gai_strerror(ret));
-		c->clientname[0] = 0;
-	}
+	c->udp_handle = NULL;
 	c->readev = event_new(evbase, clientsock, EV_READ | EV_PERSIST, handle_readev, c);
 	if(!c->readev) {
 		logger(LOG_ERR, "Unable to allocate new event: event_new() returned NULL");
 		g_slice_free1(sizeof(struct http_client), c);
 		close(clientsock);
-		return;
+		return NULL;
 	}
 	c->writeev = event_new(evbase, clientsock, EV_WRITE, handle_writeev, c);
 	if(!c->writeev) {
@@ -249,9 +1138,44 @@ void http_connect_cb(evutil_socket_t sock, short foo, void *p) {
 		event_free(c->readev);
 		g_slice_free1(sizeof(struct http_client), c);
 		close(clientsock);
-		return;
+		return NULL;
 	}
+	c->flushev = evtimer_new(evbase, client_flush_cb, c);
 	event_add(c->readev, NULL);
+	clients = g_slist_prepend(clients, c);
+	return c;
+}
+
+void http_connect_cb(evutil_socket_t sock, short foo, void *p) {
+	logger(LOG_DEBUG, "New connection on socket");
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int clientsock = accept(sock, (struct sockaddr *) &addr, &addrlen);
+	if(clientsock < 0) {
+		logger(LOG_INFO, "accept() returned %d: %s", clientsock, strerror(errno));
+		return;
+	}
+	struct http_client *c = client_new(clientsock);
+	if(!c)
+		return;
+	int ret = getnameinfo((struct sockaddr *) &addr, addrlen, c->clientname, INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) < 0;
+	if(ret < 0) {
+		logger(LOG_ERR, "getnameinfo() failed: %s", gai_strerror(ret));
+		c->clientname[0] = 0;
+	}
+}
+
+/* Accept connections on listenSock */
+static int http_listen(void) {
+	if(event_assign(&httpd, evbase, listenSock, EV_PERSIST | EV_READ | EV_WRITE, http_connect_cb, NULL) < 0) {
+		logger(LOG_ERR, "Invalid arguments in event_assign() (this should never happen, this is a bug)");
+		return -4;
+	}
+	if(event_add(&httpd, NULL) < 0) {
+		logger(LOG_ERR, "Unable to add assigned event to event base");
+		return -5;
+	}
+	return 0;
 }
 
 int http_init(uint16_t port) {
@@ -279,14 +1203,91 @@ int http_init(uint16_t port) {
 		logger(LOG_ERR, "Unable to listen on already bound sock: %s", strerror(errno));
 		return -3;
 	}
-	if(event_assign(&httpd, evbase, listenSock, EV_PERSIST | EV_READ | EV_WRITE, http_connect_cb, NULL) < 0) {
-		logger(LOG_ERR, "Invalid arguments in event_assign() (this should never happen, this is a bug)");
-		return -4;
-	}
-	if(event_add(&httpd, NULL) < 0) {
-		logger(LOG_ERR, "Unable to add assigned event to event base");
-		return -5;
-	}
+	int ret = http_listen();
+	if(ret < 0)
+		return ret;
 	logger(LOG_DEBUG, "Successfully created HTTP listener");
 	return 0;
 }
+
+int http_adopt(int sock) {
+	listenSock = sock;
+	return http_listen();
+}
+
+int http_listener(void) {
+	return listenSock;
+}
+
+/* libevent callback: Sends are still in flight, see http_pause_sends() */
+static void sends_timeout(evutil_socket_t fd, short events, void *p) {
+	for(GSList *it = clients; it != NULL; it = g_slist_next(it)) {
+		struct http_client *c = (struct http_client *) it->data;
+		if(c->sending)
+			uring_cancel(&c->send_op);
+	}
+}
+
+void http_pause_sends(void (*done)(void)) {
+	sends_paused = true;
+	if(!sends_inflight) {
+		done();
+		return;
+	}
+	sends_done = done;
+	sends_timer = evtimer_new(evbase, sends_timeout, NULL);
+	struct timeval tv = { HANDOVER_SEND_WAIT / 1000, (HANDOVER_SEND_WAIT % 1000) * 1000 };
+	evtimer_add(sends_timer, &tv);
+}
+
+void http_resume_sends(void) {
+	sends_paused = false;
+	for(GSList *it = clients; it != NULL; it = g_slist_next(it)) {
+		struct http_client *c = (struct http_client *) it->data;
+		if(c->fill && !c->sending && !c->write_pending && !c->timeout)
+			client_want_write(c);
+	}
+}
+
+void http_handover(function<void(int fd, const char *clientname, const char *url,
+			const string &pending)> fn) {
+	for(GSList *it = clients; it != NULL; it = g_slist_next(it)) {
+		struct http_client *c = (struct http_client *) it->data;
+		/* Only plain streams can be resumed by replaying the request */
+		if(!c->mpeg_handle || c->shutdown || c->body || c->hls_wait ||
+				c->ts_reader || c->udp_handle)
+			continue;
+		/* The kernel still reads from the buffer, see http_pause_sends() */
+		if(c->sending) {
+			logger(LOG_NOTICE, "[%s] Send still in flight, not handing over", c->clientname);
+			continue;
+		}
+		struct iovec iov[2];
+		int n = c->fill ? client_iov(c, iov) : 0;
+		string pending;
+		for(int i = 0; i < n; i++)
+			pending.append((const char *) iov[i].iov_base, iov[i].iov_len);
+		fn(c->fd, c->clientname, c->url, pending);
+	}
+}
+
+void http_resume_client(int fd, const char *clientname, const char *url, const string &pending) {
+	if(pending.size() > CLIENTBUF) {
+		close(fd);
+		return;
+	}
+	struct http_client *c = client_new(fd);
+	if(!c)
+		return;
+	snprintf(c->clientname, sizeof(c->clientname), "%s", clientname);
+	c->reading = false;
+	c->resumed = true;
+	/* Unsent data, it might start in the middle of a TS packet */
+	memcpy(c->writebuf, pending.data(), pending.size());
+	c->cb_inptr = c->fill = pending.size();
+	char buf[sizeof(c->url)];
+	snprintf(buf, sizeof(buf), "%s", url);
+	client_request(c, buf);
+	if(c->fill)
+		client_want_write(c);
+}
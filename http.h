@@ -2,17 +2,47 @@
 #define __INCLUDED_TVOE_HTTP
 
 #include <cstdint>
+#include <functional>
 #include "frontend.h"
 
+using std::function;
+
+/* Maximum length of a request header line, and thus of the URLs handed over */
+#define HTTP_REQUEST_SIZE 512
+
+extern int http_init(uint16_t port);
 /**
- * Adds URL handlers for the specified channel. On client request, the HTTP
- * module will tune to the specified transponder and send the service "sid" to
- * the client
- * @param name Human-readable channel name
- * @param sid Service ID
- * @param t Transponder to tune to
+ * Accept connections on a listening socket handed over by the previous
+ * process (see upgrade.h), instead of calling http_init()
  */
-extern void http_add_channel(const char *name, int sid, struct tune t);
-extern int http_init(uint16_t port);
+extern int http_adopt(int sock);
+/**
+ * @return Listening socket
+ */
+extern int http_listener(void);
+/**
+ * Stop sending before handing the clients over: Sends submitted to io_uring
+ * are waited for (or cancelled after a short time), new ones are deferred.
+ * done is called once no send is in flight anymore (right away without
+ * io_uring).
+ */
+extern void http_pause_sends(void (*done)(void));
+/**
+ * Send the data deferred by http_pause_sends(), if the upgrade failed
+ */
+extern void http_resume_sends(void);
+/**
+ * Pass every streaming client to fn, for handing it over to a new process:
+ * Its socket, name, requested URL and data which has not been sent yet.
+ * Other clients (status pages, HLS, timeshift, RTP sessions) are skipped.
+ */
+extern void http_handover(function<void(int fd, const char *clientname, const char *url,
+			const string &pending)> fn);
+/**
+ * Continue streaming to a client handed over by the previous process. The
+ * request is processed again, without sending a response header.
+ */
+extern void http_resume_client(int fd, const char *clientname, const char *url,
+		const string &pending);
 
 #endif
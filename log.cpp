@@ -1,6 +1,7 @@
 #include <printf.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <assert.h>
 #include <syslog.h>
@@ -8,6 +9,31 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <glib.h>
+#include "log.h"
+#include "affinity.h"
+
+/*
+ * Logging happens on hot paths (e.g. for every client connect or failed read),
+ * and a storm of messages must not stall the event loop. Thus, logger() only
+ * formats the message into a lock-free ring (a bounded MPSC queue, every slot
+ * has a sequence number telling whether it is free or filled). A writer thread
+ * formats timestamps and does the actual output. If the ring is full, messages
+ * are dropped and counted.
+ *
+ * Additionally, every call site may log at most LOG_BURST messages per second.
+ * The number of suppressed messages is appended to the next message of the
+ * call site, or reported by the writer thread once the storm is over.
+ */
+
+/* Number of entries in the log ring, must be a power of 2 */
+#define LOG_RING 1024
+/* Maximum length of a log message */
+#define LOG_LINE 1024
+/* Number of messages per call site and second before messages are suppressed */
+#define LOG_BURST 20
+/* Interval for reporting suppressed messages (in us) */
+#define LOG_SUMMARY_INTERVAL 1000000
 
 char *logfile = NULL;
 int use_syslog = 0;
@@ -15,30 +41,40 @@ int loglevel = 2;
 static FILE * log_fd;
 extern bool daemonized;
 
-void logger(int level, const char *fmt, ...) {
-	char text[2048], timestamp[256];
-	time_t t;
-	struct tm * ti;
+struct log_entry {
+	unsigned long seq;
+	int level;
+	time_t time;
+	char text[LOG_LINE];
+};
 
-	if((loglevel == 0) ||
-	   (loglevel == 1 && (level != LOG_ERR)) ||
-	   (loglevel == 2 && (level != LOG_ERR && level != LOG_NOTICE)) ||
-	   (loglevel == 3 && (level == LOG_DEBUG)))
-		return;
+static struct log_entry ring[LOG_RING];
+static unsigned long enqueue_pos, dequeue_pos;
+/* Messages dropped because the ring was full */
+static unsigned long dropped;
+/* Call sites that have logged at least once */
+static struct log_site *sites;
 
-	time(&t);
-	ti = localtime(&t);
-	strftime(timestamp, sizeof(timestamp), "[%X %x]", ti);
+static GThread *writer;
+static bool running;
+static GMutex wake_lock;
+static GCond wake;
+static int sleeping;
+static bool stopping;
 
-	va_list args;
-	va_start(args, fmt);
-	vsnprintf(text, sizeof(text), fmt, args);
-	va_end(args);
+/* Write a message to the configured outputs */
+static void output(int level, time_t t, const char *text) {
+	static time_t cached = -1;
+	static char timestamp[256];
+	if(t != cached) {
+		struct tm ti;
+		localtime_r(&t, &ti);
+		strftime(timestamp, sizeof(timestamp), "[%X %x]", &ti);
+		cached = t;
+	}
 
-	if(log_fd) {
+	if(log_fd)
 		fprintf(log_fd, "%s %s\n", timestamp, text);
-		fflush(log_fd);
-	}
 	if(use_syslog)
 		syslog(level, "%s", text);
 	if(!daemonized) {
@@ -60,6 +96,159 @@ void logger(int level, const char *fmt, ...) {
 	}
 }
 
+/************** Called in the writer thread ***************/
+
+/* Report call sites whose rate limiting window is over */
+static void report_suppressed(time_t now) {
+	char text[LOG_LINE];
+	for(struct log_site *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s; s = s->next) {
+		if(!__atomic_load_n(&s->suppressed, __ATOMIC_RELAXED) ||
+				__atomic_load_n(&s->window, __ATOMIC_RELAXED) == now)
+			continue;
+		int n = __atomic_exchange_n(&s->suppressed, 0, __ATOMIC_RELAXED);
+		if(!n)
+			continue;
+		snprintf(text, sizeof(text), "%d similar messages suppressed (%s:%d)", n,
+				s->file, s->line);
+		output(__atomic_load_n(&s->level, __ATOMIC_RELAXED), now, text);
+	}
+	unsigned long n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if(n) {
+		snprintf(text, sizeof(text), "%lu log messages dropped, log ring full", n);
+		output(LOG_ERR, now, text);
+	}
+}
+
+static gpointer log_writer(gpointer p) {
+	affinity_thread(AFFINITY_WORKER, "log_writer");
+	for(;;) {
+		struct log_entry *e = &ring[dequeue_pos % LOG_RING];
+		if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == dequeue_pos + 1) {
+			output(e->level, e->time, e->text);
+			/* Mark the slot as free for the next round */
+			__atomic_store_n(&e->seq, dequeue_pos + LOG_RING, __ATOMIC_RELEASE);
+			dequeue_pos++;
+			continue;
+		}
+		report_suppressed(time(NULL));
+		if(log_fd)
+			fflush(log_fd);
+		fflush(stdout);
+
+		g_mutex_lock(&wake_lock);
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&e->seq, __ATOMIC_SEQ_CST) != dequeue_pos + 1 && !stopping)
+			g_cond_wait_until(&wake, &wake_lock, g_get_monotonic_time() + LOG_SUMMARY_INTERVAL);
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+		bool stop = stopping && __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1;
+		g_mutex_unlock(&wake_lock);
+		/* Only stop once all messages are written */
+		if(stop)
+			break;
+	}
+	affinity_thread_exit();
+	return NULL;
+}
+
+/****************************** Called by logger() ************************/
+
+/*
+ * Check the rate limit of a call site
+ * @param suppressed Set to the number of messages suppressed before this one
+ * @return false if the message has to be suppressed
+ */
+static bool rate_limit(struct log_site *site, int level, time_t now, int *suppressed) {
+	if(!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE) &&
+			!__atomic_exchange_n(&site->registered, true, __ATOMIC_ACQ_REL)) {
+		site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&sites, &site->next, site, true,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	__atomic_store_n(&site->level, level, __ATOMIC_RELAXED);
+	long window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if(window != now && __atomic_compare_exchange_n(&site->window, &window, now, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	if(__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_BURST) {
+		__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Claim a free slot in the ring, NULL if the ring is full */
+static struct log_entry *ring_claim(unsigned long *pos) {
+	unsigned long p = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	for(;;) {
+		struct log_entry *e = &ring[p % LOG_RING];
+		long diff = (long) __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - (long) p;
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&enqueue_pos, &p, p + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = p;
+				return e;
+			}
+		} else if(diff < 0) {
+			return NULL;
+		} else {
+			p = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void log_write(struct log_site *site, int level, const char *fmt, ...) {
+	char buf[LOG_LINE];
+	time_t now = time(NULL);
+	int suppressed = 0;
+	if(!rate_limit(site, level, now, &suppressed))
+		return;
+
+	unsigned long pos = 0;
+	struct log_entry *e = running ? ring_claim(&pos) : NULL;
+	if(running && !e) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	char *text = e ? e->text : buf;
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(text, LOG_LINE, fmt, args);
+	va_end(args);
+	if(suppressed && len >= 0 && len < LOG_LINE)
+		snprintf(text + len, LOG_LINE - len, " (%d similar messages suppressed)", suppressed);
+
+	if(!e) {
+		output(level, now, text);
+		if(log_fd)
+			fflush(log_fd);
+		return;
+	}
+	e->level = level;
+	e->time = now;
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+	/* Wake up the writer, if it is sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+		g_mutex_lock(&wake_lock);
+		g_cond_signal(&wake);
+		g_mutex_unlock(&wake_lock);
+	}
+}
+
+/****************************** Main control flow ************************/
+
+/* Write all remaining messages on exit */
+static void log_stop(void) {
+	g_mutex_lock(&wake_lock);
+	stopping = true;
+	g_cond_signal(&wake);
+	g_mutex_unlock(&wake_lock);
+	g_thread_join(writer);
+	running = false;
+}
+
 int init_log(void) {
 	if(logfile) {
 		log_fd = fopen(logfile, "a");
@@ -71,3 +260,13 @@ int init_log(void) {
 		openlog("tvoe", 0, LOG_DAEMON);
 	return 0;
 }
+
+void log_start(void) {
+	for(unsigned long i = 0; i < LOG_RING; i++)
+		ring[i].seq = i;
+	g_mutex_init(&wake_lock);
+	g_cond_init(&wake);
+	writer = g_thread_new("log_writer", log_writer, NULL);
+	running = true;
+	atexit(log_stop);
+}
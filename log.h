@@ -1,10 +1,52 @@
 #ifndef __INCLUDED_TVOE_LOGGER
 #define __INCLUDED_TVOE_LOGGER
 #include <syslog.h>
+#include <stdbool.h>
 
 extern int loglevel;
 
-void logger(int loglevel, const char *fmt, ...);
+/*
+ * State of a logger() call site, used for rate limiting. Every call site gets
+ * its own static instance.
+ */
+struct log_site {
+	const char *file;
+	int line;
+	int level;				/**< Level of the last message */
+	long window;			/**< Second the current rate limiting window started */
+	int count;				/**< Messages logged in the current window */
+	int suppressed;			/**< Messages suppressed since the last one logged */
+	bool registered;		/**< Site is in the list of sites, see log.cpp */
+	struct log_site *next;
+};
+
+/* Check whether messages of the given level are logged at all */
+static inline bool log_enabled(int level) {
+	return loglevel == 4 ||
+		(loglevel == 3 && level != LOG_DEBUG) ||
+		(loglevel == 2 && (level == LOG_ERR || level == LOG_NOTICE)) ||
+		(loglevel == 1 && level == LOG_ERR);
+}
+
+void log_write(struct log_site *site, int level, const char *fmt, ...);
+
+/*
+ * Log a message. The arguments are only evaluated if the level is enabled.
+ * Messages are rate limited per call site and written by a background thread
+ * once log_start() has been called.
+ */
+#define logger(level, ...) do { \
+	static struct log_site logger_site = { __FILE__, __LINE__, 0, 0, 0, 0, false, NULL }; \
+	if(log_enabled(level)) \
+		log_write(&logger_site, level, __VA_ARGS__); \
+} while(0)
+
 int init_log(void);
+/**
+ * Start writing log messages in a background thread. Until then, they are
+ * written synchronously. Has to be called after daemonizing, as threads do
+ * not survive fork().
+ */
+void log_start(void);
 
 #endif
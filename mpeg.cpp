@@ -1,12 +1,15 @@
 #include <cstdint>
 #include <cstdbool>
 #include <cstdlib>
+#include <strings.h>
 #include <bitstream/mpeg/ts.h>
 #include <bitstream/mpeg/psi.h>
 #include <bitstream/mpeg/psi/pmt_print.h>
+#include <bitstream/dvb/si.h>
 #include <glib.h>
 #include <cassert>
 #include "mpeg.h"
+#include "tsdecode.h"
 #include "log.h"
 
 /*
@@ -21,23 +24,66 @@
  * Each incoming packet is forwarded to all clients requesting a SID containing
  * this PID. Also, it regularly sends a PAT containing only the requested SID
  * to all clients.
+ *
+ * The EIT (PID 18) is not forwarded as a whole, as it contains the EPG for
+ * every service on the transponder. Instead, its sections are reassembled and
+ * only the sections describing the requested SID are re-packetized and sent
+ * to the client.
  */
 
 const int MAX_TRANSPONDER_RETRIES = 64;
+/* Length of the interval used to measure PID bitrates (in s) */
+const int BITRATE_INTERVAL = 2;
+/* Sync byte at the start of every TS packet */
+const uint8_t TS_SYNC_BYTE = 0x47;
+/* Number of consecutive packets with sync bytes needed to regain TS sync */
+const size_t RESYNC_PACKETS = 3;
+
+/* Forward EIT schedule tables (in addition to present/following).
+ * Set by config parser. */
+bool eit_schedule = true;
+
+/*
+ * Shapes of the subscription table of a transponder. The packet dispatch loop
+ * is specialized for each of them, see select_dispatch():
+ * DISPATCH_NONE: No PID has callbacks, only passthrough clients (or none)
+ * DISPATCH_SINGLE: Every PID has at most one callback
+ * DISPATCH_GENERIC: Anything else
+ */
+enum dispatch_shape {
+	DISPATCH_NONE,
+	DISPATCH_SINGLE,
+	DISPATCH_GENERIC
+};
 
 /*
  * Struct describing one specific client and the associated callbacks
  */
 struct mpeg_client {
-	/** sid requested by this client */
-	int sid;
+	/** Services requested by this client. Empty if the client receives the
+	 * complete transponder */
+	GSList *services;
+	/** true if the client receives the complete transponder unmodified */
+	bool passthrough;
 	/** As we send different PATs to different clients, we have a per-client
 	 * PAT continuity counter */
 	uint8_t pid0_cc;
+	/** PAT for clients requesting more than one service */
+	uint8_t pat_ts[TS_SIZE];
+	/** Continuity counter for the EIT sections filtered for this client */
+	uint8_t eit_cc;
 	/** Associated transponder */
 	struct transponder *t;
+	/** Elementary stream selection, only valid if filtered is set */
+	struct mpeg_filter filter;
+	bool filtered;
+	/** Rewritten PMT for filtered clients, ready to be sent, and its
+	 * continuity counter */
+	uint8_t pmt_ts[6 * TS_SIZE];
+	int pmt_packets;
+	uint8_t pmt_cc;
 	/** Callback for MPEG-TS input */
-	void (*cb) (void *, const uint8_t *, uint16_t);
+	void (*cb) (void *, const uint8_t *, size_t);
 	/** Callback to call on timeout */
 	void (*timeout_cb) (void *);
 	/** Argument to supply to the callback functions */
@@ -57,6 +103,33 @@ struct pid_info {
 	uint8_t *psi_buffer;
 	uint16_t psi_buffer_used;
 	GSList *callback;
+	/** Importance of this PID, see enum mpeg_pid_class */
+	uint8_t pid_class;
+	/** Packets received in the current bitrate measurement interval */
+	uint32_t packets;
+	/** Bitrate measured in the last interval (bit/s) */
+	uint32_t bitrate;
+};
+/*
+ * Struct describing a service on a transponder that is requested by at
+ * least one client.
+ */
+struct service {
+	uint16_t sid;
+	/** PMT PID announced for this service in the upstream PAT, 0 if unknown */
+	uint16_t pmt_pid;
+	/** Version of the upstream PAT the cached PAT was built from, -1 if
+	 * there is no cached PAT yet */
+	int pat_version;
+	/** Reduced PAT containing only this service. Shared by all clients of
+	 * this service, the continuity counter is patched in on output. */
+	uint8_t pat[TS_SIZE];
+	/** Last PMT received for this service, NULL if none yet */
+	uint8_t *pmt;
+	/** Clients requesting this service */
+	GSList *clients;
+	/** Number of clients with a rewritten PMT */
+	int filtered;
 };
 struct transponder {
 	/** Transport stream ID. Taken over as part of the PAT */
@@ -70,64 +143,169 @@ struct transponder {
 	struct pid_info pids[MAX_PID];
 	/** List of clients subscribed to this transponder */
 	GSList *clients;
+	/** Requested services, indexed by SID */
+	GHashTable *services;
+	/** Clients requesting more than one service, they get their own PAT */
+	GSList *multi;
+	/** Clients receiving the complete transponder */
+	GSList *passthrough;
+	/** Version and CRC of the last processed PAT section, version is -1
+	 * if the next PAT has to be processed in any case */
+	int pat_version;
+	uint32_t pat_crc;
 	/** How often we already tried to get a tuner for this transponder */
 	int retry_count;
+	/** Start of the current bitrate measurement interval (monotonic, us) */
+	int64_t rate_since;
+	/** Total bitrate measured in the last interval (bit/s) */
+	uint64_t bitrate;
+	/** Incomplete packet at the end of the last read, see mpeg_input() */
+	uint8_t carry[TS_SIZE];
+	size_t carry_len;
+	/** Number of times the input lost TS sync, and bytes skipped resyncing */
+	uint64_t resyncs, resync_bytes;
+	/** Number of PIDs with at least one / more than one callback */
+	int subscribed_pids, shared_pids;
+	/** Dispatch kernel for the current subscriptions, see select_dispatch() */
+	void (*dispatch)(struct transponder *, uint8_t *, size_t);
 };
 static GSList *transponders;
 
-/* Helper function for send_pat(). Send a PSI section to the client. */
-/* This code is copied from bitstream examples. See LICENSE. */
-static void output_psi_section(struct mpeg_client *c, uint8_t *section, uint16_t pid, uint8_t *cc) {
-    uint16_t section_length = psi_get_length(section) + PSI_HEADER_SIZE;
-    uint16_t section_offset = 0;
-    do {
-        uint8_t ts[TS_SIZE];
-        uint8_t ts_offset = 0;
-        memset(ts, 0xff, TS_SIZE);
-
-        psi_split_section(ts, &ts_offset, section, &section_offset);
+/*
+ * Split a PSI section into TS packets on PID pid. The continuity counters are
+ * left unset, they are patched in per client by send_packets().
+ * This code is based on the bitstream examples. See LICENSE.
+ * @param ts Output buffer, large enough to hold the complete section
+ * @return Number of packets written to ts
+ */
+static int psi_packetize(uint8_t *section, uint16_t pid, uint8_t *ts) {
+	uint16_t section_length = psi_get_length(section) + PSI_HEADER_SIZE;
+	uint16_t section_offset = 0;
+	int n = 0;
+	do {
+		uint8_t *cur = ts + n++ * TS_SIZE;
+		uint8_t ts_offset = 0;
+		memset(cur, 0xff, TS_SIZE);
 
-        ts_set_pid(ts, pid);
-        ts_set_cc(ts, *cc);
-        (*cc)++;
-        *cc &= 0xf;
+		psi_split_section(cur, &ts_offset, section, &section_offset);
+		ts_set_pid(cur, pid);
 
-        if (section_offset == section_length)
-            psi_split_end(ts, &ts_offset);
+		if (section_offset == section_length)
+			psi_split_end(cur, &ts_offset);
+	} while (section_offset < section_length);
+	return n;
+}
 
-		c->cb(c->ptr, ts, TS_SIZE);
-    } while (section_offset < section_length);
+/*
+ * Send n packets from ts to a client, using (and incrementing) the
+ * continuity counter cc. The continuity counters are written into ts in
+ * place, so the same buffer can be sent to many clients without copying.
+ */
+static void send_packets(struct mpeg_client *c, uint8_t *ts, int n, uint8_t *cc) {
+	for(int i = 0; i < n; i++) {
+		ts_set_cc(ts + i * TS_SIZE, *cc);
+		(*cc)++;
+		*cc &= 0xf;
+	}
+	c->cb(c->ptr, ts, n * TS_SIZE);
 }
 
 /*
- * Assemble new PAT containing only the SID requested by the client and
- * sent it to him.
+ * Assemble a PAT containing the n programs progs (pairs of SID and PMT PID)
+ * into TS packet ts. At most PAT_MAX_PROGRAMS programs fit into one packet.
  */
-static void send_pat(struct mpeg_client *c, uint16_t sid, uint16_t pid) {
+#define PAT_MAX_PROGRAMS ((TS_SIZE - TS_HEADER_SIZE - 1 - PAT_HEADER_SIZE - PSI_CRC_SIZE) \
+		/ PAT_PROGRAM_SIZE)
+static void encode_pat(const uint16_t (*progs)[2], int n, uint8_t version, uint8_t *ts) {
 	uint8_t *pat = psi_allocate();
-	uint8_t *pat_n, j = 0;
+	uint8_t *pat_n;
+	int j;
 
-    pat_init(pat);
+	pat_init(pat);
 	pat_set_tsid(pat, 0);
-    psi_set_section(pat, 0);
-    psi_set_lastsection(pat, 0);
-    psi_set_version(pat, 0);
-    psi_set_current(pat);
-    psi_set_length(pat, PSI_MAX_SIZE);
+	psi_set_section(pat, 0);
+	psi_set_lastsection(pat, 0);
+	psi_set_version(pat, version);
+	psi_set_current(pat);
+	psi_set_length(pat, PSI_MAX_SIZE);
 
-    pat_n = pat_get_program(pat, j++);
-    patn_init(pat_n);
-    patn_set_program(pat_n, sid);
-    patn_set_pid(pat_n, pid);
+	for(j = 0; j < n; j++) {
+		pat_n = pat_get_program(pat, j);
+		patn_init(pat_n);
+		patn_set_program(pat_n, progs[j][0]);
+		patn_set_pid(pat_n, progs[j][1]);
+	}
 
-    // Set correct PAT length
-    pat_n = pat_get_program(pat, j); // Get offset of the end of last program
-    pat_set_length(pat, pat_n - pat - PAT_HEADER_SIZE);
-    psi_set_crc(pat);
+	// Set correct PAT length
+	pat_n = pat_get_program(pat, j); // Get offset of the end of last program
+	pat_set_length(pat, pat_n - pat - PAT_HEADER_SIZE);
+	psi_set_crc(pat);
 
-	output_psi_section(c, pat, PAT_PID, &c->pid0_cc);
+	psi_packetize(pat, PAT_PID, ts);
 
-    free(pat);
+	free(pat);
+}
+
+/*
+ * Assemble the reduced PAT containing only the given service, using the PMT
+ * PID and version from the upstream PAT, and cache it in the service.
+ */
+static void build_pat(struct service *svc, uint16_t pmt_pid, uint8_t version) {
+	const uint16_t prog[1][2] = { { svc->sid, pmt_pid } };
+	encode_pat(prog, 1, version, svc->pat);
+	svc->pmt_pid = pmt_pid;
+	svc->pat_version = version;
+}
+
+/*
+ * Assemble the PAT for a client requesting more than one service, containing
+ * all of its services that are part of the upstream PAT.
+ */
+static void build_multi_pat(struct mpeg_client *c, uint8_t version) {
+	uint16_t progs[PAT_MAX_PROGRAMS][2];
+	int n = 0;
+	for(GSList *it = c->services; it != NULL && n < PAT_MAX_PROGRAMS; it = g_slist_next(it)) {
+		struct service *svc = (struct service *) it->data;
+		if(!svc->pmt_pid)
+			continue;
+		progs[n][0] = svc->sid;
+		progs[n++][1] = svc->pmt_pid;
+	}
+	encode_pat(progs, n, version, c->pat_ts);
+}
+
+static void select_dispatch(struct transponder *a);
+
+/*
+ * Update the number of subscribed and shared PIDs after the callbacks of PID
+ * pid have changed
+ * @param before Number of callbacks before the change
+ */
+static void callbacks_changed(struct transponder *a, uint16_t pid, int before) {
+	int after = g_slist_length(a->pids[pid].callback);
+	a->subscribed_pids += (after > 0) - (before > 0);
+	a->shared_pids += (after > 1) - (before > 1);
+	select_dispatch(a);
+}
+
+/* Remove client c from the callbacks of PID pid */
+static void remove_callback(struct transponder *a, uint16_t pid, void *c) {
+	int before = g_slist_length(a->pids[pid].callback);
+	a->pids[pid].callback = g_slist_remove(a->pids[pid].callback, c);
+	callbacks_changed(a, pid, before);
+}
+
+/*
+ * Helper function to register client c as callback for PID pid on
+ * transponder a, if not already registered
+ */
+static void register_client(struct transponder *a, struct mpeg_client *c, uint16_t pid) {
+	int before = 0;
+	for(GSList *it = a->pids[pid].callback; it != NULL; it = g_slist_next(it), before++)
+		if(it->data == c) // Client already registered
+			return;
+	a->pids[pid].callback = g_slist_prepend(a->pids[pid].callback, c);
+	callbacks_changed(a, pid, before);
 }
 
 /*
@@ -136,16 +314,244 @@ static void send_pat(struct mpeg_client *c, uint16_t sid, uint16_t pid) {
  */
 static void register_callback(GSList *it, struct transponder *a, uint16_t pid) {
 	// Loop over all supplied clients and add them if requested
-	for(; it; it = g_slist_next(it)) {
-		GSList *it2 = a->pids[pid].callback;
-		for(; it2 != NULL; it2 = g_slist_next(it2)) {
-			if(it2->data == it->data)
-				break;
+	for(; it; it = g_slist_next(it))
+		register_client(a, (struct mpeg_client *) it->data, pid);
+}
+
+/* Get the CRC32 at the end of a PSI section */
+static uint32_t section_crc(const uint8_t *section) {
+	const uint8_t *crc = section + psi_get_length(section) + PSI_HEADER_SIZE
+		- PSI_CRC_SIZE;
+	return (crc[0] << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+}
+
+/*
+ * Check whether two PSI sections are the same version of a table. Comparing
+ * the CRC additionally catches upstream changes without version bump.
+ */
+static bool section_unchanged(const uint8_t *a, const uint8_t *b) {
+	return psi_get_version(a) == psi_get_version(b) &&
+		section_crc(a) == section_crc(b);
+}
+
+/* Elementary stream types, as far as we need to distinguish them */
+enum es_type {
+	ES_VIDEO,
+	ES_AUDIO,
+	ES_AC3,
+	ES_TELETEXT,
+	ES_SUBTITLE,
+	ES_OTHER
+};
+
+/*
+ * Determine the type of an elementary stream from its stream type and, for
+ * private PES data (stream type 6), from its descriptors.
+ */
+static int es_get_type(uint8_t *es) {
+	switch(pmtn_get_streamtype(es)) {
+		case 0x01: case 0x02: case 0x10: case 0x1b: case 0x24: case 0x42:
+			return ES_VIDEO;
+		case 0x03: case 0x04: case 0x0f: case 0x11:
+			return ES_AUDIO;
+		case 0x81: case 0x87:
+			return ES_AC3;
+		case 0x06:
+			break;
+		default:
+			return ES_OTHER;
+	}
+	uint8_t *desc;
+	for(int j = 0; (desc = descs_get_desc(pmtn_get_descs(es), j)); j++) {
+		switch(desc_get_tag(desc)) {
+			case 0x56: /* teletext_descriptor */
+				return ES_TELETEXT;
+			case 0x59: /* subtitling_descriptor */
+				return ES_SUBTITLE;
+			case 0x6a: /* AC-3_descriptor */
+			case 0x7a: /* enhanced_AC-3_descriptor */
+				return ES_AC3;
+			case 0x7b: /* DTS_descriptor */
+			case 0x7c: /* AAC_descriptor */
+				return ES_AUDIO;
+		}
+	}
+	return ES_OTHER;
+}
+
+/* Check whether the language of elementary stream es is in filter f */
+static bool es_language_selected(const struct mpeg_filter *f, uint8_t *es) {
+	uint8_t *desc;
+	for(int j = 0; (desc = descs_get_desc(pmtn_get_descs(es), j)); j++) {
+		/* ISO_639_language_descriptor, we only look at the first entry */
+		if(desc_get_tag(desc) != 0x0a || desc_get_length(desc) < 4)
+			continue;
+		for(int i = 0; i < f->n_audio; i++)
+			if(!strncasecmp((const char *) desc + 2, f->audio[i], 3))
+				return true;
+	}
+	return false;
+}
+
+/*
+ * Check whether elementary stream es of PMT pmt is selected by filter f
+ */
+static bool es_selected(const struct mpeg_filter *f, uint8_t *pmt, uint8_t *es) {
+	int type = es_get_type(es);
+	if((type == ES_TELETEXT && f->no_teletext) ||
+			(type == ES_SUBTITLE && f->no_subtitles) ||
+			(type == ES_AC3 && f->no_ac3))
+		return false;
+	if((type != ES_AUDIO && type != ES_AC3) || !f->n_audio)
+		return true;
+	if(es_language_selected(f, es))
+		return true;
+
+	/*
+	 * Requested language not available in this stream. Fall back to the
+	 * first eligible audio stream if there is no stream in any of the
+	 * requested languages.
+	 */
+	uint8_t *cur, *first = NULL;
+	for(int j = 0; (cur = pmt_get_es(pmt, j)); j++) {
+		int cur_type = es_get_type(cur);
+		if((cur_type != ES_AUDIO && cur_type != ES_AC3) ||
+				(cur_type == ES_AC3 && f->no_ac3))
+			continue;
+		if(es_language_selected(f, cur))
+			return false;
+		if(!first)
+			first = cur;
+	}
+	return first == es;
+}
+
+/* Check whether PMT pmt references PID pid (as ES or PCR PID) */
+static bool pmt_has_pid(uint8_t *pmt, uint16_t pid) {
+	uint8_t *es;
+	if(pmt_get_pcrpid(pmt) == pid)
+		return true;
+	for(int j = 0; (es = pmt_get_es(pmt, j)); j++)
+		if(pmtn_get_pid(es) == pid)
+			return true;
+	return false;
+}
+
+/*
+ * Register client c for all elementary streams it requested and the PCR PID
+ * referenced by PMT pmt
+ */
+static void subscribe_pmt(struct transponder *a, struct mpeg_client *c, uint8_t *pmt) {
+	uint8_t *es;
+	for(int j = 0; (es = pmt_get_es(pmt, j)); j++) {
+		if(c->filtered && !es_selected(&c->filter, pmt, es))
+			continue;
+		//logger(LOG_NOTICE, "Adding callback for PID %d", pmtn_get_pid(es));
+		register_client(a, c, pmtn_get_pid(es));
+	}
+	register_client(a, c, pmt_get_pcrpid(pmt));
+}
+
+/* Remove client c from PID pid, unless it is a PSI PID */
+static void unsubscribe_pid(struct transponder *a, struct mpeg_client *c, uint16_t pid) {
+	if(pid < MAX_PID && !a->pids[pid].parse)
+		remove_callback(a, pid, c);
+}
+
+/*
+ * Remove client c from all elementary streams and the PCR PID referenced by
+ * PMT pmt
+ */
+static void unsubscribe_pmt(struct transponder *a, struct mpeg_client *c, uint8_t *pmt) {
+	uint8_t *es;
+	for(int j = 0; (es = pmt_get_es(pmt, j)); j++)
+		unsubscribe_pid(a, c, pmtn_get_pid(es));
+	unsubscribe_pid(a, c, pmt_get_pcrpid(pmt));
+}
+
+/*
+ * Remove the unfiltered clients of service svc from PID pid, if it is no
+ * longer referenced by the new PMT new_pmt. Clients keep the PID if another
+ * of their services (see /by-sids/) still uses it, e.g. as PCR PID.
+ */
+static void unsubscribe_stale(struct transponder *a, struct service *svc,
+		uint16_t pid, uint8_t *new_pmt) {
+	/* Never drop PSI PIDs, we subscribed to them for other reasons */
+	if(pid >= MAX_PID || a->pids[pid].parse || pmt_has_pid(new_pmt, pid))
+		return;
+	logger(LOG_DEBUG, "PID %u removed from service %u", pid, svc->sid);
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		bool shared = false;
+		if(c->filtered)
+			continue;
+		for(GSList *s = c->services; s != NULL; s = g_slist_next(s)) {
+			struct service *other = (struct service *) s->data;
+			if(other != svc && other->pmt && pmt_has_pid(other->pmt, pid))
+				shared = true;
 		}
-		if(it2) // Client already registered
+		if(!shared)
+			remove_callback(a, pid, c);
+	}
+}
+
+/*
+ * Build the rewritten PMT for a filtered client from the upstream PMT pmt,
+ * containing only the elementary streams selected by the client
+ */
+static void build_filtered_pmt(struct mpeg_client *c, uint8_t *pmt, uint16_t pid) {
+	uint8_t *out = psi_allocate();
+	uint16_t header = PMT_HEADER_SIZE + pmt_get_desclength(pmt);
+	uint8_t *es, *w;
+
+	/* Header and program descriptors are taken over unmodified */
+	memcpy(out, pmt, header);
+	w = out + header;
+	for(int j = 0; (es = pmt_get_es(pmt, j)); j++) {
+		if(!es_selected(&c->filter, pmt, es))
 			continue;
-		a->pids[pid].callback =
-			g_slist_prepend(a->pids[pid].callback, it->data);
+		uint16_t size = PMT_ES_SIZE + pmtn_get_desclength(es);
+		memcpy(w, es, size);
+		w += size;
+	}
+	pmt_set_length(out, w - out - PMT_HEADER_SIZE);
+	psi_set_crc(out);
+
+	c->pmt_packets = psi_packetize(out, pid, c->pmt_ts);
+	free(out);
+}
+
+/* Send the cached rewritten PMTs to all filtered clients of a service */
+static void send_filtered_pmts(struct service *svc) {
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		if(c->filtered && c->pmt_packets)
+			send_packets(c, c->pmt_ts, c->pmt_packets, &c->pmt_cc);
+	}
+}
+
+/*
+ * Classify the elementary streams of PMT pmt for the overload handling of the
+ * outputs. All audio streams are essential: Clients may have selected any of
+ * them, and the PIDs are shared by all clients.
+ */
+static void classify_pmt(struct transponder *a, uint8_t *pmt) {
+	uint8_t *es;
+	for(int j = 0; (es = pmt_get_es(pmt, j)); j++) {
+		uint16_t pid = pmtn_get_pid(es);
+		if(pid >= MAX_PID || a->pids[pid].parse)
+			continue;
+		switch(es_get_type(es)) {
+			case ES_VIDEO:
+				a->pids[pid].pid_class = PID_CLASS_VIDEO;
+				break;
+			case ES_AUDIO:
+			case ES_AC3:
+				a->pids[pid].pid_class = PID_CLASS_AUDIO;
+				break;
+			default:
+				a->pids[pid].pid_class = PID_CLASS_AUX;
+		}
 	}
 }
 
@@ -158,21 +564,104 @@ static void pmt_handler(struct transponder *a, uint16_t pid, uint8_t *section) {
 
 	//logger(LOG_DEBUG, "Handling new PMT on PID %u", pid);
 
+	struct service *svc = (struct service *) g_hash_table_lookup(a->services,
+			GINT_TO_POINTER(pmt_get_program(section)));
+	if(!svc) {
+		/*
+		 * Nobody is interested in this service. Clients receiving the
+		 * complete transponder still need the streams classified to
+		 * recover from overload at a video random access point.
+		 */
+		if(a->passthrough && pmt_validate(section))
+			classify_pmt(a, section);
+		free(section);
+		return;
+	}
+	if(svc->pmt && section_unchanged(svc->pmt, section)) {
+		if(svc->filtered)
+			send_filtered_pmts(svc);
+		free(section);
+		return;
+	}
+
 	if(!pmt_validate(section)) {
 		free(section);
 		return;
 	}
 
 	uint8_t *es;
+	classify_pmt(a, section);
+
+	if(svc->pmt) {
+		logger(LOG_INFO, "PMT of service %u changed", svc->sid);
+		/* Drop subscriptions for PIDs no longer part of the service */
+		unsubscribe_stale(a, svc, pmt_get_pcrpid(svc->pmt), section);
+		for(j = 0; (es = pmt_get_es(svc->pmt, j)); j++)
+			unsubscribe_stale(a, svc, pmtn_get_pid(es), section);
+		/* The selection of filtered clients might have changed entirely */
+		for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it))
+			if(((struct mpeg_client *) it->data)->filtered)
+				unsubscribe_pmt(a, (struct mpeg_client *) it->data, svc->pmt);
+		free(svc->pmt);
+	}
+	svc->pmt = section;
+
 	// Register callback for all elementary streams for this SID
-	for(j = 0; (es = pmt_get_es(section, j)); j++) {
-		//logger(LOG_NOTICE, "Adding callback for PID %d", pmtn_get_pid(es));
-		register_callback(a->pids[pid].callback, a, pmtn_get_pid(es));
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		subscribe_pmt(a, c, section);
+		if(c->filtered)
+			build_filtered_pmt(c, section, pid);
 	}
-	// ... and for the PCR
-	register_callback(a->pids[pid].callback, a, pmt_get_pcrpid(section));
+	if(svc->filtered)
+		send_filtered_pmts(svc);
+}
 
-	free(section);
+/* Check whether client c requests more than one service */
+static bool is_multi(struct mpeg_client *c) {
+	return c->services && g_slist_next(c->services);
+}
+
+/*
+ * Send the cached PAT of a service to all its clients. Clients requesting
+ * more than one service get their own PAT, see send_multi_pats().
+ */
+static void resend_pat(gpointer key, gpointer value, gpointer data) {
+	struct service *svc = (struct service *) value;
+	if(svc->pat_version < 0)
+		return;
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		if(!is_multi(c))
+			send_packets(c, svc->pat, 1, &c->pid0_cc);
+	}
+}
+
+/* Send the cached PATs of all clients requesting more than one service */
+static void send_multi_pats(struct transponder *a) {
+	for(GSList *it = a->multi; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		send_packets(c, c->pat_ts, 1, &c->pid0_cc);
+	}
+}
+
+/*
+ * Remove the unfiltered clients of service svc from its previous PMT PID
+ * after the PAT announced a new one. Clients still receiving another service
+ * with its PMT on the same PID stay subscribed.
+ */
+static void unsubscribe_old_pmt(struct transponder *a, struct service *svc) {
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		bool shared = false;
+		if(c->filtered)
+			continue;
+		for(GSList *s = c->services; s != NULL; s = g_slist_next(s))
+			if(s->data != svc && ((struct service *) s->data)->pmt_pid == svc->pmt_pid)
+				shared = true;
+		if(!shared)
+			remove_callback(a, svc->pmt_pid, c);
+	}
 }
 
 /*
@@ -187,6 +676,19 @@ static void pat_handler(struct transponder *a, uint16_t pid, uint8_t *section) {
 
 	//logger(LOG_DEBUG, "Handling new PAT");
 
+	/*
+	 * The PAT is usually unchanged. In this case, only send the cached
+	 * reduced PATs.
+	 */
+	uint8_t version = psi_get_version(section);
+	uint32_t crc = section_crc(section);
+	if(a->pat_version == version && a->pat_crc == crc) {
+		g_hash_table_foreach(a->services, resend_pat, NULL);
+		send_multi_pats(a);
+		free(section);
+		return;
+	}
+
 	if(!pat_validate(section)) {
 		free(section);
 		return;
@@ -209,60 +711,92 @@ static void pat_handler(struct transponder *a, uint16_t pid, uint8_t *section) {
 		a->tsid = pat_get_tsid(cur);
 
 		/*
-		 * For every proram in this PAT, check whether we have clients
+		 * For every program in this PAT, check whether we have clients
 		 * that request it. Add callbacks for them, if necessary.
 		 */
 		for(j = 0; (program = pat_get_program(cur, j)); j++) {
 			uint16_t cur_sid = patn_get_program(program);
+			uint16_t pmt_pid = patn_get_pid(program);
 
-			a->pids[patn_get_pid(program)].parse = true; // We always parse all PMTs
+			a->pids[pmt_pid].parse = true; // We always parse all PMTs
+			a->pids[pmt_pid].pid_class = PID_CLASS_PSI;
+
+			struct service *svc = (struct service *)
+				g_hash_table_lookup(a->services, GINT_TO_POINTER(cur_sid));
+			if(!svc)
+				continue;
+
+			if(svc->pmt_pid && svc->pmt_pid != pmt_pid) {
+				logger(LOG_INFO, "PMT PID of service %u changed from %u to %u",
+						svc->sid, svc->pmt_pid, pmt_pid);
+				unsubscribe_old_pmt(a, svc);
+			}
+			/* Rebuild the reduced PAT only if the upstream PAT changed */
+			if(svc->pmt_pid != pmt_pid || svc->pat_version != psi_get_version(cur))
+				build_pat(svc, pmt_pid, psi_get_version(cur));
 
 			/*
-			 * Loop over all registered clients for this transponder.
-			 * This might be expensive, however, PATs are only sent about
-			 * once a second, so this should not hurt.
+			 * Receiving a new PAT from the uplink triggers sending
+			 * the reduced PAT on the remuxed transport streams
 			 */
-			for(GSList *it = a->clients; it != NULL; it = g_slist_next(it)) {
+			for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
 				struct mpeg_client *c = (struct mpeg_client *) it->data;
-				if(c->sid != cur_sid)
-					continue;
-
-				/*
-				 * Receiving a new PAT from the uplink triggers sending
-				 * a new, reduced PAT on the remuxed transport
-				 * streams
-				 */
-				send_pat(c, cur_sid, patn_get_pid(program));
-
-				/*
-				 * If necessary, add this client as callback for the
-				 * referenced PMT.
-				 */
-				GSList *it2;
-				for(it2 = a->pids[patn_get_pid(program)].callback;
-						it2 != NULL; it2 = g_slist_next(it2)) {
-					if(it2->data == c)
-						break;
-				}
-				if(it2) // Callback already registered
-					continue;
-				a->pids[patn_get_pid(program)].callback =
-					g_slist_prepend(a->pids[patn_get_pid(program)].callback, c);
+				if(!is_multi(c))
+					send_packets(c, svc->pat, 1, &c->pid0_cc);
+			}
+
+			/*
+			 * If necessary, add the clients as callback for the
+			 * referenced PMT. Filtered clients get a rewritten PMT
+			 * instead.
+			 */
+			for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+				struct mpeg_client *c = (struct mpeg_client *) it->data;
+				if(!c->filtered)
+					register_client(a, c, pmt_pid);
 			}
 			//logger(LOG_DEBUG, "%d -> %d", patn_get_program(program),
 			//		patn_get_pid(program));
 		}
 	}
 
-	/* Additionally to the PIDs defined in the PMT, we also forward the EPG
-	 * informations to all clients. They always have PID 18. */
-	register_callback(a->clients, a, 18);
-
 	psi_table_free(new_pat);
+	a->pat_version = version;
+	a->pat_crc = crc;
+
+	for(GSList *it = a->multi; it != NULL; it = g_slist_next(it))
+		build_multi_pat((struct mpeg_client *) it->data, version);
+	send_multi_pats(a);
 
 	return;
 }
 
+/*
+ * Process a new EIT section. Sections describing one of the requested
+ * services are re-packetized and sent to the clients of that service,
+ * everything else is dropped.
+ */
+static void eit_handler(struct transponder *a, uint8_t *section) {
+	uint8_t table_id = psi_get_tableid(section);
+	/* Enough packets for a private section of maximum size */
+	static uint8_t ts[(PSI_PRIVATE_MAX_SIZE / (TS_SIZE - TS_HEADER_SIZE) + 2) * TS_SIZE];
+
+	struct service *svc = (struct service *) g_hash_table_lookup(a->services,
+			GINT_TO_POINTER(eit_get_sid(section)));
+	if(!svc || (!eit_schedule && table_id != EIT_TABLE_ID_PF_ACTUAL) ||
+			!eit_validate(section) || !psi_check_crc(section)) {
+		free(section);
+		return;
+	}
+
+	int n = psi_packetize(section, EIT_PID, ts);
+	for(GSList *it = svc->clients; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		send_packets(c, ts, n, &c->eit_cc);
+	}
+	free(section);
+}
+
 static void handle_section(struct transponder *a, uint16_t pid, uint8_t *section) {
 	uint8_t table_pid = psi_get_tableid(section);
 	if(!psi_validate(section)) {
@@ -276,58 +810,146 @@ static void handle_section(struct transponder *a, uint16_t pid, uint8_t *section
 		case PMT_TABLE_ID:
 			pmt_handler(a, pid, section);
 			break;
+		case EIT_TABLE_ID_PF_ACTUAL:
+		case EIT_TABLE_ID_SCHED_ACTUAL_FIRST ... EIT_TABLE_ID_SCHED_ACTUAL_LAST:
+			/* EIT sections about other transponders are never forwarded */
+			if(pid == EIT_PID) {
+				eit_handler(a, section);
+				break;
+			}
+			/* fallthrough */
 		default:
 			free(section);
 	}
 }
 
-void mpeg_input(void *ptr, unsigned char *data, size_t len) {
-	struct transponder *a = (struct transponder *) ptr;
+/*
+ * Finish a bitrate measurement interval: Compute the bitrate of every PID
+ * from its packet count and start the next interval
+ */
+static void update_bitrates(struct transponder *a, int64_t now) {
+	int64_t elapsed = now - a->rate_since;
+	uint64_t total = 0;
+	for(int i = 0; i < MAX_PID; i++) {
+		struct pid_info *p = &a->pids[i];
+		p->bitrate = (uint64_t) p->packets * TS_SIZE * 8 * 1000000 / elapsed;
+		p->packets = 0;
+		total += p->bitrate;
+	}
+	a->bitrate = total;
+	a->rate_since = now;
+}
 
-	if(len % TS_SIZE) {
-		logger(LOG_NOTICE, "Unaligned MPEG-TS packets received, dropping.");
-		return;
+/*
+ * Find the next sync position at or after from: A sync byte followed by
+ * RESYNC_PACKETS - 1 more at packet distance (as far as data is available).
+ * Returns len if there is none.
+ */
+static size_t find_sync(const uint8_t *data, size_t from, size_t len) {
+	for(size_t i = from; i < len; i++) {
+		if(data[i] != TS_SYNC_BYTE)
+			continue;
+		bool found = true;
+		for(size_t pos = i + TS_SIZE; pos < len && pos <= i + (RESYNC_PACKETS - 1) * TS_SIZE;
+				pos += TS_SIZE)
+			if(data[pos] != TS_SYNC_BYTE)
+				found = false;
+		if(found)
+			return i;
 	}
+	return len;
+}
 
-	/*
-	 * Loop over all packets, parse PSI tables, if necessary and forward them
-	 * to all requesting clients
-	 */
-	for(size_t i = 0; i < len; i += TS_SIZE) {
-		uint8_t *cur = data + i;
-		uint16_t pid = ts_get_pid(cur);
-		GSList *it;
+static void process_packets(struct transponder *a, uint8_t *data, size_t len);
 
-		if(pid >= MAX_PID - 1)
-			continue;
+/*
+ * Usually, the dvr device delivers whole, aligned packets. After buffer
+ * overflows or with broken drivers, reads may end with a partial packet or
+ * bytes may be lost in between. The partial packet at the end of a read is
+ * carried over to the next one, and after lost bytes, the input is skipped
+ * up to the next position where several consecutive sync bytes are found.
+ * Aligned runs of packets are processed in place.
+ */
+void mpeg_input(void *ptr, unsigned char *data, size_t len) {
+	struct transponder *a = (struct transponder *) ptr;
+	size_t i = 0;
 
-		// Send packet to clients
-		for(it = a->pids[pid].callback; it != NULL; it = g_slist_next(it)) {
-			struct mpeg_client *c = (struct mpeg_client *) it->data;
-			c->cb(c->ptr, cur, TS_SIZE);
+	if(a->carry_len) {
+		size_t need = TS_SIZE - a->carry_len;
+		if(len < need) {
+			memcpy(a->carry + a->carry_len, data, len);
+			a->carry_len += len;
+			return;
+		}
+		/* The carried packet is only valid if a packet starts after it */
+		if(len == need || data[need] == TS_SYNC_BYTE) {
+			memcpy(a->carry + a->carry_len, data, need);
+			process_packets(a, a->carry, TS_SIZE);
+			i = need;
+		} else {
+			a->resyncs++;
+			a->resync_bytes += a->carry_len;
 		}
+		a->carry_len = 0;
+	}
 
-		if(!a->pids[pid].parse)
+	while(len - i >= TS_SIZE) {
+		/* Find the end of the aligned run starting at i */
+		size_t end = i;
+		while(len - end >= TS_SIZE && data[end] == TS_SYNC_BYTE &&
+				(len - end == TS_SIZE || data[end + TS_SIZE] == TS_SYNC_BYTE))
+			end += TS_SIZE;
+		if(end > i) {
+			process_packets(a, data + i, end - i);
+			i = end;
 			continue;
+		}
+		size_t next = find_sync(data, i + 1, len);
+		logger(LOG_DEBUG, "Lost TS sync, skipping %zu bytes", next - i);
+		a->resyncs++;
+		a->resync_bytes += next - i;
+		i = next;
+	}
+	if(i < len) {
+		if(data[i] == TS_SYNC_BYTE) {
+			memcpy(a->carry, data + i, len - i);
+			a->carry_len = len - i;
+		} else {
+			a->resyncs++;
+			a->resync_bytes += len - i;
+		}
+	}
+}
+
+/* Parse the PSI sections in a run of consecutive packets on PID pid */
+static void parse_run(struct transponder *a, uint16_t pid, uint8_t *data,
+		const uint8_t *flags, size_t n) {
+	struct pid_info *p = &a->pids[pid];
+	for(size_t i = 0; i < n; i++) {
+		uint8_t *cur = data + i * TS_SIZE;
+		uint8_t cc = flags[i] & TS_HDR_CC;
 
 		/* The following code is based on bitstream examples */
 
-		if(ts_check_duplicate(ts_get_cc(cur), a->pids[pid].last_cc) ||
-				!ts_has_payload(cur)) {
+		if(flags[i] & TS_HDR_TEI) {
+			logger(LOG_DEBUG, "Ignoring input packet: transport error");
+			continue;
+		}
+		if(ts_check_duplicate(cc, p->last_cc) || !(flags[i] & TS_HDR_PAYLOAD)) {
 			logger(LOG_DEBUG, "Ignoring input packet: duplicate or no payload");
 			continue;
 		}
-		if(ts_check_discontinuity(ts_get_cc(cur), a->pids[pid].last_cc))
-			psi_assemble_reset(&a->pids[pid].psi_buffer, &a->pids[pid].psi_buffer_used);
+		if(ts_check_discontinuity(cc, p->last_cc))
+			psi_assemble_reset(&p->psi_buffer, &p->psi_buffer_used);
 
-		a->pids[pid].last_cc = ts_get_cc(cur);
+		p->last_cc = cc;
 
 		const uint8_t *payload = ts_section(cur);
-		uint8_t length = data + TS_SIZE - payload;
+		uint8_t length = cur + TS_SIZE - payload;
 
-		if(!psi_assemble_empty(&a->pids[pid].psi_buffer, &a->pids[pid].psi_buffer_used)) {
-			uint8_t *section = psi_assemble_payload(&a->pids[pid].psi_buffer,
-					&a->pids[pid].psi_buffer_used, &payload, &length);
+		if(!psi_assemble_empty(&p->psi_buffer, &p->psi_buffer_used)) {
+			uint8_t *section = psi_assemble_payload(&p->psi_buffer,
+					&p->psi_buffer_used, &payload, &length);
 			if(section)
 				handle_section(a, pid, section);
 		}
@@ -336,14 +958,119 @@ void mpeg_input(void *ptr, unsigned char *data, size_t len) {
 		length = cur + TS_SIZE - payload;
 
 		while(length) {
-			uint8_t *section = psi_assemble_payload(&a->pids[pid].psi_buffer,
-					&a->pids[pid].psi_buffer_used, &payload, &length);
+			uint8_t *section = psi_assemble_payload(&p->psi_buffer,
+					&p->psi_buffer_used, &payload, &length);
 			if(section)
 				handle_section(a, pid, section);
 		}
 	}
 }
 
+/*
+ * Forward a run of consecutive packets on the same PID to the clients and
+ * parse the PSI tables on it, if necessary. Specialized for the shape of the
+ * subscription table of the transponder, see select_dispatch().
+ */
+template<int shape>
+static inline void process_run(struct transponder *a, uint16_t pid, uint8_t *data,
+		const uint8_t *flags, size_t n) {
+	if(pid >= MAX_PID - 1)
+		return;
+	struct pid_info *p = &a->pids[pid];
+	p->packets += n;
+
+	// Send packets to clients
+	if(shape == DISPATCH_SINGLE) {
+		if(p->callback) {
+			struct mpeg_client *c = (struct mpeg_client *) p->callback->data;
+			c->cb(c->ptr, data, n * TS_SIZE);
+		}
+	} else if(shape == DISPATCH_GENERIC) {
+		for(GSList *it = p->callback; it != NULL; it = g_slist_next(it)) {
+			struct mpeg_client *c = (struct mpeg_client *) it->data;
+			c->cb(c->ptr, data, n * TS_SIZE);
+		}
+	}
+
+	if(p->parse)
+		parse_run(a, pid, data, flags, n);
+}
+
+/*
+ * Decode the packet headers in batches, then forward runs of packets on
+ * the same PID to the requesting clients at once and parse PSI tables,
+ * if necessary
+ */
+template<int shape>
+static void dispatch_packets(struct transponder *a, uint8_t *data, size_t len) {
+	struct ts_headers h;
+	size_t packets = len / TS_SIZE;
+	for(size_t base = 0; base < packets; base += TS_DECODE_BATCH) {
+		uint8_t *batch = data + base * TS_SIZE;
+		size_t n = MIN(packets - base, (size_t) TS_DECODE_BATCH);
+		ts_decode_headers(batch, n, &h);
+		for(size_t i = 0; i < n;) {
+			uint16_t pid = h.pid[i];
+			size_t run = 1;
+			if(h.flags[i] & TS_HDR_INVALID) {
+				i++;
+				continue;
+			}
+			while(i + run < n && h.pid[i + run] == pid && !(h.flags[i + run] & TS_HDR_INVALID))
+				run++;
+			process_run<shape>(a, pid, batch + i * TS_SIZE, h.flags + i, run);
+			i += run;
+		}
+	}
+}
+
+/*
+ * Select the dispatch kernel matching the subscription table. Called
+ * whenever the number of clients on a PID changes.
+ */
+static void select_dispatch(struct transponder *a) {
+	if(!a->subscribed_pids)
+		a->dispatch = dispatch_packets<DISPATCH_NONE>;
+	else if(!a->shared_pids)
+		a->dispatch = dispatch_packets<DISPATCH_SINGLE>;
+	else
+		a->dispatch = dispatch_packets<DISPATCH_GENERIC>;
+}
+
+/* Process aligned TS packets */
+static void process_packets(struct transponder *a, uint8_t *data, size_t len) {
+	int64_t now = g_get_monotonic_time();
+	if(now - a->rate_since >= BITRATE_INTERVAL * 1000000)
+		update_bitrates(a, now);
+
+	/*
+	 * Clients requesting the complete transponder get the input buffer
+	 * in one piece, without any per-PID processing
+	 */
+	for(GSList *it = a->passthrough; it != NULL; it = g_slist_next(it)) {
+		struct mpeg_client *c = (struct mpeg_client *) it->data;
+		c->cb(c->ptr, data, len);
+	}
+
+	a->dispatch(a, data, len);
+}
+
+/*
+ * Free a transponder after its last client has quit
+ */
+static void transponder_free(struct transponder *t) {
+	if(t->frontend_handle)
+		frontend_release(t->frontend_handle);
+	for(int i = 0; i < MAX_PID; i++) {
+		psi_assemble_reset(&t->pids[i].psi_buffer, &t->pids[i].psi_buffer_used);
+		g_slist_free(t->pids[i].callback);
+	}
+	g_hash_table_destroy(t->services);
+	g_slist_free(t->clients);
+	transponders = g_slist_remove(transponders, t);
+	g_slice_free1(sizeof(struct transponder), t);
+}
+
 /*
  * Called if transponder times out waiting for data
  */
@@ -351,6 +1078,9 @@ void mpeg_notify_timeout(void *handle) {
 	struct transponder *t = (struct transponder *) handle;
 	t->retry_count++;
 	frontend_release(t->frontend_handle);
+	t->frontend_handle = NULL;
+	/* Don't mix the data of different frontends */
+	t->carry_len = 0;
 	if(t->retry_count <= MAX_TRANSPONDER_RETRIES) {
 		/* If possible, acquire new frontend as a replacement */
 		t->frontend_handle = frontend_acquire(t->in, t);
@@ -359,39 +1089,187 @@ void mpeg_notify_timeout(void *handle) {
 		/* No replacement found. Disconnect all clients on this
 		 * transponder */
 		logger(LOG_ERR, "Unable to acquire transponder while looking for replacement after timeout");
+		/* Timeout callbacks may unregister other clients as well (e.g. a
+		 * recorder kept alive by the client), so hold a reference on the
+		 * transponder and skip clients that are already gone */
+		t->users++;
 		GSList *copy = g_slist_copy(t->clients);
 		for(GSList *it = copy; it; it = g_slist_next(it)) {
 			struct mpeg_client *scb = (struct mpeg_client *) it->data;
-			scb->timeout_cb(scb->ptr);
+			if(g_slist_find(t->clients, scb))
+				scb->timeout_cb(scb->ptr);
 		}
 		g_slist_free(copy);
+		if(!--t->users)
+			transponder_free(t);
 	} else {
 		logger(LOG_NOTICE, "Switched frontend after frontend error, retry count: %d", t->retry_count);
 	}
 }
 
-void *mpeg_register(struct tune s, void (*cb) (void *, const uint8_t *, uint16_t),
+/*
+ * Sum of the bitrates of the PIDs of a service client c receives, i.e. only
+ * the selected elementary streams for filtered clients
+ */
+static uint64_t service_bitrate(struct transponder *t, struct service *svc,
+		struct mpeg_client *c) {
+	uint64_t rate = t->pids[0].bitrate;
+	if(svc->pmt_pid)
+		rate += t->pids[svc->pmt_pid].bitrate;
+	if(!svc->pmt)
+		return rate;
+	uint16_t pcrpid = pmt_get_pcrpid(svc->pmt);
+	bool pcr_counted = false;
+	uint8_t *es;
+	for(int j = 0; (es = pmt_get_es(svc->pmt, j)); j++) {
+		uint16_t pid = pmtn_get_pid(es);
+		if(pid >= MAX_PID || (c->filtered && !es_selected(&c->filter, svc->pmt, es)))
+			continue;
+		rate += t->pids[pid].bitrate;
+		if(pid == pcrpid)
+			pcr_counted = true;
+	}
+	if(!pcr_counted && pcrpid < MAX_PID)
+		rate += t->pids[pcrpid].bitrate;
+	return rate;
+}
+
+void mpeg_get_resyncs(void *handle, uint64_t *resyncs, uint64_t *bytes) {
+	struct transponder *t = (struct transponder *) handle;
+	*resyncs = t->resyncs;
+	*bytes = t->resync_bytes;
+}
+
+uint64_t mpeg_get_bitrate(void *ptr) {
+	struct mpeg_client *scb = (struct mpeg_client *) ptr;
+	struct transponder *t = scb->t;
+	if(scb->passthrough)
+		return t->bitrate;
+	uint64_t rate = 0;
+	for(GSList *it = scb->services; it != NULL; it = g_slist_next(it))
+		rate += service_bitrate(t, (struct service *) it->data, scb);
+	return rate;
+}
+
+int mpeg_get_pid_class(void *ptr, uint16_t pid) {
+	struct mpeg_client *scb = (struct mpeg_client *) ptr;
+	if(pid >= MAX_PID)
+		return PID_CLASS_AUX;
+	return scb->t->pids[pid].pid_class;
+}
+
+/*
+ * Add a client to service sid on its transponder, creating the service if
+ * necessary
+ */
+static void add_to_service(struct transponder *t, struct mpeg_client *scb, uint16_t sid) {
+	struct service *svc = (struct service *)
+		g_hash_table_lookup(t->services, GINT_TO_POINTER(sid));
+	if(!svc) {
+		svc = (struct service *) g_slice_alloc(sizeof(struct service));
+		svc->sid = sid;
+		svc->pmt_pid = 0;
+		svc->pat_version = -1;
+		svc->pmt = NULL;
+		svc->clients = NULL;
+		svc->filtered = 0;
+		g_hash_table_insert(t->services, GINT_TO_POINTER(sid), svc);
+		/* Look up the new service in the next PAT, even if unchanged */
+		t->pat_version = -1;
+	} else {
+		/*
+		 * Unchanged PATs and PMTs are skipped, so subscribe the new
+		 * client from the cached tables of the service
+		 */
+		if(svc->pmt_pid && !scb->filtered)
+			register_client(t, scb, svc->pmt_pid);
+		if(svc->pmt) {
+			subscribe_pmt(t, scb, svc->pmt);
+			if(scb->filtered)
+				build_filtered_pmt(scb, svc->pmt, svc->pmt_pid);
+		}
+	}
+	svc->clients = g_slist_prepend(svc->clients, scb);
+	if(scb->filtered)
+		svc->filtered++;
+	scb->services = g_slist_append(scb->services, svc);
+}
+
+/*
+ * Remove a client from all services it requested, freeing services no other
+ * client is interested in
+ */
+static void remove_from_services(struct transponder *t, struct mpeg_client *scb) {
+	for(GSList *it = scb->services; it != NULL; it = g_slist_next(it)) {
+		struct service *svc = (struct service *) it->data;
+		svc->clients = g_slist_remove(svc->clients, scb);
+		if(scb->filtered)
+			svc->filtered--;
+		if(svc->clients)
+			continue;
+		g_hash_table_remove(t->services, GINT_TO_POINTER(svc->sid));
+		free(svc->pmt);
+		g_slice_free1(sizeof(struct service), svc);
+	}
+	g_slist_free(scb->services);
+	scb->services = NULL;
+}
+
+/*
+ * Attach a new client to transponder t and the services it requests
+ */
+static void attach_client(struct transponder *t, struct mpeg_client *scb,
+		const uint16_t *sids, int n_sids) {
+	scb->t = t;
+	t->clients = g_slist_prepend(t->clients, scb);
+	if(!n_sids) {
+		scb->passthrough = true;
+		t->passthrough = g_slist_prepend(t->passthrough, scb);
+		return;
+	}
+	for(int i = 0; i < n_sids; i++)
+		add_to_service(t, scb, sids[i]);
+	if(n_sids > 1)
+		t->multi = g_slist_prepend(t->multi, scb);
+}
+
+/*
+ * Register a new client. See mpeg_register() and mpeg_register_multi().
+ */
+static void *add_client(struct tune s, const uint16_t *sids, int n_sids,
+		const struct mpeg_filter *f, void (*cb) (void *, const uint8_t *, size_t),
 		void (*timeout_cb) (void *), void *ptr) {
 	struct mpeg_client *scb = (struct mpeg_client *) g_slice_alloc(sizeof(struct mpeg_client));
 	scb->cb = cb;
 	scb->timeout_cb = timeout_cb;
 	scb->ptr = ptr;
-	scb->sid = s.sid;
+	scb->services = NULL;
+	scb->passthrough = false;
 	scb->pid0_cc = 0;
+	scb->eit_cc = 0;
+	scb->filtered = f != NULL;
+	if(f)
+		scb->filter = *f;
+	scb->pmt_packets = 0;
+	scb->pmt_cc = 0;
 
 	/* Check whether we are already receiving a multiplex containing
-	 * the requested program */
+	 * the requested program. Services from the channel index carry the
+	 * number of their transponder. */
 	GSList *it = transponders;
 	for(; it != NULL; it = g_slist_next(it)) {
 		struct transponder *t = (struct transponder *) it->data;
 		struct tune in = t->in;
-		if(in.delivery_system == s.delivery_system &&
+		if(in.transponder && s.transponder ? in.transponder == s.transponder :
+				in.delivery_system == s.delivery_system &&
 				in.dvbs.symbol_rate == s.dvbs.symbol_rate &&
 				in.dvbs.frequency == s.dvbs.frequency &&
 				in.dvbs.polarization == s.dvbs.polarization) {
 			t->users++;
-			t->clients = g_slist_prepend(t->clients, scb);
-			scb->t = t;
+			attach_client(t, scb, sids, n_sids);
+			/* Build the PAT right away if the services are already known */
+			if(n_sids > 1 && t->pat_version >= 0)
+				build_multi_pat(scb, t->pat_version);
 			logger(LOG_DEBUG, "New client on known transponder. New client count: %d",
 					t->users);
 			return scb;
@@ -411,40 +1289,65 @@ void *mpeg_register(struct tune s, void (*cb) (void *, const uint8_t *, uint16_t
 	t->in = s;
 	t->users = 1;
 	t->clients = NULL;
-	t->clients = g_slist_prepend(t->clients, scb);
+	t->multi = NULL;
+	t->passthrough = NULL;
 	t->retry_count = 0;
-	scb->t = t;
+	t->services = g_hash_table_new(g_direct_hash, g_direct_equal);
+	t->pat_version = -1;
+	t->rate_since = g_get_monotonic_time();
+	t->bitrate = 0;
+	t->carry_len = 0;
+	t->resyncs = t->resync_bytes = 0;
+	t->subscribed_pids = t->shared_pids = 0;
+	select_dispatch(t);
 	for(int i = 0; i < MAX_PID; i++) {
+		t->pids[i].packets = t->pids[i].bitrate = 0;
 		t->pids[i].last_cc = 0;
 		t->pids[i].callback = NULL;
+		t->pids[i].parse = false;
+		t->pids[i].pid_class = PID_CLASS_AUDIO;
 		psi_assemble_init(&t->pids[i].psi_buffer, &t->pids[i].psi_buffer_used);
 	}
 	t->pids[0].parse = true; // Always parse the PAT
+	t->pids[0].pid_class = PID_CLASS_PSI;
+	t->pids[EIT_PID].parse = true; // EIT is filtered per service
+	t->pids[EIT_PID].pid_class = PID_CLASS_AUX;
+	attach_client(t, scb, sids, n_sids);
 	transponders = g_slist_prepend(transponders, t);
 	return scb;
 }
 
+void *mpeg_register(struct tune s, const struct mpeg_filter *f,
+		void (*cb) (void *, const uint8_t *, size_t),
+		void (*timeout_cb) (void *), void *ptr) {
+	uint16_t sid = s.sid;
+	return add_client(s, &sid, 1, f, cb, timeout_cb, ptr);
+}
+
+void *mpeg_register_multi(struct tune s, const uint16_t *sids, int n_sids,
+		void (*cb) (void *, const uint8_t *, size_t),
+		void (*timeout_cb) (void *), void *ptr) {
+	return add_client(s, sids, n_sids, NULL, cb, timeout_cb, ptr);
+}
+
 void mpeg_unregister(void *ptr) {
 	struct mpeg_client *scb = (struct mpeg_client *) ptr;
 	struct transponder *t = scb->t;
 	t->users--;
+	remove_from_services(t, scb);
+	t->multi = g_slist_remove(t->multi, scb);
+	t->passthrough = g_slist_remove(t->passthrough, scb);
 	if(!t->users) { // Completely remove transponder
-		if(t->frontend_handle)
-			frontend_release(t->frontend_handle);
-		for(int i = 0; i < MAX_PID; i++) {
-			psi_assemble_reset(&t->pids[i].psi_buffer, &t->pids[i].psi_buffer_used);
-			g_slist_free(t->pids[i].callback);
-		}
 		g_slice_free1(sizeof(struct mpeg_client), scb);
-		transponders = g_slist_remove(transponders, t);
-		g_slice_free1(sizeof(struct transponder), t);
+		transponder_free(t);
 	} else { // Only unregister this client
 		/*
 		 * Iterate over all callbacks and remove this client from them.  This
 		 * is expensive, however, disconnects should be rather rare.
 		 */
 		for(int i=0; i < MAX_PID; i++)
-			t->pids[i].callback = g_slist_remove(t->pids[i].callback, scb);
+			if(t->pids[i].callback)
+				remove_callback(t, i, scb);
 		t->clients = g_slist_remove(t->clients, scb);
 		g_slice_free1(sizeof(struct mpeg_client), scb);
 		logger(LOG_INFO, "Client quitted, new transponder user count: %d",
@@ -8,6 +8,34 @@
 
 #define MAX_PID 0x2000
 
+/**
+ * Importance classes of the PIDs of a transport stream, in ascending order.
+ * Output modules use them to decide which packets to drop first if a client
+ * cannot keep up with the stream.
+ */
+enum mpeg_pid_class {
+	PID_CLASS_AUX,		/**< EIT, teletext, subtitles */
+	PID_CLASS_AUDIO,	/**< Audio and not (yet) classified PIDs */
+	PID_CLASS_VIDEO,	/**< Video */
+	PID_CLASS_PSI		/**< PAT and PMTs */
+};
+
+/**
+ * Selection of elementary streams requested by a client. Clients with a
+ * filter get a rewritten PMT and are only subscribed to the selected streams.
+ */
+struct mpeg_filter {
+	/** Preferred audio languages (ISO 639-2 codes). If none of them is
+	 * available, the first audio stream is selected. No preference selects
+	 * all audio streams. */
+	char audio[4][4];
+	int n_audio;
+	/** Drop teletext, DVB subtitle or AC-3 streams, respectively */
+	bool no_teletext;
+	bool no_subtitles;
+	bool no_ac3;
+};
+
 /**
  * Callback for new MPEG-TS input data. Called by the frontend module
  * when reading from frontend succeeded and data is ready for parsing.
@@ -24,12 +52,30 @@ void mpeg_input(void *handle, unsigned char *data, size_t len);
  * pointer to an arbitrary data structure that will be provided unchanged to
  * the callback.
  * @param s Requested program
+ * @param f Elementary stream selection, NULL to get all streams of the program
  * @param cb Callback to invoke when new data is ready
  * @param timeout_cb Callback to invoke on frontend tune timeout
  * @param ptr Pointer to be passed to the callback when invoked
  * @return Pointer to client handle, to be passed to mpeg_unregister()
  */
-void *mpeg_register(struct tune s, void (*cb) (void *, const uint8_t *buf, uint16_t bufsize),
+void *mpeg_register(struct tune s, const struct mpeg_filter *f,
+		void (*cb) (void *, const uint8_t *buf, size_t bufsize),
+		void (*timeout_cb) (void *), void *ptr);
+/**
+ * Register new client requesting several programs of the same transponder,
+ * or the complete transponder. The client gets a PAT listing all requested
+ * programs. Clients requesting the complete transponder get the input
+ * unmodified, without any remultiplexing.
+ * @param s Requested transponder, s.sid is ignored
+ * @param sids List of requested programs
+ * @param n_sids Number of entries in sids, 0 to request the complete transponder
+ * @param cb Callback to invoke when new data is ready
+ * @param timeout_cb Callback to invoke on frontend tune timeout
+ * @param ptr Pointer to be passed to the callback when invoked
+ * @return Pointer to client handle, to be passed to mpeg_unregister()
+ */
+void *mpeg_register_multi(struct tune s, const uint16_t *sids, int n_sids,
+		void (*cb) (void *, const uint8_t *buf, size_t bufsize),
 		void (*timeout_cb) (void *), void *ptr);
 /**
  * Deregister a specific client
@@ -40,5 +86,26 @@ void mpeg_unregister(void *ptr);
  * Called by the frontend module when tuning times out.
  */
 void mpeg_notify_timeout(void *handle);
+/**
+ * Get the importance class (enum mpeg_pid_class) of a PID, as determined
+ * from the PAT and PMTs of the transponder the client is subscribed to.
+ * @param ptr Client handle returned by mpeg_register()
+ * @param pid PID to look up
+ */
+int mpeg_get_pid_class(void *ptr, uint16_t pid);
+/**
+ * Get the bitrate of the data sent to a client, as measured over the last
+ * few seconds. For service clients, this is the sum of the bitrates of all
+ * PIDs belonging to the requested services.
+ * @param ptr Client handle returned by mpeg_register()
+ * @return Bitrate in bit/s, 0 if not yet known
+ */
+uint64_t mpeg_get_bitrate(void *ptr);
+/**
+ * Get the number of times the input of a transponder lost TS sync, and the
+ * number of bytes skipped because of this.
+ * @param handle Transponder handle passed to frontend_acquire()
+ */
+void mpeg_get_resyncs(void *handle, uint64_t *resyncs, uint64_t *bytes);
 
 #endif
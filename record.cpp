@@ -0,0 +1,476 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include <event.h>
+#include <bitstream/mpeg/ts.h>
+#include "record.h"
+#include "channels.h"
+#include "mpeg.h"
+#include "log.h"
+#include "affinity.h"
+#include "tvoe.h"
+
+/*
+ * Built-in recorder: Each recording job is registered with the MPEG module
+ * like an HTTP client while it is running, so recordings do not need any
+ * additional sockets or copies.
+ *
+ * The received packets are collected into aligned blocks of RECORD_BLOCK
+ * bytes. Full blocks are handed to a writer thread per job, which writes
+ * them using O_DIRECT (if supported by the file system) and returns them.
+ * Every job has a fixed pool of RECORD_BLOCKS blocks. If the disk is too
+ * slow and no free block is left, data is dropped: a slow disk must never
+ * stall the event loop shared by all clients. Blocks hold a whole number of
+ * TS packets, so only complete packets are dropped.
+ */
+
+/* Size and alignment of the blocks written to disk. The block size is a
+ * multiple of both, the TS packet size and the alignment (about 750 KB). */
+#define RECORD_ALIGN 4096
+#define RECORD_BLOCK (TS_SIZE * RECORD_ALIGN)
+/* Number of blocks per job, i.e. maximum amount of data buffered */
+#define RECORD_BLOCKS 32
+/* Delay between attempts to start a recording if no tuner is available (in s) */
+#define RECORD_RETRY_DELAY 10
+
+enum job_state {
+	JOB_SCHEDULED,
+	JOB_RECORDING,
+	JOB_DONE,
+	JOB_CANCELLED,
+	JOB_FAILED
+};
+static const char *state_names[] = { "scheduled", "recording", "done", "cancelled", "failed" };
+
+struct block {
+	uint8_t *data;			/**< RECORD_ALIGN aligned, RECORD_BLOCK bytes */
+	size_t len;
+};
+
+/* Marks the end of the recording in the queue of full blocks */
+static struct block finish;
+
+struct job {
+	int id;
+	unsigned int sid;
+	char name[64];
+	time_t start, stop;
+	char path[512];
+	enum job_state state;
+	void *mpeg_handle;		/**< Handle returned by mpeg_register(), if recording */
+	struct event *startev, *stopev, *retryev;
+	GThread *writer;		/**< Writer thread, NULL if not started */
+
+	/* Block currently being filled, NULL if none */
+	struct block *cur;
+	/* Blocks to be written, and blocks available for filling */
+	GAsyncQueue *full, *empty;
+	uint64_t received;		/**< Bytes received from the MPEG module */
+	uint64_t dropped;		/**< Bytes dropped because no block was free */
+	int queued_max;			/**< High watermark of queued blocks */
+
+	/* Shared with the writer thread, protected by lock */
+	GMutex lock;
+	int queued;				/**< Blocks queued for writing */
+	uint64_t written;		/**< Bytes written to disk */
+	int64_t write_time;		/**< Time spent in write calls (us) */
+	bool write_error;
+	bool direct;			/**< File is opened with O_DIRECT */
+};
+
+static char *directory;
+static GSList *jobs;
+static int next_id = 1;
+static bool initialized;
+
+static void job_start(struct job *j);
+static void job_finish(struct job *j, enum job_state state);
+static void writer_done_cb(evutil_socket_t fd, short events, void *p);
+
+/************** Called in the writer threads ***************/
+
+/* Write one block, padded to RECORD_ALIGN if necessary (only the last one) */
+static bool write_block(struct job *j, int fd, struct block *b) {
+	size_t len = b->len;
+	if(len % RECORD_ALIGN) {
+		size_t padded = len + RECORD_ALIGN - len % RECORD_ALIGN;
+		memset(b->data + len, 0x0, padded - len);
+		len = padded;
+	}
+	int64_t start = g_get_monotonic_time();
+	size_t done = 0;
+	while(done < len) {
+		ssize_t ret = write(fd, b->data + done, len - done);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			logger(LOG_ERR, "[record %d] Write to %s failed: %s", j->id, j->path, strerror(errno));
+			return false;
+		}
+		done += ret;
+	}
+	g_mutex_lock(&j->lock);
+	j->written += b->len;
+	j->write_time += g_get_monotonic_time() - start;
+	g_mutex_unlock(&j->lock);
+	return true;
+}
+
+static gpointer record_writer(gpointer p) {
+	struct job *j = (struct job *) p;
+	affinity_thread(AFFINITY_WORKER, "record_writer");
+	bool direct = true;
+	int fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if(fd < 0 && errno == EINVAL) {
+		/* File system does not support O_DIRECT */
+		direct = false;
+		fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(fd < 0)
+		logger(LOG_ERR, "[record %d] Unable to open %s: %s", j->id, j->path, strerror(errno));
+	g_mutex_lock(&j->lock);
+	j->direct = direct;
+	j->write_error = fd < 0;
+	g_mutex_unlock(&j->lock);
+
+	bool ok = fd >= 0;
+	for(;;) {
+		struct block *b = (struct block *) g_async_queue_pop(j->full);
+		if(b == &finish)
+			break;
+		if(ok && !write_block(j, fd, b)) {
+			ok = false;
+			g_mutex_lock(&j->lock);
+			j->write_error = true;
+			g_mutex_unlock(&j->lock);
+		}
+		b->len = 0;
+		g_mutex_lock(&j->lock);
+		j->queued--;
+		g_mutex_unlock(&j->lock);
+		g_async_queue_push(j->empty, b);
+	}
+
+	if(fd >= 0) {
+		/* Remove the padding of the last block */
+		g_mutex_lock(&j->lock);
+		off_t len = j->written;
+		g_mutex_unlock(&j->lock);
+		if(ftruncate(fd, len) < 0)
+			logger(LOG_ERR, "[record %d] Unable to truncate %s: %s", j->id, j->path, strerror(errno));
+		close(fd);
+	}
+	/* All blocks have been returned by now */
+	for(int i = 0; i < RECORD_BLOCKS; i++) {
+		struct block *b = (struct block *) g_async_queue_pop(j->empty);
+		free(b->data);
+		delete b;
+	}
+	g_async_queue_unref(j->full);
+	g_async_queue_unref(j->empty);
+	logger(LOG_INFO, "[record %d] Recording %s closed", j->id, j->path);
+	affinity_thread_exit();
+	/* The job is freed in the main control flow */
+	assert(event_base_once(evbase, -1, EV_TIMEOUT, writer_done_cb, j, NULL) != -1);
+	return NULL;
+}
+
+/****************************** Main control flow ************************/
+
+/*
+ * Callback for new MPEG-TS data, see mpeg_register(). The MPEG module only
+ * passes complete packets, and blocks are filled with complete packets.
+ */
+static void record_input(void *p, const uint8_t *buf, size_t bufsize) {
+	struct job *j = (struct job *) p;
+	j->received += bufsize;
+	while(bufsize) {
+		if(!j->cur && !(j->cur = (struct block *) g_async_queue_try_pop(j->empty))) {
+			/* Disk is too slow, all blocks are queued for writing */
+			if(!j->dropped)
+				logger(LOG_NOTICE, "[record %d] Disk too slow, dropping data", j->id);
+			j->dropped += bufsize;
+			return;
+		}
+		size_t chunk = MIN(bufsize, RECORD_BLOCK - j->cur->len);
+		memcpy(j->cur->data + j->cur->len, buf, chunk);
+		j->cur->len += chunk;
+		buf += chunk;
+		bufsize -= chunk;
+		if(j->cur->len < RECORD_BLOCK)
+			break;
+		g_mutex_lock(&j->lock);
+		int queued = ++j->queued;
+		g_mutex_unlock(&j->lock);
+		j->queued_max = MAX(j->queued_max, queued);
+		g_async_queue_push(j->full, j->cur);
+		j->cur = NULL;
+	}
+}
+
+/* Called by the MPEG module if the frontend failed */
+static void record_timeout(void *p) {
+	struct job *j = (struct job *) p;
+	logger(LOG_NOTICE, "[record %d] Frontend failed, retrying in %d seconds", j->id,
+			RECORD_RETRY_DELAY);
+	mpeg_unregister(j->mpeg_handle);
+	j->mpeg_handle = NULL;
+	struct timeval tv = { RECORD_RETRY_DELAY, 0 };
+	evtimer_add(j->retryev, &tv);
+}
+
+/* Register job with the MPEG module, retry later if that fails */
+static void job_register(struct job *j) {
+	struct tune t;
+	if(!channel_find_sid(j->sid, &t)) {
+		logger(LOG_ERR, "[record %d] Unknown service %u", j->id, j->sid);
+		job_finish(j, JOB_FAILED);
+		return;
+	}
+	j->mpeg_handle = mpeg_register(t, NULL, record_input, record_timeout, j);
+	if(j->mpeg_handle)
+		return;
+	logger(LOG_NOTICE, "[record %d] No tuner available, retrying in %d seconds", j->id,
+			RECORD_RETRY_DELAY);
+	struct timeval tv = { RECORD_RETRY_DELAY, 0 };
+	evtimer_add(j->retryev, &tv);
+}
+
+static void start_cb(evutil_socket_t fd, short events, void *p) {
+	job_start((struct job *) p);
+}
+
+static void stop_cb(evutil_socket_t fd, short events, void *p) {
+	job_finish((struct job *) p, JOB_DONE);
+}
+
+static void retry_cb(evutil_socket_t fd, short events, void *p) {
+	struct job *j = (struct job *) p;
+	if(j->state == JOB_RECORDING && !j->mpeg_handle)
+		job_register(j);
+}
+
+/* Start recording: Set up blocks and writer thread, and register the job */
+static void job_start(struct job *j) {
+	char date[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(date, sizeof(date), "%Y%m%d-%H%M", &tm);
+	snprintf(j->path, sizeof(j->path), "%s/%s-%s.ts", directory, j->name, date);
+	/*
+	 * Don't overwrite a file of the same minute, e.g. one still being
+	 * finished by the previous process after an upgrade
+	 */
+	for(int n = 2; access(j->path, F_OK) == 0; n++)
+		snprintf(j->path, sizeof(j->path), "%s/%s-%s-%d.ts", directory, j->name, date, n);
+
+	j->full = g_async_queue_new();
+	j->empty = g_async_queue_new();
+	for(int i = 0; i < RECORD_BLOCKS; i++) {
+		struct block *b = new struct block;
+		if(posix_memalign((void **) &b->data, RECORD_ALIGN, RECORD_BLOCK)) {
+			logger(LOG_ERR, "[record %d] Unable to allocate buffers", j->id);
+			abort();
+		}
+		b->len = 0;
+		g_async_queue_push(j->empty, b);
+	}
+	j->cur = NULL;
+	j->queued = j->queued_max = 0;
+	j->state = JOB_RECORDING;
+	j->writer = g_thread_new("record_writer", record_writer, j);
+	logger(LOG_INFO, "[record %d] Recording service %u to %s", j->id, j->sid, j->path);
+
+	struct timeval tv = { j->stop - now > 0 ? j->stop - now : 0, 0 };
+	evtimer_add(j->stopev, &tv);
+	job_register(j);
+}
+
+/* Free a job that is no longer scheduled or running */
+static void job_free(struct job *j) {
+	jobs = g_slist_remove(jobs, j);
+	event_free(j->startev);
+	event_free(j->stopev);
+	event_free(j->retryev);
+	g_mutex_clear(&j->lock);
+	delete j;
+}
+
+/* libevent callback: The writer thread of a finished job has closed the file */
+static void writer_done_cb(evutil_socket_t fd, short events, void *p) {
+	struct job *j = (struct job *) p;
+	g_thread_join(j->writer);
+	job_free(j);
+}
+
+/*
+ * Stop or cancel a job. The writer thread finishes writing in the background,
+ * the job is freed once it is done. j must not be used afterwards.
+ */
+static void job_finish(struct job *j, enum job_state state) {
+	event_del(j->startev);
+	event_del(j->stopev);
+	event_del(j->retryev);
+	if(j->state == JOB_RECORDING) {
+		if(j->mpeg_handle)
+			mpeg_unregister(j->mpeg_handle);
+		j->mpeg_handle = NULL;
+		if(j->cur) {
+			g_async_queue_push(j->full, j->cur);
+			j->cur = NULL;
+		}
+		g_async_queue_push(j->full, &finish);
+		logger(LOG_INFO, "[record %d] Recording stopped", j->id);
+	}
+	j->state = state;
+	if(!j->writer)
+		job_free(j);
+}
+
+/* Arm the start timer of a job, or start it right away. See job_finish(). */
+static void job_schedule(struct job *j) {
+	time_t now = time(NULL);
+	if(j->stop <= now) {
+		logger(LOG_NOTICE, "[record %d] Recording is in the past, ignoring", j->id);
+		job_finish(j, JOB_DONE);
+		return;
+	}
+	if(j->start <= now) {
+		job_start(j);
+		return;
+	}
+	struct timeval tv = { j->start - now, 0 };
+	evtimer_add(j->startev, &tv);
+}
+
+void record_set_directory(const char *dir) {
+	free(directory);
+	directory = strdup(dir);
+}
+
+int record_add(unsigned int sid, time_t start, int duration, const char *name) {
+	if(!name || !*name || strchr(name, '/') || duration <= 0)
+		return -1;
+	if(initialized && !directory)
+		return -2;
+	struct job *j = new struct job;
+	j->id = next_id++;
+	j->sid = sid;
+	snprintf(j->name, sizeof(j->name), "%s", name);
+	j->start = start ? start : time(NULL);
+	j->stop = j->start + duration;
+	j->path[0] = 0;
+	j->state = JOB_SCHEDULED;
+	j->mpeg_handle = NULL;
+	j->cur = NULL;
+	j->full = j->empty = NULL;
+	j->received = j->dropped = 0;
+	j->queued = j->queued_max = 0;
+	g_mutex_init(&j->lock);
+	j->written = 0;
+	j->write_time = 0;
+	j->write_error = false;
+	j->direct = false;
+	j->startev = evtimer_new(evbase, start_cb, j);
+	j->stopev = evtimer_new(evbase, stop_cb, j);
+	j->retryev = evtimer_new(evbase, retry_cb, j);
+	j->writer = NULL;
+	jobs = g_slist_append(jobs, j);
+	int id = j->id;
+	if(initialized)
+		job_schedule(j);
+	return id;
+}
+
+bool record_stop(int id) {
+	for(GSList *it = jobs; it != NULL; it = g_slist_next(it)) {
+		struct job *j = (struct job *) it->data;
+		if(j->id != id)
+			continue;
+		if(j->state == JOB_SCHEDULED)
+			job_finish(j, JOB_CANCELLED);
+		else if(j->state == JOB_RECORDING)
+			job_finish(j, JOB_DONE);
+		else
+			return false;
+		return true;
+	}
+	return false;
+}
+
+void record_init(void) {
+	if(jobs && !directory) {
+		logger(LOG_ERR, "Recordings are configured, but no recording directory is set");
+		exit(EXIT_FAILURE);
+	}
+	initialized = true;
+	/* Jobs in the past are freed right away */
+	for(GSList *it = jobs, *next; it != NULL; it = next) {
+		next = g_slist_next(it);
+		job_schedule((struct job *) it->data);
+	}
+}
+
+void record_shutdown(void) {
+	for(GSList *it = jobs, *next; it != NULL; it = next) {
+		next = g_slist_next(it);
+		struct job *j = (struct job *) it->data;
+		if(j->state == JOB_RECORDING)
+			job_finish(j, JOB_DONE);
+	}
+	/* The writer_done_cb() callbacks never run, the process exits afterwards */
+	for(GSList *it = jobs; it != NULL; it = g_slist_next(it)) {
+		struct job *j = (struct job *) it->data;
+		if(j->writer)
+			g_thread_join(j->writer);
+	}
+}
+
+void send_recording_list(function<void(string)> sendfn) {
+	sendfn(
+		"<!DOCTYPE html>"
+		"<html lang=\"de\">"
+		"<head><title>tvoe recording list</title></head>"
+		"<body>"
+		"<h3>List of recordings</h3>"
+		"<table><tr><th>ID</th><th>Service</th><th>Name</th><th>Start</th><th>Stop</th>"
+		"<th>State</th><th>Received (MB)</th><th>Written (MB)</th><th>Disk (MB/s)</th>"
+		"<th>Queued blocks (max)</th><th>Dropped (MB)</th><th>File</th></tr>");
+	for(GSList *it = jobs; it != NULL; it = g_slist_next(it)) {
+		struct job *j = (struct job *) it->data;
+		char buf[2048], start[32], stop[32];
+		struct tm tm;
+		strftime(start, sizeof(start), "%Y-%m-%d %H:%M", localtime_r(&j->start, &tm));
+		strftime(stop, sizeof(stop), "%Y-%m-%d %H:%M", localtime_r(&j->stop, &tm));
+
+		g_mutex_lock(&j->lock);
+		uint64_t written = j->written;
+		int64_t write_time = j->write_time;
+		int queued = j->queued;
+		bool error = j->write_error, direct = j->direct;
+		g_mutex_unlock(&j->lock);
+		/* Throughput while actually writing, i.e. what the disk can take */
+		double rate = write_time ? (double) written / write_time : 0;
+		/* Names are chosen by HTTP clients */
+		gchar *name = g_markup_escape_text(j->name, -1);
+		gchar *path = g_markup_escape_text(j->path, -1);
+
+		snprintf(buf, sizeof(buf), "<tr><td>%d</td><td>%u</td><td>%s</td><td>%s</td>"
+				"<td>%s</td><td>%s%s</td><td>%.1f</td><td>%.1f</td><td>%.1f</td>"
+				"<td>%d (%d)</td><td>%.1f</td><td>%s%s</td></tr>",
+				j->id, j->sid, name, start, stop, state_names[j->state],
+				error ? ", write error" : "", j->received / 1e6, written / 1e6, rate,
+				queued, j->queued_max, j->dropped / 1e6, path,
+				direct ? " (O_DIRECT)" : "");
+		g_free(name);
+		g_free(path);
+		sendfn(buf);
+	}
+	sendfn("</table></body></html>");
+}
@@ -0,0 +1,46 @@
+#ifndef __INCLUDED_TVOE_RECORD
+#define __INCLUDED_TVOE_RECORD
+
+#include <ctime>
+#include <functional>
+#include "tvoe.h"
+
+using std::function;
+
+/**
+ * Set the directory recordings are written to. Called by the config parser.
+ */
+void record_set_directory(const char *directory);
+/**
+ * Schedule a recording. Called by the config parser and the HTTP API.
+ * @param sid Service to record
+ * @param start Start time, 0 to start immediately
+ * @param duration Duration (in s)
+ * @param name Name of the recording, used for the file name
+ * @return Job ID, -1 if the parameters are invalid, -2 if no recording
+ * directory is configured (checked by record_init() for the recordings of
+ * the config file, which may precede the directory setting)
+ */
+int record_add(unsigned int sid, time_t start, int duration, const char *name);
+/**
+ * Stop a running recording, or cancel a scheduled one
+ * @param id Job ID returned by record_add()
+ * @return false if no such job is scheduled or running
+ */
+bool record_stop(int id);
+/**
+ * Arm the timers of all configured recordings. Needs the frontend subsystem
+ * to be initialized.
+ */
+void record_init(void);
+/**
+ * Stop all running recordings and wait until their files are written and
+ * closed. Only used before exiting: the jobs are not freed.
+ */
+void record_shutdown(void);
+/**
+ * Send a (HTML-formatted) list of all recording jobs and their state
+ */
+void send_recording_list(function<void(string)> sendfn);
+
+#endif
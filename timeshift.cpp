@@ -0,0 +1,589 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <event.h>
+#include <bitstream/mpeg/ts.h>
+#include "timeshift.h"
+#include "channels.h"
+#include "mpeg.h"
+#include "log.h"
+#include "affinity.h"
+#include "tvoe.h"
+
+/*
+ * Timeshifting: Recorded services are written continuously into a
+ * preallocated, memory-mapped ring file per service. Clients can then start
+ * watching in the past, e.g. /by-sid/SID?offset=-300.
+ *
+ * Each recorder is registered with the MPEG module like an HTTP client. The
+ * received packets are collected into chunks, which are handed to a writer
+ * thread using a GAsyncQueue, so that slow disks never block the input path.
+ * The writer thread also creates and maps the ring files. If it cannot keep
+ * up, chunks are dropped instead of being queued indefinitely.
+ *
+ * A coarse index maps time to positions in the stream, with about one entry
+ * per second. Entries point to the last PAT before a video random access
+ * point, so that clients can start decoding right away.
+ *
+ * Readers are fed by a timer, interpolating the index to send the data in
+ * real time. Readers whose client does not accept data (e.g. because it
+ * paused) do not advance.
+ *
+ * Stream positions are counted in bytes since the start of the recording.
+ * The position p is stored at offset p % size in the ring file.
+ */
+
+/* Size of the chunks handed to the writer thread */
+#define TIMESHIFT_CHUNK (256 * 1024)
+/* Maximum number of chunks queued for the writer thread, per recorder */
+#define TIMESHIFT_MAX_PENDING 64
+/* Incomplete chunks are handed to the writer thread after this time (in ms) */
+#define TIMESHIFT_FLUSH 200
+/* Minimum interval between index entries (in s), and number of entries */
+#define TIMESHIFT_INDEX_INTERVAL 1
+#define TIMESHIFT_INDEX_SIZE (6 * 3600)
+/* Reader timer interval (in ms), and maximum amount of data sent per tick */
+#define TIMESHIFT_TICK 40
+#define TIMESHIFT_TICK_MAX (256 * 1024)
+/* Delay between attempts to start a recorder if no tuner is available (in s) */
+#define TIMESHIFT_RETRY_DELAY 10
+
+/* Ring file, shared with the writer thread */
+struct ring {
+	char path[512];
+	uint64_t size;			/**< Ring size in bytes, multiple of TS_SIZE */
+	int fd;
+	uint8_t *map;			/**< NULL if the file could not be set up */
+	GMutex lock;
+	/** Stream position up to which data has been written. Protected by lock. */
+	uint64_t committed;
+	/** Number of chunks queued, but not yet written. Protected by lock. */
+	int pending;
+};
+
+enum work_type { WORK_OPEN, WORK_WRITE, WORK_CLOSE };
+/* Work item for the writer thread */
+struct work {
+	enum work_type type;
+	struct ring *r;
+	uint64_t pos;			/**< Stream position of data */
+	uint8_t *data;
+	size_t len;
+};
+
+struct index_entry {
+	int64_t time;			/**< Time of reception (monotonic, us) */
+	uint64_t pos;
+};
+
+struct recorder {
+	unsigned int sid;
+	void *mpeg_handle;		/**< Handle returned by mpeg_register() */
+	struct ring *r;
+	/** Chunk currently being filled */
+	uint8_t *chunk;
+	size_t fill;
+	/** Stream position of the chunk, i.e. amount of data queued so far */
+	uint64_t written;
+	/** Index ring, oldest entry at index_head */
+	struct index_entry *index;
+	int index_head, index_n;
+	/** Stream position of the last PAT, -1 if none */
+	int64_t last_pat;
+	bool video_seen;
+	/** Reference count: watching clients, readers and permanent recording */
+	int users;
+	bool permanent;
+	GSList *readers;
+	struct event *flushev;
+	struct event *retryev;
+	uint64_t dropped;		/**< Chunks dropped because the writer was too slow */
+};
+
+struct reader {
+	struct recorder *rec;
+	uint64_t pos;			/**< Next position to send */
+	int64_t vtime;			/**< Recording time corresponding to pos */
+	int64_t last_tick;
+	struct event *timer;
+	void (*cb)(void *, const uint8_t *, size_t);
+	bool (*ready)(void *);
+	void (*end_cb)(void *);
+	void *ptr;
+};
+
+static char *directory;
+static uint64_t ring_size;
+static bool record_watched;
+/* Services to record permanently */
+static GSList *permanent;
+/* Active recorders, indexed by SID */
+static GHashTable *recorders;
+static GAsyncQueue *work_queue;
+/* Set by timeshift_shutdown(), the writer thread drops queued chunks then */
+static bool discard;
+
+/************** Called in the writer thread ***************/
+
+static void ring_open(struct ring *r) {
+	r->fd = open(r->path, O_RDWR | O_CREAT, 0600);
+	if(r->fd < 0) {
+		logger(LOG_ERR, "Unable to open timeshift file %s: %s", r->path, strerror(errno));
+		return;
+	}
+	int ret = posix_fallocate(r->fd, 0, r->size);
+	if(ret) {
+		logger(LOG_ERR, "Unable to allocate timeshift file %s: %s", r->path, strerror(ret));
+		close(r->fd);
+		return;
+	}
+	void *map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if(map == MAP_FAILED) {
+		logger(LOG_ERR, "Unable to map timeshift file %s: %s", r->path, strerror(errno));
+		close(r->fd);
+		return;
+	}
+	madvise(map, r->size, MADV_SEQUENTIAL);
+	g_mutex_lock(&r->lock);
+	r->map = (uint8_t *) map;
+	g_mutex_unlock(&r->lock);
+}
+
+static void ring_write(struct ring *r, uint64_t pos, const uint8_t *data, size_t len) {
+	if(r->map && !__atomic_load_n(&discard, __ATOMIC_RELAXED)) {
+		size_t offset = pos % r->size;
+		size_t chunk = MIN(len, r->size - offset);
+		memcpy(r->map + offset, data, chunk);
+		memcpy(r->map, data + chunk, len - chunk);
+	}
+	g_mutex_lock(&r->lock);
+	if(r->map)
+		r->committed = pos + len;
+	r->pending--;
+	g_mutex_unlock(&r->lock);
+}
+
+static void ring_close(struct ring *r) {
+	if(r->map) {
+		munmap(r->map, r->size);
+		close(r->fd);
+	}
+	g_mutex_clear(&r->lock);
+	delete r;
+}
+
+static void *timeshift_writer(void *p) {
+	affinity_thread(AFFINITY_WORKER, "timeshift_writer");
+	for(;;) {
+		struct work *w = (struct work *) g_async_queue_pop(work_queue);
+		switch(w->type) {
+			case WORK_OPEN:
+				ring_open(w->r);
+				break;
+			case WORK_WRITE:
+				ring_write(w->r, w->pos, w->data, w->len);
+				free(w->data);
+				break;
+			case WORK_CLOSE:
+				ring_close(w->r);
+				break;
+		}
+		delete w;
+	}
+	return NULL;
+}
+
+/****************************** Main control flow ************************/
+
+static void queue_work(enum work_type type, struct ring *r, uint64_t pos,
+		uint8_t *data, size_t len) {
+	struct work *w = new struct work;
+	w->type = type;
+	w->r = r;
+	w->pos = pos;
+	w->data = data;
+	w->len = len;
+	g_async_queue_push(work_queue, w);
+}
+
+/* Hand the current chunk to the writer thread, or drop it if it is too busy */
+static void recorder_flush(struct recorder *rec) {
+	if(!rec->fill)
+		return;
+	g_mutex_lock(&rec->r->lock);
+	bool busy = rec->r->pending >= TIMESHIFT_MAX_PENDING;
+	if(!busy)
+		rec->r->pending++;
+	g_mutex_unlock(&rec->r->lock);
+	if(busy) {
+		if(!rec->dropped++)
+			logger(LOG_NOTICE, "[timeshift %u] Disk too slow, dropping data", rec->sid);
+		rec->fill = 0;
+		rec->last_pat = -1;
+		/* Forget index entries pointing into the dropped data */
+		while(rec->index_n && rec->index[(rec->index_head + rec->index_n - 1) %
+				TIMESHIFT_INDEX_SIZE].pos >= rec->written)
+			rec->index_n--;
+		return;
+	}
+	queue_work(WORK_WRITE, rec->r, rec->written, rec->chunk, rec->fill);
+	rec->written += rec->fill;
+	rec->chunk = (uint8_t *) malloc(TIMESHIFT_CHUNK);
+	rec->fill = 0;
+}
+
+/* libevent callback: Hand incomplete chunks to the writer thread */
+static void flush_cb(evutil_socket_t fd, short events, void *p) {
+	recorder_flush((struct recorder *) p);
+}
+
+static void index_add(struct recorder *rec, int64_t now, uint64_t pos) {
+	if(rec->index_n) {
+		struct index_entry *last = &rec->index[(rec->index_head + rec->index_n - 1) %
+			TIMESHIFT_INDEX_SIZE];
+		if(now - last->time < TIMESHIFT_INDEX_INTERVAL * 1000000 || pos <= last->pos)
+			return;
+	}
+	if(rec->index_n == TIMESHIFT_INDEX_SIZE) {
+		rec->index_head = (rec->index_head + 1) % TIMESHIFT_INDEX_SIZE;
+		rec->index_n--;
+	}
+	struct index_entry *e = &rec->index[(rec->index_head + rec->index_n++) % TIMESHIFT_INDEX_SIZE];
+	e->time = now;
+	e->pos = pos;
+}
+
+/* Callback for new MPEG-TS data, see mpeg_register() */
+static void recorder_input(void *p, const uint8_t *buf, size_t bufsize) {
+	struct recorder *rec = (struct recorder *) p;
+	int64_t now = g_get_monotonic_time();
+	for(size_t i = 0; i + TS_SIZE <= bufsize; i += TS_SIZE) {
+		const uint8_t *pkt = buf + i;
+		uint16_t pid = ts_get_pid(pkt);
+		uint64_t pos = rec->written + rec->fill;
+		int pid_class = mpeg_get_pid_class(rec->mpeg_handle, pid);
+		if(pid == 0) {
+			rec->last_pat = pos;
+			/* Without video, every PAT is a suitable starting point */
+			if(!rec->video_seen)
+				index_add(rec, now, pos);
+		} else if(pid_class == PID_CLASS_VIDEO) {
+			rec->video_seen = true;
+			if(rec->last_pat >= 0 && ts_get_unitstart(pkt) && ts_has_adaptation(pkt) &&
+					ts_get_adaptation(pkt) && tsaf_has_randomaccess(pkt))
+				index_add(rec, now, rec->last_pat);
+		}
+		memcpy(rec->chunk + rec->fill, pkt, TS_SIZE);
+		rec->fill += TS_SIZE;
+		if(rec->fill + TS_SIZE > TIMESHIFT_CHUNK)
+			recorder_flush(rec);
+	}
+}
+
+static void recorder_release(struct recorder *rec);
+
+/* Called by the MPEG module if the frontend of a recorder failed */
+static void recorder_timeout(void *p) {
+	struct recorder *rec = (struct recorder *) p;
+	logger(LOG_NOTICE, "[timeshift %u] Frontend failed, recording stopped", rec->sid);
+	mpeg_unregister(rec->mpeg_handle);
+	rec->mpeg_handle = NULL;
+	/* Readers can not continue beyond the end of the recording */
+	rec->users++;
+	GSList *readers = g_slist_copy(rec->readers);
+	for(GSList *it = readers; it != NULL; it = g_slist_next(it)) {
+		struct reader *rd = (struct reader *) it->data;
+		rd->end_cb(rd->ptr);
+	}
+	g_slist_free(readers);
+	if(rec->permanent) {
+		struct timeval tv = { TIMESHIFT_RETRY_DELAY, 0 };
+		evtimer_add(rec->retryev, &tv);
+	}
+	recorder_release(rec);
+}
+
+/* Register recorder with the MPEG module */
+static bool recorder_register(struct recorder *rec) {
+	struct tune t;
+	if(!channel_find_sid(rec->sid, &t)) {
+		logger(LOG_ERR, "[timeshift %u] Unknown service", rec->sid);
+		return false;
+	}
+	rec->mpeg_handle = mpeg_register(t, NULL, recorder_input, recorder_timeout, rec);
+	return rec->mpeg_handle != NULL;
+}
+
+/* libevent callback: Retry to start a permanent recorder */
+static void retry_cb(evutil_socket_t fd, short events, void *p) {
+	struct recorder *rec = (struct recorder *) p;
+	if(rec->mpeg_handle)
+		return;
+	if(recorder_register(rec)) {
+		logger(LOG_INFO, "[timeshift %u] Recording started", rec->sid);
+		return;
+	}
+	struct timeval tv = { TIMESHIFT_RETRY_DELAY, 0 };
+	evtimer_add(rec->retryev, &tv);
+}
+
+/* Create a new recorder, without registering it with the MPEG module */
+static struct recorder *recorder_new(unsigned int sid) {
+	struct recorder *rec = new struct recorder;
+	rec->sid = sid;
+	rec->mpeg_handle = NULL;
+	rec->r = new struct ring;
+	snprintf(rec->r->path, sizeof(rec->r->path), "%s/tvoe-%u.ts", directory, sid);
+	rec->r->size = ring_size;
+	rec->r->map = NULL;
+	g_mutex_init(&rec->r->lock);
+	rec->r->committed = 0;
+	rec->r->pending = 0;
+	queue_work(WORK_OPEN, rec->r, 0, NULL, 0);
+	rec->chunk = (uint8_t *) malloc(TIMESHIFT_CHUNK);
+	rec->fill = 0;
+	rec->written = 0;
+	rec->index = (struct index_entry *) malloc(TIMESHIFT_INDEX_SIZE * sizeof(struct index_entry));
+	rec->index_head = rec->index_n = 0;
+	rec->last_pat = -1;
+	rec->video_seen = false;
+	rec->users = 0;
+	rec->permanent = false;
+	rec->readers = NULL;
+	rec->dropped = 0;
+	rec->flushev = event_new(evbase, -1, EV_PERSIST, flush_cb, rec);
+	struct timeval tv = { 0, TIMESHIFT_FLUSH * 1000 };
+	event_add(rec->flushev, &tv);
+	rec->retryev = evtimer_new(evbase, retry_cb, rec);
+	g_hash_table_insert(recorders, GINT_TO_POINTER(sid), rec);
+	return rec;
+}
+
+static void recorder_free(struct recorder *rec) {
+	g_hash_table_remove(recorders, GINT_TO_POINTER(rec->sid));
+	if(rec->mpeg_handle)
+		mpeg_unregister(rec->mpeg_handle);
+	event_free(rec->flushev);
+	event_free(rec->retryev);
+	/* The writer thread frees the ring after all queued chunks are written */
+	queue_work(WORK_CLOSE, rec->r, 0, NULL, 0);
+	free(rec->chunk);
+	free(rec->index);
+	delete rec;
+}
+
+/* Find the recorder of a service, starting it if start is set */
+static struct recorder *recorder_get(unsigned int sid, bool start) {
+	struct recorder *rec = (struct recorder *)
+		g_hash_table_lookup(recorders, GINT_TO_POINTER(sid));
+	if(rec || !start)
+		return rec;
+	rec = recorder_new(sid);
+	if(!recorder_register(rec)) {
+		recorder_free(rec);
+		return NULL;
+	}
+	logger(LOG_INFO, "[timeshift %u] Recording started", sid);
+	return rec;
+}
+
+static void recorder_release(struct recorder *rec) {
+	if(--rec->users)
+		return;
+	logger(LOG_INFO, "[timeshift %u] Recording stopped", rec->sid);
+	recorder_free(rec);
+}
+
+/* i-th oldest index entry */
+static struct index_entry *index_entry(struct recorder *rec, int i) {
+	return &rec->index[(rec->index_head + i) % TIMESHIFT_INDEX_SIZE];
+}
+
+/*
+ * Stream position corresponding to a recording time, interpolated between
+ * index entries. Returns false if time is beyond the last index entry.
+ */
+static bool index_lookup(struct recorder *rec, int64_t time, uint64_t *pos) {
+	if(rec->index_n < 2)
+		return false;
+	/* Binary search for the first entry not older than time, the index is
+	 * ordered by time */
+	int lo = 0, hi = rec->index_n;
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if(index_entry(rec, mid)->time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == rec->index_n)
+		return false;
+	struct index_entry *b = index_entry(rec, lo);
+	if(!lo) {
+		*pos = b->pos;
+		return true;
+	}
+	struct index_entry *a = index_entry(rec, lo - 1);
+	*pos = a->pos + (b->pos - a->pos) * (time - a->time) / (b->time - a->time);
+	*pos -= *pos % TS_SIZE;
+	return true;
+}
+
+/* Oldest stream position that will not be overwritten soon */
+static uint64_t oldest_pos(struct recorder *rec) {
+	uint64_t end = rec->written + TIMESHIFT_CHUNK;
+	return end > rec->r->size ? end - rec->r->size : 0;
+}
+
+/* libevent callback: Send the data that is due to a reader */
+static void reader_tick(evutil_socket_t fd, short events, void *p) {
+	struct reader *rd = (struct reader *) p;
+	struct recorder *rec = rd->rec;
+	int64_t now = g_get_monotonic_time();
+	int64_t elapsed = now - rd->last_tick;
+	rd->last_tick = now;
+	/* Paused clients do not advance */
+	if(!rd->ready(rd->ptr))
+		return;
+	rd->vtime += elapsed;
+
+	g_mutex_lock(&rec->r->lock);
+	uint64_t committed = rec->r->committed;
+	uint8_t *map = rec->r->map;
+	g_mutex_unlock(&rec->r->lock);
+	if(!map)
+		return;
+
+	if(rd->pos < oldest_pos(rec)) {
+		/* Data has been overwritten while the client was paused. Skip to the
+		 * oldest index entry that is still available. */
+		int i;
+		for(i = 0; i < rec->index_n; i++) {
+			struct index_entry *e = &rec->index[(rec->index_head + i) % TIMESHIFT_INDEX_SIZE];
+			if(e->pos >= oldest_pos(rec)) {
+				rd->pos = e->pos;
+				rd->vtime = e->time;
+				break;
+			}
+		}
+		if(i == rec->index_n)
+			return;
+		logger(LOG_INFO, "[timeshift %u] Reader fell out of the ring, skipping forward", rec->sid);
+	}
+
+	uint64_t target;
+	if(!index_lookup(rec, rd->vtime, &target))
+		target = committed;
+	target = MIN(MIN(target, committed), rd->pos + TIMESHIFT_TICK_MAX);
+	while(rd->pos < target) {
+		size_t offset = rd->pos % rec->r->size;
+		size_t len = MIN(target - rd->pos, rec->r->size - offset);
+		rd->cb(rd->ptr, map + offset, len);
+		rd->pos += len;
+	}
+}
+
+void timeshift_configure(const char *dir, int size, bool watched) {
+	free(directory);
+	directory = strdup(dir);
+	ring_size = (uint64_t) size * 1024 * 1024;
+	ring_size -= ring_size % TS_SIZE;
+	record_watched = watched;
+}
+
+void timeshift_add_service(unsigned int sid) {
+	permanent = g_slist_append(permanent, GUINT_TO_POINTER(sid));
+}
+
+void timeshift_init(void) {
+	if(!directory)
+		return;
+	recorders = g_hash_table_new(g_direct_hash, g_direct_equal);
+	work_queue = g_async_queue_new();
+	g_thread_new("timeshift_writer", timeshift_writer, NULL);
+	for(GSList *it = permanent; it != NULL; it = g_slist_next(it)) {
+		unsigned int sid = GPOINTER_TO_UINT(it->data);
+		struct recorder *rec = recorder_get(sid, false);
+		if(!rec)
+			rec = recorder_new(sid);
+		rec->permanent = true;
+		rec->users++;
+		/* Retry later if no tuner is available right now */
+		retry_cb(-1, 0, rec);
+	}
+}
+
+void timeshift_shutdown(void) {
+	__atomic_store_n(&discard, true, __ATOMIC_RELAXED);
+}
+
+void *timeshift_watch(unsigned int sid) {
+	if(!directory || !record_watched)
+		return NULL;
+	struct recorder *rec = recorder_get(sid, true);
+	if(rec)
+		rec->users++;
+	return rec;
+}
+
+void timeshift_unwatch(void *handle) {
+	recorder_release((struct recorder *) handle);
+}
+
+void *timeshift_open(unsigned int sid, int offset,
+		void (*cb)(void *, const uint8_t *, size_t), bool (*ready)(void *),
+		void (*end_cb)(void *), void *ptr) {
+	if(!directory)
+		return NULL;
+	struct recorder *rec = recorder_get(sid, false);
+	if(!rec || !rec->index_n)
+		return NULL;
+
+	/* Start at the first index entry after the requested time, or at the
+	 * oldest available one */
+	int64_t now = g_get_monotonic_time();
+	int64_t start = now - (int64_t) (offset < 0 ? -offset : offset) * 1000000;
+	struct index_entry *e = NULL;
+	for(int i = 0; i < rec->index_n; i++) {
+		struct index_entry *cur = &rec->index[(rec->index_head + i) % TIMESHIFT_INDEX_SIZE];
+		if(cur->pos < oldest_pos(rec))
+			continue;
+		e = cur;
+		if(cur->time >= start)
+			break;
+	}
+	if(!e)
+		return NULL;
+
+	struct reader *rd = new struct reader;
+	rd->rec = rec;
+	rd->pos = e->pos;
+	rd->vtime = e->time;
+	rd->last_tick = now;
+	rd->cb = cb;
+	rd->ready = ready;
+	rd->end_cb = end_cb;
+	rd->ptr = ptr;
+	rd->timer = event_new(evbase, -1, EV_PERSIST, reader_tick, rd);
+	struct timeval tv = { 0, TIMESHIFT_TICK * 1000 };
+	event_add(rd->timer, &tv);
+	rec->readers = g_slist_prepend(rec->readers, rd);
+	rec->users++;
+	logger(LOG_INFO, "[timeshift %u] Reader started %lld s in the past", sid,
+			(long long) ((now - e->time) / 1000000));
+	return rd;
+}
+
+void timeshift_close(void *handle) {
+	struct reader *rd = (struct reader *) handle;
+	struct recorder *rec = rd->rec;
+	event_free(rd->timer);
+	rec->readers = g_slist_remove(rec->readers, rd);
+	delete rd;
+	recorder_release(rec);
+}
@@ -0,0 +1,63 @@
+#ifndef __INCLUDED_TVOE_TIMESHIFT
+#define __INCLUDED_TVOE_TIMESHIFT
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Enable timeshifting. Called by the config parser.
+ * @param directory Directory for the ring files
+ * @param size Size of the ring file per service (in MB)
+ * @param watched Record every service that is watched by an HTTP client
+ */
+void timeshift_configure(const char *directory, int size, bool watched);
+/**
+ * Always record a service, not only while it is watched. Called by the
+ * config parser.
+ */
+void timeshift_add_service(unsigned int sid);
+/**
+ * Start recording the services added by timeshift_add_service(). Needs the
+ * frontend subsystem to be initialized.
+ */
+void timeshift_init(void);
+/**
+ * Drop the chunks still queued for writing, before exiting after an upgrade:
+ * The new process starts the rings over (the index is not handed over), so
+ * writing them would only overwrite its data.
+ */
+void timeshift_shutdown(void);
+/**
+ * Notify the timeshift module that a service is watched, recording it if
+ * watched services are to be recorded.
+ * @return Handle for timeshift_unwatch(), NULL if the service is not recorded
+ */
+void *timeshift_watch(unsigned int sid);
+/**
+ * Notify the timeshift module that a service is no longer watched
+ * @param handle Handle returned by timeshift_watch()
+ */
+void timeshift_unwatch(void *handle);
+/**
+ * Start reading a recorded service, beginning offset seconds in the past (or
+ * at the oldest recorded data). The data is fed to cb in real time, as long
+ * as ready returns true. If ready returns false (e.g. because the client
+ * paused), output is paused as well.
+ * @param sid Service ID
+ * @param offset Offset into the past (in s)
+ * @param cb Callback for the MPEG-TS data
+ * @param ready Called to check whether the client accepts more data
+ * @param end_cb Called if the recording ends, e.g. because the frontend failed
+ * @param ptr Argument for the callbacks
+ * @return Reader handle, NULL if the service is not recorded
+ */
+void *timeshift_open(unsigned int sid, int offset,
+		void (*cb)(void *, const uint8_t *, size_t), bool (*ready)(void *),
+		void (*end_cb)(void *), void *ptr);
+/**
+ * Stop reading
+ * @param handle Handle returned by timeshift_open()
+ */
+void timeshift_close(void *handle);
+
+#endif
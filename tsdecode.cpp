@@ -0,0 +1,120 @@
+#include <cstring>
+#include <bitstream/mpeg/ts.h>
+#include "tsdecode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * TS header decoding. The first four bytes of every packet are read as one
+ * little endian word w (sync byte in bits 0-7), which gives:
+ *
+ *   pid   = (w & 0x1f00) | ((w >> 16) & 0xff)
+ *   flags = ((w >> 24) & 0x1f)		CC and payload flag (adaptation_field_control & 1)
+ *         | ((w >> 9) & 0x60)		unit start and transport error indicator
+ *         | (w & 0xff) != 0x47 ? 0x80 : 0
+ *
+ * The vectorized versions compute this for 4 (SSE2) or 8 (AVX2) packets at
+ * once. The headers are 188 bytes apart, so AVX2 uses a gather; SSE2 has to
+ * assemble the vector from scalar loads, which still saves the per-packet
+ * shifting and masking.
+ */
+
+static inline uint32_t load_header(const uint8_t *p) {
+	uint32_t w;
+	memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap32(w);
+#endif
+	return w;
+}
+
+static void decode_scalar(const uint8_t *data, size_t start, size_t n, struct ts_headers *h) {
+	for(size_t i = start; i < n; i++) {
+		uint32_t w = load_header(data + i * TS_SIZE);
+		h->pid[i] = (w & 0x1f00) | ((w >> 16) & 0xff);
+		h->flags[i] = ((w >> 24) & 0x1f) | ((w >> 9) & 0x60) |
+			((w & 0xff) != 0x47 ? TS_HDR_INVALID : 0);
+	}
+}
+
+#ifdef __SSE2__
+static void decode_sse2(const uint8_t *data, size_t n, struct ts_headers *h) {
+	const __m128i pid_hi = _mm_set1_epi32(0x1f00), byte = _mm_set1_epi32(0xff),
+		  low = _mm_set1_epi32(0x1f), ind = _mm_set1_epi32(0x60),
+		  sync = _mm_set1_epi32(0x47), invalid = _mm_set1_epi32(TS_HDR_INVALID);
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const uint8_t *p = data + i * TS_SIZE;
+		__m128i w = _mm_set_epi32(load_header(p + 3 * TS_SIZE), load_header(p + 2 * TS_SIZE),
+				load_header(p + TS_SIZE), load_header(p));
+		__m128i pid = _mm_or_si128(_mm_and_si128(w, pid_hi),
+				_mm_and_si128(_mm_srli_epi32(w, 16), byte));
+		__m128i flags = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w, 24), low),
+				_mm_and_si128(_mm_srli_epi32(w, 9), ind));
+		flags = _mm_or_si128(flags, _mm_andnot_si128(
+				_mm_cmpeq_epi32(_mm_and_si128(w, byte), sync), invalid));
+		/* Narrow to 16 bit (values fit into 15 bits, so signed saturation is fine) */
+		__m128i packed = _mm_packs_epi32(pid, flags);
+		_mm_storel_epi64((__m128i *) (h->pid + i), packed);
+		packed = _mm_packus_epi16(_mm_srli_si128(packed, 8), _mm_setzero_si128());
+		uint32_t f = _mm_cvtsi128_si32(packed);
+		memcpy(h->flags + i, &f, sizeof(f));
+	}
+	decode_scalar(data, i, n, h);
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void decode_avx2(const uint8_t *data, size_t n, struct ts_headers *h) {
+	const __m256i offsets = _mm256_setr_epi32(0, TS_SIZE, 2 * TS_SIZE, 3 * TS_SIZE,
+			4 * TS_SIZE, 5 * TS_SIZE, 6 * TS_SIZE, 7 * TS_SIZE);
+	const __m256i pid_hi = _mm256_set1_epi32(0x1f00), byte = _mm256_set1_epi32(0xff),
+		  low = _mm256_set1_epi32(0x1f), ind = _mm256_set1_epi32(0x60),
+		  sync = _mm256_set1_epi32(0x47), invalid = _mm256_set1_epi32(TS_HDR_INVALID);
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256i w = _mm256_i32gather_epi32((const int *) (data + i * TS_SIZE), offsets, 1);
+		__m256i pid = _mm256_or_si256(_mm256_and_si256(w, pid_hi),
+				_mm256_and_si256(_mm256_srli_epi32(w, 16), byte));
+		__m256i flags = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(w, 24), low),
+				_mm256_and_si256(_mm256_srli_epi32(w, 9), ind));
+		flags = _mm256_or_si256(flags, _mm256_andnot_si256(
+				_mm256_cmpeq_epi32(_mm256_and_si256(w, byte), sync), invalid));
+		/* packs works per 128 bit lane: pid0-3 flags0-3 | pid4-7 flags4-7 */
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(pid, flags), 0xd8);
+		_mm_storeu_si128((__m128i *) (h->pid + i), _mm256_castsi256_si128(packed));
+		__m128i f = _mm_packus_epi16(_mm256_extracti128_si256(packed, 1), _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *) (h->flags + i), f);
+	}
+	decode_scalar(data, i, n, h);
+}
+#endif
+
+static void decode_default(const uint8_t *data, size_t n, struct ts_headers *h) {
+#ifdef __SSE2__
+	decode_sse2(data, n, h);
+#else
+	decode_scalar(data, 0, n, h);
+#endif
+}
+
+/* Select the best implementation on first use */
+static void decode_select(const uint8_t *data, size_t n, struct ts_headers *h);
+static void (*decode)(const uint8_t *, size_t, struct ts_headers *) = decode_select;
+
+static void decode_select(const uint8_t *data, size_t n, struct ts_headers *h) {
+	decode = decode_default;
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		decode = decode_avx2;
+#endif
+	decode(data, n, h);
+}
+
+void ts_decode_headers(const uint8_t *data, size_t n, struct ts_headers *h) {
+	decode(data, n, h);
+}
@@ -0,0 +1,35 @@
+#ifndef __INCLUDED_TVOE_TSDECODE
+#define __INCLUDED_TVOE_TSDECODE
+
+#include <cstdint>
+#include <cstddef>
+
+/* Maximum number of packets decoded by one call to ts_decode_headers() */
+#define TS_DECODE_BATCH 256
+
+/* Bits in ts_headers.flags */
+#define TS_HDR_CC			0x0f	/**< Continuity counter */
+#define TS_HDR_PAYLOAD		0x10	/**< Packet has a payload */
+#define TS_HDR_UNITSTART	0x20	/**< Payload unit start indicator */
+#define TS_HDR_TEI			0x40	/**< Transport error indicator */
+#define TS_HDR_INVALID		0x80	/**< No sync byte */
+
+/**
+ * Decoded headers of consecutive TS packets, kept in compact arrays so the
+ * dispatch loop does not have to touch every packet to find its PID.
+ */
+struct ts_headers {
+	uint16_t pid[TS_DECODE_BATCH];
+	uint8_t flags[TS_DECODE_BATCH];
+};
+
+/**
+ * Decode the headers of n consecutive TS packets, using SSE2 or AVX2 if
+ * supported by the CPU.
+ * @param data First packet
+ * @param n Number of packets, at most TS_DECODE_BATCH
+ * @param h Output
+ */
+void ts_decode_headers(const uint8_t *data, size_t n, struct ts_headers *h);
+
+#endif
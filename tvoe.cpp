@@ -11,7 +11,15 @@
 #include <errno.h>
 #include <signal.h>
 #include "http.h"
+#include "channels.h"
 #include "log.h"
+#include "udp.h"
+#include "timeshift.h"
+#include "record.h"
+#include "uring.h"
+#include "affinity.h"
+#include "frontend.h"
+#include "upgrade.h"
 #include "tvoe.h"
 
 struct event_base *evbase;
@@ -21,17 +29,172 @@ static bool daemonize = true;
 bool daemonized = false;
 int http_port = 8080;
 
+extern FILE *yyin;
 extern void yylex_destroy();
-extern void init_lexer();
+extern int init_lexer();
 extern void init_parser();
 extern int yyparse(void);
+extern bool reloading, parse_failed;
+
+/* Settings which are applied on reload, see reload_config() */
+extern size_t dmxbuf;
+extern size_t dvr_readsize;
+extern int dvr_buffers;
+extern int flush_size;
+extern int flush_delay;
+extern bool eit_schedule;
+
+/* Settings before the running reload, restored if the configuration is invalid */
+static struct {
+	int loglevel, dvr_buffers, flush_size, flush_delay;
+	size_t dmxbuf;
+	bool eit_schedule;
+} saved;
+/* The channel lists are being loaded, see reload_config() */
+static bool reload_running;
+
+/* Apply the reloaded configuration, or restore the previous settings */
+static void reload_finish(bool ok) {
+	frontend_reload(ok);
+	reload_running = false;
+	if(!ok) {
+		loglevel = saved.loglevel;
+		dvr_buffers = saved.dvr_buffers;
+		flush_size = saved.flush_size;
+		flush_delay = saved.flush_delay;
+		dmxbuf = saved.dmxbuf;
+		eit_schedule = saved.eit_schedule;
+		logger(LOG_ERR, "Invalid configuration, keeping the current one");
+		return;
+	}
+	logger(LOG_INFO, "Configuration reloaded");
+}
+
+/* Called once the channel lists have been loaded, see channels_load_async() */
+static void reload_channels_cb(int ret, void *ptr) {
+	/* Running clients keep their transponders even if the list changed */
+	reload_finish(ret == 0);
+}
+
+bool reload_config(void) {
+	/* The channel lists must not change while they are loaded */
+	if(reload_running) {
+		logger(LOG_NOTICE, "Configuration is already being reloaded, ignoring request");
+		return false;
+	}
+	logger(LOG_INFO, "Reloading configuration file %s", conffile);
+	saved.loglevel = loglevel;
+	saved.dvr_buffers = dvr_buffers;
+	saved.flush_size = flush_size;
+	saved.flush_delay = flush_delay;
+	saved.dmxbuf = dmxbuf;
+	saved.eit_schedule = eit_schedule;
+	size_t old_dvr_readsize = dvr_readsize;
+
+	channels_clear();
+	reloading = true;
+	bool ok = init_lexer() == 0;
+	if(ok) {
+		init_parser();
+		ok = yyparse() == 0 && !parse_failed;
+		/* The file is only closed by the lexer if it was parsed completely */
+		if(yyin) {
+			fclose(yyin);
+			yyin = NULL;
+		}
+		yylex_destroy();
+	}
+	reloading = false;
+
+	/* The dvr buffers have already been allocated */
+	if(dvr_readsize != old_dvr_readsize) {
+		logger(LOG_NOTICE, "Changing dvr_readsize requires a restart, ignoring it");
+		dvr_readsize = old_dvr_readsize;
+	}
+	if(!ok) {
+		reload_finish(false);
+		return false;
+	}
+	/* Parsing the channel lists would stall the event loop */
+	reload_running = true;
+	channels_load_async(reload_channels_cb, NULL);
+	return true;
+}
+
+static void sighup_cb(evutil_socket_t fd, short events, void *arg) {
+	reload_config();
+}
+
+static void sigusr2_cb(evutil_socket_t fd, short events, void *arg) {
+	upgrade_start();
+}
+
+/* Interval for retrying to lock the PID file after an upgrade (in ms) */
+#define PIDFILE_RETRY 100
+
+static bool pidfile_store(int pidfd, const char *pidfile) {
+	char pid[16];
+	snprintf(pid, sizeof(pid), "%d\n", getpid());
+	if(ftruncate(pidfd, 0) < 0 || write(pidfd, pid, strlen(pid)) != (ssize_t) strlen(pid)) {
+		logger(LOG_ERR, "Unable to write to PID file %s: %s",
+				pidfile, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* PID file waiting for the previous process to exit, see write_pidfile() */
+static int pidfile_fd;
+static const char *pidfile_path;
+static struct event *pidfile_timer;
+
+static void pidfile_retry_cb(evutil_socket_t fd, short events, void *arg) {
+	if(lockf(pidfile_fd, F_TLOCK, 0) < 0) {
+		struct timeval tv = { 0, PIDFILE_RETRY * 1000 };
+		evtimer_add(pidfile_timer, &tv);
+		return;
+	}
+	event_free(pidfile_timer);
+	pidfile_timer = NULL;
+	pidfile_store(pidfile_fd, pidfile_path);
+}
+
+/*
+ * Write our PID to the PID file and keep it locked. During an upgrade, the
+ * lock is held by the previous process until it has finished writing its
+ * recordings and exits. Blocking would stall the resumed clients meanwhile,
+ * so retry from the event loop instead.
+ */
+static bool write_pidfile(const char *pidfile, bool wait) {
+	int pidfd = open(pidfile, O_RDWR | O_CREAT, 0600);
+	if(pidfd < 0) {
+		logger(LOG_ERR, "Unable to open PID file %s: %s, exiting",
+				pidfile, strerror(errno));
+		return false;
+	}
+	if(lockf(pidfd, F_TLOCK, 0) < 0) {
+		if(wait && (errno == EACCES || errno == EAGAIN)) {
+			pidfile_fd = pidfd;
+			pidfile_path = pidfile;
+			pidfile_timer = evtimer_new(evbase, pidfile_retry_cb, NULL);
+			struct timeval tv = { 0, PIDFILE_RETRY * 1000 };
+			evtimer_add(pidfile_timer, &tv);
+			return true;
+		}
+		logger(LOG_ERR, "Unable to lock PID file %s. tvoe is probably already running.",
+				pidfile);
+		return false;
+	}
+	return pidfile_store(pidfd, pidfile);
+}
 
 int main(int argc, char **argv) {
 	int c;
 	char *pidfile = NULL;
 	bool quiet = false;
+	int upgrade_fd = -1;
 
-	while((c = getopt(argc, argv, "qhfd:c:p:")) != -1) {
+	while((c = getopt(argc, argv, "qhfd:c:p:u:")) != -1) {
 		switch(c) {
 			case 'c': // Config filename
 				conffile = optarg;
@@ -45,6 +208,9 @@ int main(int argc, char **argv) {
 			case 'q': // Quiet
 				quiet = true;
 				break;
+			case 'u': // Take over from running process
+				upgrade_fd = atoi(optarg);
+				break;
 			case 'h':
 			default:
 				fprintf(stderr, "Usage: %s [-c config] [-f] [-h] [-p pidfile]\n"
@@ -52,6 +218,7 @@ int main(int argc, char **argv) {
 						"\t-f: Disable daemon fork\n"
 						"\t-p: Write PID to given pidfile\n"
 						"\t-q: Quiet startup\n"
+						"\t-u: Take over from a running tvoe (used for upgrades)\n"
 						"\t-h: Show this help\n", argv[0]);
 				exit(EXIT_FAILURE);
 		}
@@ -60,6 +227,17 @@ int main(int argc, char **argv) {
 	if(!quiet)
 		printf("tvoe version %s compiled on %s %s\n", "0.1", __DATE__, __TIME__);
 
+	/* The config file is read again on reloads and upgrades, after daemonizing */
+	{
+		char *path = realpath(conffile, NULL);
+		if(path)
+			conffile = path;
+	}
+	upgrade_init(argc, argv);
+	/* The previous process has already been daemonized */
+	if(upgrade_fd >= 0)
+		daemonize = false;
+
 	/* Initialize libevent */
 	evthread_use_pthreads();
 	event_init();
@@ -79,8 +257,20 @@ int main(int argc, char **argv) {
 	/* Initialize logging subsystem */
 	init_log();
 
-	/* Open HTTP listener */
-	if(http_init(http_port) < 0) {
+	/* Build the channel index */
+	if(channels_load() < 0) {
+		logger(LOG_ERR, "Unable to import channel lists, aborting.");
+		return EXIT_FAILURE;
+	}
+
+	/* Take over the state of the running process, if upgrading */
+	if(upgrade_fd >= 0 && !upgrade_receive(upgrade_fd)) {
+		logger(LOG_ERR, "Unable to take over from the running process, aborting.");
+		return EXIT_FAILURE;
+	}
+
+	/* Open HTTP listener (or use the one of the previous process) */
+	if((upgrade_listener() >= 0 ? http_adopt(upgrade_listener()) : http_init(http_port)) < 0) {
 		logger(LOG_ERR, "Unable to open HTTP listener, aborting.");
 		return EXIT_FAILURE;
 	}
@@ -104,26 +294,8 @@ int main(int argc, char **argv) {
 			return EXIT_SUCCESS;
 		}
 
-		if(pidfile) {
-			int pidfd = open(pidfile, O_RDWR | O_CREAT, 0600);
-			char pid[8]; // PID is not greater than 65536
-			if(pidfd < 0) {
-				logger(LOG_ERR, "Unable to open PID file %s: %s, exiting",
-						pidfile, strerror(errno));
-				return EXIT_FAILURE;
-			}
-			if(lockf(pidfd, F_TLOCK, 0) < 0) {
-				logger(LOG_ERR, "Unable to lock PID file %s. tvoe is probably already running.",
-						pidfile);
-				return EXIT_FAILURE;
-			}
-			snprintf(pid, 8, "%d\n", getpid());
-			if(write(pidfd, pid, strlen(pid)) != (ssize_t) strlen(pid)) {
-				logger(LOG_ERR, "Unable to write to PID file %s: %s",
-						pidfile, pidfile);
-				return EXIT_FAILURE;
-			}
-		}
+		if(pidfile && !write_pidfile(pidfile, false))
+			return EXIT_FAILURE;
 
 		daemonized = true; // prevents logger from logging to stderr
 		umask(0);
@@ -140,9 +312,24 @@ int main(int argc, char **argv) {
 		freopen("/dev/null", "w", stderr);
 	}
 
-	/* Initialize frontend handler */
+	/* Pin the event loop, all other threads are started from here on */
+	affinity_init();
+
+	/* Write log messages in the background from now on */
+	log_start();
+
+	/* Set up io_uring, if enabled. Has to be done before frontend_init() */
+	uring_init();
+
+	/* Initialize frontend handler. Returns once the first frontend is usable. */
+	upgrade_adopt_frontends();
 	frontend_init();
 
+	/* Start configured UDP/RTP outputs */
+	udp_init();
+	timeshift_init();
+	record_init();
+
 	/* Ignore SIGPIPE */
 	{
 		struct sigaction action;
@@ -152,6 +339,17 @@ int main(int argc, char **argv) {
 		sigaction(SIGPIPE, &action, NULL);
 	}
 
+	/* Continue streaming to the clients of the previous process */
+	if(upgrade_fd >= 0) {
+		upgrade_finish();
+		if(pidfile)
+			write_pidfile(pidfile, true);
+	}
+
+	/* Reload the configuration on SIGHUP, upgrade on SIGUSR2 */
+	event_add(evsignal_new(evbase, SIGHUP, sighup_cb, NULL), NULL);
+	event_add(evsignal_new(evbase, SIGUSR2, sigusr2_cb, NULL), NULL);
+
 	event_base_dispatch(evbase);
 
 	logger(LOG_ERR, "Event loop exited");
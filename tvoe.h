@@ -11,4 +11,15 @@ using std::string;
  */
 extern struct event_base *evbase;
 
+/**
+ * Reload the configuration file: Frontends, channel lists and runtime
+ * settings (log level, buffer sizes) are updated, without interrupting
+ * clients on unaffected transponders. Called on SIGHUP and /reload. The
+ * channel lists are loaded in the background, the frontends are updated
+ * once they are done (or the previous settings restored if they are invalid).
+ * @return false if the configuration file is invalid or a reload is already
+ * running
+ */
+bool reload_config(void);
+
 #endif
@@ -0,0 +1,525 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <glib.h>
+#include <event.h>
+#include <bitstream/mpeg/ts.h>
+#include "udp.h"
+#include "channels.h"
+#include "mpeg.h"
+#include "log.h"
+#include "tvoe.h"
+
+/*
+ * This module sends services or complete transponders as raw UDP or RTP
+ * streams, usually to multicast groups, so that any number of viewers on the
+ * LAN only costs one send. Each output is registered with the MPEG module like
+ * an HTTP client.
+ *
+ * TS packets are grouped into datagrams of UDP_PACKETS packets, which are
+ * queued in a per-output ring. Unpaced outputs send complete datagrams in
+ * batches using sendmmsg() at the end of the event loop iteration that
+ * produced them. Incomplete datagrams are sent after UDP_FLUSH_DELAY at the
+ * latest.
+ *
+ * Paced outputs are meant for receivers with small buffers (cheap set-top
+ * boxes), which cannot cope with the bursts caused by large dvr reads. Every
+ * datagram is given a send time: the datagrams between two PCRs are spread
+ * evenly over the PCR interval, shifted by UDP_PACING_DELAY to absorb input
+ * jitter. A timer sends the datagrams that are due, again using sendmmsg().
+ */
+
+/* Number of TS packets per datagram */
+#define UDP_PACKETS 7
+#define UDP_PAYLOAD (UDP_PACKETS * TS_SIZE)
+#define UDP_DATAGRAM (RTP_HEADER_SIZE + UDP_PAYLOAD)
+/* Maximum number of datagrams per sendmmsg() call, queue size of unpaced outputs */
+#define UDP_BATCH 64
+/* Queue size of paced outputs (about 1 s at 10 MBit/s) */
+#define UDP_PACED_QUEUE 1024
+/* Maximum delay before incomplete datagrams are sent (in ms) */
+#define UDP_FLUSH_DELAY 10
+/* Delay between attempts to start an output if no tuner is available (in s) */
+#define UDP_RETRY_DELAY 10
+/* Latency added by pacing to absorb the jitter of dvr reads (in ms) */
+#define UDP_PACING_DELAY 100
+/* Deviation from the PCR clock after which the pacing clock is reset (in ms) */
+#define UDP_PACING_RESET 1000
+/* Gain of the correction for drift between the PCR clock and the local clock */
+#define UDP_PACING_GAIN 64
+
+#define RTP_HEADER_SIZE 12
+#define RTP_PT_MP2T 33
+
+/* PCRs are 33 bits of 90 kHz base plus 9 bits of 27 MHz extension */
+#define PCR_WRAP ((UINT64_C(1) << 33) * 300)
+
+struct udp_output {
+	char name[128];			/**< Destination as "group:port" */
+	unsigned int sid;		/**< Service to send, 0 for complete transponder */
+	char transponder[16];	/**< Transponder to send, if sid is 0 */
+	struct mpeg_filter filter;	/**< Stream selection, if filtered is set */
+	bool filtered;
+	bool rtp;				/**< Prepend RTP headers */
+	bool paced;				/**< Send according to the PCR */
+	bool ondemand;			/**< Only started via udp_request() */
+	bool session;			/**< Unicast session, see udp_add_session() */
+	void (*ended) (void *);	/**< Called if a session failed */
+	void *ended_ptr;
+	bool running;			/**< Output is supposed to be sending */
+	int fd;					/**< Socket, connected to the destination */
+	void *mpeg_handle;		/**< Handle returned by mpeg_register() */
+	struct event *flushev;	/**< Sends queued datagrams */
+	struct event *retryev;	/**< Retries registration if no tuner was available */
+	/* Ring of queued datagrams: n complete ones starting at head, fill bytes
+	 * in the one following them. Every datagram has space for the RTP header
+	 * in front. The first sched complete datagrams have a send time. */
+	uint8_t (*buf)[UDP_DATAGRAM];
+	int64_t *due;			/**< Send time (monotonic, us), paced outputs only */
+	int size, head, n, sched, fill;
+	/* Pacing state */
+	int pcr_pid;			/**< PID whose PCR is used, -1 if none seen yet */
+	uint64_t last_pcr;		/**< Last PCR (27 MHz) */
+	int64_t last_due;		/**< Send time assigned to last_pcr */
+	uint16_t rtp_seq;
+	uint32_t rtp_ssrc;
+	/* Statistics */
+	uint64_t datagrams, dropped;
+};
+
+static GSList *outputs;
+
+static void output_register(struct udp_output *o);
+
+/* Write the RTP header for the datagram in slot i */
+static void write_rtp_header(struct udp_output *o, int i) {
+	uint8_t *h = o->buf[i];
+	struct timeval tv;
+	event_base_gettimeofday_cached(evbase, &tv);
+	/* 90 kHz media clock */
+	uint32_t ts = tv.tv_sec * 90000 + tv.tv_usec * 9 / 100;
+	h[0] = 0x80; /* Version 2, no padding, extensions or CSRCs */
+	h[1] = RTP_PT_MP2T;
+	h[2] = o->rtp_seq >> 8;
+	h[3] = o->rtp_seq & 0xff;
+	o->rtp_seq++;
+	h[4] = ts >> 24;
+	h[5] = (ts >> 16) & 0xff;
+	h[6] = (ts >> 8) & 0xff;
+	h[7] = ts & 0xff;
+	h[8] = o->rtp_ssrc >> 24;
+	h[9] = (o->rtp_ssrc >> 16) & 0xff;
+	h[10] = (o->rtp_ssrc >> 8) & 0xff;
+	h[11] = o->rtp_ssrc & 0xff;
+}
+
+/*
+ * Send the first count complete datagrams of the queue, and the incomplete
+ * one if partial is set, using as few sendmmsg() calls as possible
+ */
+static void output_send(struct udp_output *o, int count, bool partial) {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int total = count + (partial && o->fill ? 1 : 0);
+
+	for(int done = 0; done < total; ) {
+		int batch = total - done < UDP_BATCH ? total - done : UDP_BATCH;
+		memset(msgs, 0x0, sizeof(msgs[0]) * batch);
+		for(int i = 0; i < batch; i++) {
+			int slot = (o->head + done + i) % o->size;
+			int len = done + i < count ? UDP_PAYLOAD : o->fill;
+			if(o->rtp)
+				write_rtp_header(o, slot);
+			iov[i].iov_base = o->buf[slot] + (o->rtp ? 0 : RTP_HEADER_SIZE);
+			iov[i].iov_len = len + (o->rtp ? RTP_HEADER_SIZE : 0);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int sent = sendmmsg(o->fd, msgs, batch, MSG_DONTWAIT);
+		if(sent < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				logger(LOG_DEBUG, "[%s] sendmmsg() failed: %s", o->name, strerror(errno));
+			sent = 0;
+		}
+		o->datagrams += sent;
+		/* UDP is unreliable anyway, so we do not retry */
+		o->dropped += batch - sent;
+		done += batch;
+	}
+
+	o->head = (o->head + count) % o->size;
+	o->n -= count;
+	o->sched = o->sched > count ? o->sched - count : 0;
+	/* The incomplete datagram now is the one at head, if it was kept */
+	if(partial)
+		o->fill = 0;
+}
+
+/* (Re-)arm the pacing timer for the next scheduled datagram */
+static void pace_arm(struct udp_output *o) {
+	if(!o->sched || evtimer_pending(o->flushev, NULL))
+		return;
+	int64_t wait = o->due[o->head] - g_get_monotonic_time();
+	if(wait < 0)
+		wait = 0;
+	struct timeval tv = { (time_t) (wait / 1000000), (suseconds_t) (wait % 1000000) };
+	evtimer_add(o->flushev, &tv);
+}
+
+/*
+ * Assign send times to all complete datagrams received since the last PCR,
+ * spreading them evenly up to the send time of the new PCR
+ */
+static void pace_pcr(struct udp_output *o, const uint8_t *pkt) {
+	uint64_t pcr = tsaf_get_pcr(pkt) * 300 + tsaf_get_pcrext(pkt);
+	int64_t now = g_get_monotonic_time();
+	int64_t target = now + UDP_PACING_DELAY * 1000;
+	int64_t due;
+	bool reset = o->pcr_pid < 0 || tsaf_has_discontinuity(pkt);
+
+	if(!reset) {
+		uint64_t delta = (pcr + PCR_WRAP - o->last_pcr) % PCR_WRAP;
+		due = o->last_due + (int64_t) (delta / 27);
+		if(due - target > UDP_PACING_RESET * 1000 || target - due > UDP_PACING_RESET * 1000) {
+			logger(LOG_DEBUG, "[%s] PCR jump, resetting pacing clock", o->name);
+			reset = true;
+		} else {
+			/* Slowly follow the local clock to avoid queue growth or underruns
+			 * caused by clock drift */
+			due += (target - due) / UDP_PACING_GAIN;
+		}
+	}
+	if(reset)
+		due = target;
+	if(o->pcr_pid < 0)
+		o->pcr_pid = ts_get_pid(pkt);
+
+	int m = o->n - o->sched;
+	int64_t start = reset ? due : o->last_due;
+	for(int i = 0; i < m; i++)
+		o->due[(o->head + o->sched + i) % o->size] = start + (due - start) * (i + 1) / m;
+	o->sched = o->n;
+	o->last_pcr = pcr;
+	o->last_due = due;
+	pace_arm(o);
+}
+
+/*
+ * libevent callback: Activated at the end of an event loop iteration that
+ * completed datagrams, or after UDP_FLUSH_DELAY if only an incomplete
+ * datagram is pending. For paced outputs, this is the pacing timer.
+ */
+static void flush_cb(evutil_socket_t fd, short events, void *p) {
+	struct udp_output *o = (struct udp_output *) p;
+	if(o->paced) {
+		int64_t now = g_get_monotonic_time();
+		int count = 0;
+		while(count < o->sched && o->due[(o->head + count) % o->size] <= now)
+			count++;
+		output_send(o, count, false);
+		pace_arm(o);
+		return;
+	}
+	output_send(o, o->n, events & EV_TIMEOUT);
+	if(o->fill && !evtimer_pending(o->flushev, NULL)) {
+		struct timeval tv = { 0, UDP_FLUSH_DELAY * 1000 };
+		evtimer_add(o->flushev, &tv);
+	}
+}
+
+/* Queue one TS packet for a paced output */
+static void paced_packet(struct udp_output *o, const uint8_t *pkt) {
+	int slot = (o->head + o->n) % o->size;
+	memcpy(o->buf[slot] + RTP_HEADER_SIZE + o->fill, pkt, TS_SIZE);
+	o->fill += TS_SIZE;
+	if(o->fill == UDP_PAYLOAD) {
+		o->fill = 0;
+		if(++o->n == o->size) {
+			/* No space left for the next datagram: The receiver is not keeping
+			 * up with the input, or the input is not paced correctly. Drop the
+			 * oldest datagram, and skip its sequence number to signal the loss. */
+			o->head = (o->head + 1) % o->size;
+			o->n--;
+			if(o->sched)
+				o->sched--;
+			o->rtp_seq++;
+			o->dropped++;
+		}
+		/* Without any PCR, fall back to sending in bursts */
+		if(o->n - o->sched > o->size / 2) {
+			int64_t now = g_get_monotonic_time();
+			for(int i = o->sched; i < o->n; i++)
+				o->due[(o->head + i) % o->size] = now;
+			o->sched = o->n;
+			pace_arm(o);
+		}
+	}
+	if(ts_has_adaptation(pkt) && ts_get_adaptation(pkt) && tsaf_has_pcr(pkt) &&
+			(o->pcr_pid < 0 || ts_get_pid(pkt) == o->pcr_pid))
+		pace_pcr(o, pkt);
+}
+
+/* Callback for new MPEG-TS data, see mpeg_register() */
+static void udp_senddata(void *p, const uint8_t *buf, size_t bufsize) {
+	struct udp_output *o = (struct udp_output *) p;
+	if(o->paced) {
+		for(; bufsize >= TS_SIZE; buf += TS_SIZE, bufsize -= TS_SIZE)
+			paced_packet(o, buf);
+		return;
+	}
+	while(bufsize) {
+		size_t chunk = UDP_PAYLOAD - o->fill;
+		if(chunk > bufsize)
+			chunk = bufsize;
+		memcpy(o->buf[(o->head + o->n) % o->size] + RTP_HEADER_SIZE + o->fill, buf, chunk);
+		o->fill += chunk;
+		buf += chunk;
+		bufsize -= chunk;
+		if(o->fill < UDP_PAYLOAD)
+			break;
+		/* Datagram complete */
+		o->fill = 0;
+		if(++o->n == o->size - 1)
+			output_send(o, o->n, false);
+	}
+	if(o->n)
+		event_active(o->flushev, EV_WRITE, 0);
+	else if(o->fill && !evtimer_pending(o->flushev, NULL)) {
+		struct timeval tv = { 0, UDP_FLUSH_DELAY * 1000 };
+		evtimer_add(o->flushev, &tv);
+	}
+}
+
+/* libevent callback: Retry to register an output */
+static void retry_cb(evutil_socket_t fd, short events, void *p) {
+	struct udp_output *o = (struct udp_output *) p;
+	if(o->running && !o->mpeg_handle)
+		output_register(o);
+}
+
+/* Called by the MPEG module if the frontend of an output failed */
+static void udp_timeout(void *p) {
+	struct udp_output *o = (struct udp_output *) p;
+	mpeg_unregister(o->mpeg_handle);
+	o->mpeg_handle = NULL;
+	/* Sessions are not retried, the requesting client is told instead */
+	if(o->session) {
+		logger(LOG_NOTICE, "[%s] Frontend failed, ending session", o->name);
+		o->ended(o->ended_ptr);
+		return;
+	}
+	logger(LOG_NOTICE, "[%s] Frontend failed, restarting output", o->name);
+	struct timeval tv = { UDP_RETRY_DELAY, 0 };
+	evtimer_add(o->retryev, &tv);
+}
+
+/* Register output with the MPEG module, retry later if that fails */
+static void output_register(struct udp_output *o) {
+	struct tune t;
+	if(o->sid) {
+		if(channel_find_sid(o->sid, &t))
+			o->mpeg_handle = mpeg_register(t, o->filtered ? &o->filter : NULL,
+					udp_senddata, udp_timeout, o);
+		else
+			logger(LOG_ERR, "[%s] Unknown service %u", o->name, o->sid);
+	} else {
+		if(channel_find_transponder(o->transponder, &t))
+			o->mpeg_handle = mpeg_register_multi(t, NULL, 0, udp_senddata, udp_timeout, o);
+		else
+			logger(LOG_ERR, "[%s] Unknown transponder %s", o->name, o->transponder);
+	}
+	if(o->mpeg_handle) {
+		logger(LOG_INFO, "[%s] Output started", o->name);
+		return;
+	}
+	/* Sessions are requested by a client, which is told about the failure */
+	if(o->session)
+		return;
+	logger(LOG_NOTICE, "[%s] Unable to start output, retrying in %d seconds",
+			o->name, UDP_RETRY_DELAY);
+	struct timeval tv = { UDP_RETRY_DELAY, 0 };
+	evtimer_add(o->retryev, &tv);
+}
+
+static void output_start(struct udp_output *o) {
+	if(o->running)
+		return;
+	o->running = true;
+	output_register(o);
+}
+
+static void output_stop(struct udp_output *o) {
+	if(!o->running)
+		return;
+	o->running = false;
+	event_del(o->retryev);
+	event_del(o->flushev);
+	if(o->mpeg_handle)
+		mpeg_unregister(o->mpeg_handle);
+	o->mpeg_handle = NULL;
+	o->head = o->n = o->sched = o->fill = 0;
+	o->pcr_pid = -1;
+	logger(LOG_INFO, "[%s] Output stopped", o->name);
+}
+
+/* Create a new output sending to host:port. Returns NULL on error. */
+static struct udp_output *output_new(const char *host, int port, bool rtp,
+		bool paced, int ttl) {
+	struct addrinfo hints, *res;
+	char service[8];
+	memset(&hints, 0x0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	snprintf(service, sizeof(service), "%d", port);
+	int ret = getaddrinfo(host, service, &hints, &res);
+	if(ret) {
+		logger(LOG_ERR, "Invalid output address %s: %s", host, gai_strerror(ret));
+		return NULL;
+	}
+	int fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		logger(LOG_ERR, "Unable to create UDP socket: %s", strerror(errno));
+		freeaddrinfo(res);
+		return NULL;
+	}
+	if(res->ai_family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+	else
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	if(connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		logger(LOG_ERR, "Unable to connect UDP socket to %s: %s", host, strerror(errno));
+		freeaddrinfo(res);
+		close(fd);
+		return NULL;
+	}
+	freeaddrinfo(res);
+	evutil_make_socket_nonblocking(fd);
+
+	struct udp_output *o = new struct udp_output;
+	snprintf(o->name, sizeof(o->name), "%s:%d", host, port);
+	o->sid = 0;
+	o->transponder[0] = 0;
+	o->filtered = false;
+	o->rtp = rtp;
+	o->paced = paced;
+	o->ondemand = o->session = o->running = false;
+	o->ended = NULL;
+	o->ended_ptr = NULL;
+	o->fd = fd;
+	o->mpeg_handle = NULL;
+	o->flushev = event_new(evbase, -1, 0, flush_cb, o);
+	o->retryev = evtimer_new(evbase, retry_cb, o);
+	o->size = paced ? UDP_PACED_QUEUE : UDP_BATCH;
+	o->buf = (uint8_t (*)[UDP_DATAGRAM]) g_malloc(o->size * UDP_DATAGRAM);
+	o->due = paced ? (int64_t *) g_malloc(o->size * sizeof(int64_t)) : NULL;
+	o->head = o->n = o->sched = o->fill = 0;
+	o->pcr_pid = -1;
+	o->rtp_seq = g_random_int();
+	o->rtp_ssrc = g_random_int();
+	o->datagrams = o->dropped = 0;
+	return o;
+}
+
+static void output_free(struct udp_output *o) {
+	output_stop(o);
+	event_free(o->flushev);
+	event_free(o->retryev);
+	close(o->fd);
+	g_free(o->buf);
+	g_free(o->due);
+	delete o;
+}
+
+int udp_add_output(const char *group, int port, unsigned int sid,
+		const char *transponder, bool rtp, bool paced, int ttl, bool ondemand) {
+	struct udp_output *o = output_new(group, port, rtp, paced, ttl);
+	if(!o)
+		return -1;
+	o->sid = sid;
+	snprintf(o->transponder, sizeof(o->transponder), "%s", transponder ? transponder : "");
+	o->ondemand = ondemand;
+	outputs = g_slist_append(outputs, o);
+	return 0;
+}
+
+void *udp_add_session(const char *host, int port, unsigned int sid,
+		const struct mpeg_filter *f, void (*ended) (void *), void *ptr) {
+	struct udp_output *o = output_new(host, port, true, true, 1);
+	if(!o)
+		return NULL;
+	o->sid = sid;
+	o->session = true;
+	o->ended = ended;
+	o->ended_ptr = ptr;
+	if(f) {
+		o->filter = *f;
+		o->filtered = true;
+	}
+	output_start(o);
+	if(!o->mpeg_handle) {
+		output_free(o);
+		return NULL;
+	}
+	outputs = g_slist_append(outputs, o);
+	return o;
+}
+
+void udp_remove_session(void *handle) {
+	struct udp_output *o = (struct udp_output *) handle;
+	outputs = g_slist_remove(outputs, o);
+	output_free(o);
+}
+
+void udp_init(void) {
+	for(GSList *it = outputs; it != NULL; it = g_slist_next(it)) {
+		struct udp_output *o = (struct udp_output *) it->data;
+		if(!o->ondemand)
+			output_start(o);
+	}
+}
+
+bool udp_request(const char *name, bool start) {
+	for(GSList *it = outputs; it != NULL; it = g_slist_next(it)) {
+		struct udp_output *o = (struct udp_output *) it->data;
+		if(strcmp(o->name, name) || !o->ondemand)
+			continue;
+		if(start)
+			output_start(o);
+		else
+			output_stop(o);
+		return true;
+	}
+	return false;
+}
+
+void send_output_list(function<void(string)> sendfn) {
+	sendfn(
+		"<!DOCTYPE html>"
+		"<html lang=\"de\">"
+		"<head><title>tvoe UDP/RTP output list</title></head>"
+		"<body>"
+		"<h3>List of UDP/RTP outputs</h3>"
+		"<ul>");
+	for(GSList *it = outputs; it != NULL; it = g_slist_next(it)) {
+		struct udp_output *o = (struct udp_output *) it->data;
+		char buf[1024], source[64];
+		if(o->sid)
+			snprintf(source, sizeof(source), "service %u", o->sid);
+		else
+			snprintf(source, sizeof(source), "transponder %s", o->transponder);
+		snprintf(buf, sizeof(buf), "<li> %s (%s, %s%s%s%s): %s, %llu datagrams sent, %llu dropped",
+				o->name, source, o->rtp ? "RTP" : "UDP", o->paced ? ", paced" : "",
+				o->ondemand ? ", on demand" : "", o->session ? ", session" : "",
+				o->mpeg_handle ? "running" : (o->running ? "waiting for tuner" : "stopped"),
+				(unsigned long long) o->datagrams, (unsigned long long) o->dropped);
+		sendfn(buf);
+	}
+	sendfn("</ul></body></html>");
+}
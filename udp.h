@@ -0,0 +1,61 @@
+#ifndef __INCLUDED_TVOE_UDP
+#define __INCLUDED_TVOE_UDP
+
+#include <functional>
+#include "tvoe.h"
+#include "mpeg.h"
+
+using std::function;
+
+/**
+ * Add a new UDP/RTP output, usually sending to a multicast group. Called by
+ * the config parser. The output is started by udp_init(), unless it is an
+ * on-demand output.
+ * @param group Destination address (multicast group or unicast host)
+ * @param port Destination port
+ * @param sid Service to send, 0 to send the complete transponder
+ * @param transponder Transponder to send if sid is 0, e.g. "11836h"
+ * @param rtp Send RTP instead of raw UDP
+ * @param paced Send according to the PCR instead of in bursts
+ * @param ttl Multicast TTL
+ * @param ondemand Only send when started via udp_request()
+ * @return 0 on success, -1 on error
+ */
+int udp_add_output(const char *group, int port, unsigned int sid,
+		const char *transponder, bool rtp, bool paced, int ttl, bool ondemand);
+/**
+ * Start a paced RTP unicast session for a single service, e.g. for a set-top
+ * box. The session runs until it is removed using udp_remove_session().
+ * @param host Destination address
+ * @param port Destination port
+ * @param sid Service to send
+ * @param f Stream selection, NULL to send all streams
+ * @param ended Called if the session stopped sending because its frontend
+ * failed. The session still has to be removed using udp_remove_session().
+ * @param ptr Argument to supply to ended
+ * @return Session handle, NULL if the session could not be started
+ */
+void *udp_add_session(const char *host, int port, unsigned int sid,
+		const struct mpeg_filter *f, void (*ended) (void *), void *ptr);
+/**
+ * Stop a session started by udp_add_session()
+ */
+void udp_remove_session(void *handle);
+/**
+ * Start all configured outputs that are not on-demand. Needs the frontend
+ * subsystem to be initialized.
+ */
+void udp_init(void);
+/**
+ * Start or stop an on-demand output
+ * @param name Output name ("group:port")
+ * @param start true to start the output, false to stop it
+ * @return true on success, false if no such on-demand output exists
+ */
+bool udp_request(const char *name, bool start);
+/**
+ * Send a (HTML-formatted) list of the configured outputs and their state
+ */
+void send_output_list(function<void(string)> sendfn);
+
+#endif
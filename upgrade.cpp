@@ -0,0 +1,399 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <glib.h>
+#include "upgrade.h"
+#include "frontend.h"
+#include "http.h"
+#include "record.h"
+#include "timeshift.h"
+#include "log.h"
+#include "tvoe.h"
+
+/*
+ * The old process starts the new binary with "-u FD", FD being its end of a
+ * Unix socket pair. The old process sends its state as a sequence of
+ * messages (the listening socket, every tuned frontend, every streaming
+ * client) and blocks until the new process acknowledges that it has taken
+ * over. It exits then, after finishing its recordings and captures. If the
+ * new process fails before, the old one just continues: The only state it
+ * changes is stopping the io_uring dvr reads and client sends before the
+ * handover (so that no read in flight takes data from the new process, and
+ * no send in flight uses a client buffer being handed over), they are
+ * resumed then.
+ *
+ * The new process continues reading from the frontends without retuning, so
+ * the transponders are not interrupted. Clients are resumed by processing
+ * their request again (without sending the response header), the MPEG
+ * module rebuilds its PSI tables from the stream. Outputs, recordings and
+ * timeshift buffers are started from the configuration, like on a restart.
+ */
+
+extern const char *conffile;
+extern int dvr_buffers;
+
+/* Time the new process has to take over (in s) */
+#define UPGRADE_TIMEOUT 30
+/* Has to be increased if struct upgrade_msg or struct tune change */
+#define UPGRADE_VERSION 2
+/* Maximum number of file descriptors per message */
+#define UPGRADE_MAX_FDS 3
+/* Maximum length of the data of a message */
+#define UPGRADE_MAX_LEN (64 * 1024 * 1024)
+
+enum msg_type {
+	MSG_LISTENER = 1,	/**< Listening socket */
+	MSG_FRONTEND,		/**< Frontend, demux and dvr fd of a tuned frontend */
+	MSG_CLIENT,			/**< Client socket, followed by the unsent data */
+	MSG_END
+};
+
+/*
+ * A message, followed by len bytes of data. File descriptors are passed as
+ * SCM_RIGHTS control message along with it.
+ */
+struct upgrade_msg {
+	uint32_t version;
+	uint32_t type;
+	uint32_t nfds;
+	uint32_t len;
+	int32_t adapter, frontend;
+	struct tune t;
+	char clientname[INET6_ADDRSTRLEN];
+	char url[HTTP_REQUEST_SIZE];
+};
+
+/* A message received by the new process */
+struct received {
+	struct upgrade_msg m;
+	int fds[UPGRADE_MAX_FDS];
+	string data;
+};
+
+/* Arguments tvoe was started with, see upgrade_init() */
+static int saved_argc;
+static char **saved_argv;
+static char *binary;
+/* Old process: Waiting for the dvr reads to stop, or handing over */
+static bool upgrading;
+
+/* New process: State received, see upgrade_receive() */
+static int upgrade_sock = -1;
+static int listener = -1;
+static GSList *received;
+
+static bool send_all(int sock, const char *buf, size_t len) {
+	while(len) {
+		ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool recv_all(int sock, char *buf, size_t len) {
+	while(len) {
+		ssize_t n = recv(sock, buf, len, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void msg_init(struct upgrade_msg *m, enum msg_type type) {
+	memset(m, 0, sizeof(*m));
+	m->version = UPGRADE_VERSION;
+	m->type = type;
+}
+
+static bool send_msg(int sock, struct upgrade_msg *m, const int *fds, int nfds,
+		const string *data) {
+	m->nfds = nfds;
+	m->len = data ? data->size() : 0;
+	struct iovec iov = { m, sizeof(*m) };
+	union {
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(nfds) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	ssize_t n;
+	while((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	if(n <= 0)
+		return false;
+	/* The file descriptors went along with the first part */
+	return send_all(sock, (const char *) m + n, sizeof(*m) - n) &&
+		(!data || send_all(sock, data->data(), data->size()));
+}
+
+static bool recv_msg(int sock, struct received *r) {
+	struct iovec iov = { &r->m, sizeof(r->m) };
+	union {
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t n;
+	while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	if(n <= 0)
+		return false;
+	unsigned int nfds = 0;
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(int i = 0; i < count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if(nfds < UPGRADE_MAX_FDS)
+				r->fds[nfds++] = fd;
+			else
+				close(fd);
+		}
+	}
+	bool ok = recv_all(sock, (char *) &r->m + n, sizeof(r->m) - n) &&
+		r->m.version == UPGRADE_VERSION && r->m.nfds == nfds && r->m.len <= UPGRADE_MAX_LEN;
+	if(ok && r->m.len) {
+		r->data.resize(r->m.len);
+		ok = recv_all(sock, &r->data[0], r->m.len);
+	}
+	if(!ok) {
+		for(unsigned int i = 0; i < nfds; i++)
+			close(r->fds[i]);
+		return false;
+	}
+	r->m.clientname[sizeof(r->m.clientname) - 1] = 0;
+	r->m.url[sizeof(r->m.url) - 1] = 0;
+	return true;
+}
+
+/* Old process: Send the state to the new process */
+static bool send_state(int sock) {
+	struct upgrade_msg m;
+	msg_init(&m, MSG_LISTENER);
+	int fd = http_listener();
+	bool ok = send_msg(sock, &m, &fd, 1, NULL);
+	int frontends = 0, clients = 0;
+	frontend_handover([&](int adapter, int frontend, const struct tune *t, const int *fds) {
+		msg_init(&m, MSG_FRONTEND);
+		m.adapter = adapter;
+		m.frontend = frontend;
+		m.t = *t;
+		ok = ok && send_msg(sock, &m, fds, 3, NULL);
+		frontends++;
+	});
+	http_handover([&](int fd, const char *clientname, const char *url, const string &pending) {
+		msg_init(&m, MSG_CLIENT);
+		snprintf(m.clientname, sizeof(m.clientname), "%s", clientname);
+		snprintf(m.url, sizeof(m.url), "%s", url);
+		ok = ok && send_msg(sock, &m, &fd, 1, &pending);
+		clients++;
+	});
+	msg_init(&m, MSG_END);
+	ok = ok && send_msg(sock, &m, NULL, 0, NULL);
+	if(ok)
+		logger(LOG_INFO, "Upgrade: Handed over %d frontends and %d clients", frontends, clients);
+	return ok;
+}
+
+void upgrade_init(int argc, char **argv) {
+	saved_argc = argc;
+	saved_argv = argv;
+	/* The working directory is changed when daemonizing, without a path, $PATH is searched */
+	binary = strchr(argv[0], '/') ? realpath(argv[0], NULL) : NULL;
+	if(!binary)
+		binary = strdup(argv[0]);
+}
+
+/* Start the new process and hand over the state. Only returns on failure. */
+static void handover(void) {
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		logger(LOG_ERR, "Upgrade: Unable to create socket pair: %s", strerror(errno));
+		return;
+	}
+	/* Options given later override the original ones */
+	char fd[16];
+	snprintf(fd, sizeof(fd), "%d", sv[1]);
+	char **argv = new char *[saved_argc + 8];
+	int n = 0;
+	argv[n++] = binary;
+	for(int i = 1; i < saved_argc; i++)
+		argv[n++] = saved_argv[i];
+	argv[n++] = (char *) "-c";
+	argv[n++] = (char *) conffile;
+	argv[n++] = (char *) "-f";
+	argv[n++] = (char *) "-q";
+	argv[n++] = (char *) "-u";
+	argv[n++] = fd;
+	argv[n] = NULL;
+	struct rlimit rl;
+	int maxfd = 65536;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 1048576)
+		maxfd = rl.rlim_cur;
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		/*
+		 * Only the socket is inherited: Copies of client sockets would keep
+		 * the connections open after the new process closed them.
+		 */
+		for(int i = 3; i < maxfd; i++)
+			if(i != sv[1])
+				close(i);
+		fcntl(sv[1], F_SETFD, 0);
+		execvp(binary, argv);
+		_exit(127);
+	}
+	delete[] argv;
+	close(sv[1]);
+	if(pid < 0) {
+		logger(LOG_ERR, "Upgrade: fork() failed: %s", strerror(errno));
+		close(sv[0]);
+		return;
+	}
+	logger(LOG_INFO, "Upgrade: Started %s (pid %d)", binary, pid);
+
+	struct timeval tv = { UPGRADE_TIMEOUT, 0 };
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char ack;
+	if(send_state(sv[0]) && recv(sv[0], &ack, 1, 0) == 1) {
+		logger(LOG_INFO, "Upgrade: New process has taken over, exiting");
+		/* Write what is still queued, the new process starts new files */
+		timeshift_shutdown();
+		record_shutdown();
+		frontend_stop_captures();
+		exit(EXIT_SUCCESS);
+	}
+	logger(LOG_ERR, "Upgrade: New process failed to take over, continuing");
+	close(sv[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* Called once no io_uring send is in flight anymore, see http_pause_sends() */
+static void sends_paused(void) {
+	handover();
+	http_resume_sends();
+	frontend_resume_reads();
+	upgrading = false;
+}
+
+/* Called once the io_uring dvr reads are stopped, see frontend_pause_reads() */
+static void reads_paused(void) {
+	http_pause_sends(sends_paused);
+}
+
+void upgrade_start(void) {
+	if(dvr_buffers) {
+		logger(LOG_ERR, "Upgrade: Not possible with mmap'ed dvr buffers (dvr_buffers)");
+		return;
+	}
+	if(upgrading) {
+		logger(LOG_ERR, "Upgrade: Already in progress");
+		return;
+	}
+	upgrading = true;
+	frontend_pause_reads(reads_paused);
+}
+
+bool upgrade_receive(int sock) {
+	upgrade_sock = sock;
+	for(;;) {
+		struct received *r = new struct received;
+		if(!recv_msg(sock, r)) {
+			delete r;
+			logger(LOG_ERR, "Upgrade: Unable to receive state from the previous process");
+			return false;
+		}
+		if(r->m.type == MSG_END) {
+			delete r;
+			break;
+		}
+		if(r->m.type == MSG_LISTENER && r->m.nfds == 1) {
+			listener = r->fds[0];
+			delete r;
+			continue;
+		}
+		received = g_slist_prepend(received, r);
+	}
+	received = g_slist_reverse(received);
+	return listener >= 0;
+}
+
+int upgrade_listener(void) {
+	return listener;
+}
+
+void upgrade_adopt_frontends(void) {
+	for(GSList *it = received; it != NULL; it = g_slist_next(it)) {
+		struct received *r = (struct received *) it->data;
+		if(r->m.type != MSG_FRONTEND || r->m.nfds != 3)
+			continue;
+		if(frontend_adopt(r->m.adapter, r->m.frontend, &r->m.t, r->fds))
+			continue;
+		logger(LOG_NOTICE, "Upgrade: Frontend %d/%d is not configured anymore, closing it",
+				r->m.adapter, r->m.frontend);
+		for(int i = 0; i < 3; i++)
+			close(r->fds[i]);
+	}
+}
+
+void upgrade_finish(void) {
+	if(upgrade_sock < 0)
+		return;
+	int clients = 0;
+	for(GSList *it = received; it != NULL; it = g_slist_next(it)) {
+		struct received *r = (struct received *) it->data;
+		if(r->m.type == MSG_CLIENT && r->m.nfds == 1) {
+			http_resume_client(r->fds[0], r->m.clientname, r->m.url, r->data);
+			clients++;
+		}
+		delete r;
+	}
+	g_slist_free(received);
+	received = NULL;
+	frontend_adopt_done();
+
+	/* The previous process exits once it got this */
+	char ack = 1;
+	if(send(upgrade_sock, &ack, 1, MSG_NOSIGNAL) != 1)
+		logger(LOG_ERR, "Upgrade: Unable to notify the previous process: %s", strerror(errno));
+	close(upgrade_sock);
+	upgrade_sock = -1;
+	logger(LOG_INFO, "Upgrade: Resumed %d clients", clients);
+}
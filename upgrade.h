@@ -0,0 +1,45 @@
+#ifndef __INCLUDED_TVOE_UPGRADE
+#define __INCLUDED_TVOE_UPGRADE
+
+/*
+ * Binary upgrade without dropping clients: The running process starts the
+ * (new) tvoe binary and hands over its listening socket, tuned frontends and
+ * streaming clients over a Unix socket. The new process continues streaming
+ * without retuning, the old one exits once it is done.
+ */
+
+/**
+ * Remember how tvoe was started, to start the new binary the same way. Has to
+ * be called before daemonizing (changing the working directory).
+ */
+void upgrade_init(int argc, char **argv);
+/**
+ * Start the upgrade: Called on SIGUSR2 and /upgrade. The state is handed over
+ * once the io_uring dvr reads and client sends are stopped, possibly from a
+ * later event loop iteration. The old process exits once the new one has
+ * taken over, after writing its recordings and captures completely. It just
+ * continues if the new process failed.
+ */
+void upgrade_start(void);
+/**
+ * Receive the state handed over by the previous process (new process, -u
+ * option). Has to be called after parsing the configuration.
+ * @param sock Unix socket connected to the previous process
+ * @return false if the handover failed
+ */
+bool upgrade_receive(int sock);
+/**
+ * @return Listening socket handed over, -1 if none
+ */
+int upgrade_listener(void);
+/**
+ * Take over the frontends handed over, see frontend_adopt()
+ */
+void upgrade_adopt_frontends(void);
+/**
+ * Resume the clients handed over and tell the previous process to exit. Has
+ * to be called after frontend_init(), before entering the event loop.
+ */
+void upgrade_finish(void);
+
+#endif
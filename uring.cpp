@@ -0,0 +1,215 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <glib.h>
+#include <event.h>
+#include "uring.h"
+#include "log.h"
+#include "tvoe.h"
+
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+bool use_io_uring = false;
+
+#ifdef HAVE_LIBURING
+
+/*
+ * Size of the submission queue. The completion queue is larger, as there
+ * might be a send in flight for every client; the kernel buffers overflowing
+ * completions anyway.
+ */
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+static struct io_uring ring;
+static bool active;
+/* Completion notification */
+static int efd;
+static struct event *completionev;
+/* Submits the queued operations at the end of the event loop iteration */
+static struct event *submitev;
+/*
+ * Operations are queued by the main thread and by the frontend worker thread
+ * (open_fe()), so the submission queue is protected by submit_lock.
+ * Completions are only reaped by the main thread.
+ */
+static GMutex submit_lock;
+static bool submit_pending;
+/* Registered buffers, see uring_register_buffers() */
+static struct iovec *buffers;
+
+/*
+ * Get a free submission queue entry, making sure that n entries are
+ * available (for linked operations). Called with submit_lock held.
+ */
+static struct io_uring_sqe *get_sqe(unsigned int n) {
+	/* Queue full, submit right away */
+	if(io_uring_sq_space_left(&ring) < n)
+		io_uring_submit(&ring);
+	struct io_uring_sqe *sqe = io_uring_sq_space_left(&ring) >= n ?
+		io_uring_get_sqe(&ring) : NULL;
+	if(sqe && !submit_pending) {
+		submit_pending = true;
+		event_active(submitev, EV_TIMEOUT, 0);
+	}
+	return sqe;
+}
+
+static void submit_cb(evutil_socket_t fd, short events, void *arg) {
+	g_mutex_lock(&submit_lock);
+	submit_pending = false;
+	int ret = io_uring_submit(&ring);
+	g_mutex_unlock(&submit_lock);
+	if(ret < 0)
+		logger(LOG_ERR, "[uring] Submitting operations failed: %s", strerror(-ret));
+}
+
+static void completion_cb(evutil_socket_t fd, short events, void *arg) {
+	uint64_t n;
+	if(read(efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		logger(LOG_ERR, "[uring] Unable to read eventfd: %s", strerror(errno));
+	struct io_uring_cqe *cqe;
+	while(io_uring_peek_cqe(&ring, &cqe) == 0) {
+		struct uring_op *op = (struct uring_op *) io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		/* Linked timeouts and cancellations have no callback */
+		if(op)
+			op->cb(op->arg, res);
+	}
+}
+
+bool uring_init(void) {
+	if(!use_io_uring)
+		return false;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	int ret = io_uring_queue_init_params(URING_ENTRIES, &ring, &p);
+	if(ret < 0) {
+		logger(LOG_ERR, "[uring] Unable to set up io_uring: %s, using read()/send()",
+				strerror(-ret));
+		return false;
+	}
+	if((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+			(ret = io_uring_register_eventfd(&ring, efd)) < 0) {
+		logger(LOG_ERR, "[uring] Unable to register eventfd: %s, using read()/send()",
+				strerror(efd < 0 ? errno : -ret));
+		if(efd >= 0)
+			close(efd);
+		io_uring_queue_exit(&ring);
+		return false;
+	}
+	g_mutex_init(&submit_lock);
+	completionev = event_new(evbase, efd, EV_READ | EV_PERSIST, completion_cb, NULL);
+	submitev = event_new(evbase, -1, 0, submit_cb, NULL);
+	event_add(completionev, NULL);
+	active = true;
+	logger(LOG_INFO, "[uring] Using io_uring for dvr reads and client sends");
+	return true;
+}
+
+bool uring_active(void) {
+	return active;
+}
+
+bool uring_register_buffers(const struct iovec *iov, int n) {
+	if(!active || buffers || n <= 0)
+		return false;
+	int ret = io_uring_register_buffers(&ring, iov, n);
+	if(ret < 0) {
+		logger(LOG_ERR, "[uring] Unable to register %d buffers: %s", n, strerror(-ret));
+		return false;
+	}
+	buffers = new struct iovec[n];
+	memcpy(buffers, iov, n * sizeof(struct iovec));
+	return true;
+}
+
+bool uring_read(struct uring_op *op, int fd, int buf, size_t len, int timeout) {
+	g_mutex_lock(&submit_lock);
+	struct io_uring_sqe *sqe = get_sqe(timeout ? 2 : 1);
+	if(!sqe) {
+		g_mutex_unlock(&submit_lock);
+		return false;
+	}
+	/* The dvr device is not seekable, the offset is ignored */
+	io_uring_prep_read_fixed(sqe, fd, buffers[buf].iov_base, MIN(len, buffers[buf].iov_len), 0, buf);
+	io_uring_sqe_set_data(sqe, op);
+	if(timeout) {
+		/* Cancels the read if it does not complete in time */
+		sqe->flags |= IOSQE_IO_LINK;
+		op->timeout.tv_sec = timeout / 1000;
+		op->timeout.tv_nsec = (timeout % 1000) * 1000000L;
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_link_timeout(sqe, &op->timeout, 0);
+		io_uring_sqe_set_data(sqe, NULL);
+	}
+	g_mutex_unlock(&submit_lock);
+	return true;
+}
+
+bool uring_send(struct uring_op *op, int fd, const struct iovec *iov, int iovcnt) {
+	g_mutex_lock(&submit_lock);
+	struct io_uring_sqe *sqe = get_sqe(1);
+	if(!sqe) {
+		g_mutex_unlock(&submit_lock);
+		return false;
+	}
+	/* The message has to stay valid until the operation is finished */
+	memset(&op->msg, 0, sizeof(op->msg));
+	for(int i = 0; i < iovcnt; i++)
+		op->iov[i] = iov[i];
+	op->msg.msg_iov = op->iov;
+	op->msg.msg_iovlen = iovcnt;
+	io_uring_prep_sendmsg(sqe, fd, &op->msg, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, op);
+	g_mutex_unlock(&submit_lock);
+	return true;
+}
+
+void uring_cancel(struct uring_op *op) {
+	g_mutex_lock(&submit_lock);
+	struct io_uring_sqe *sqe = get_sqe(1);
+	if(sqe) {
+		io_uring_prep_cancel(sqe, op, 0);
+		io_uring_sqe_set_data(sqe, NULL);
+	} else {
+		logger(LOG_ERR, "[uring] Submission queue full, unable to cancel operation");
+	}
+	g_mutex_unlock(&submit_lock);
+}
+
+#else
+
+bool uring_init(void) {
+	if(use_io_uring)
+		logger(LOG_ERR, "[uring] tvoe was built without io_uring support, using read()/send()");
+	return false;
+}
+
+bool uring_active(void) {
+	return false;
+}
+
+bool uring_register_buffers(const struct iovec *iov, int n) {
+	return false;
+}
+
+bool uring_read(struct uring_op *op, int fd, int buf, size_t len, int timeout) {
+	return false;
+}
+
+bool uring_send(struct uring_op *op, int fd, const struct iovec *iov, int iovcnt) {
+	return false;
+}
+
+void uring_cancel(struct uring_op *op) {
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __INCLUDED_TVOE_URING
+#define __INCLUDED_TVOE_URING
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <linux/time_types.h>
+#endif
+
+/*
+ * Optional io_uring backend for dvr reads and client sends. Only available if
+ * tvoe is built with liburing (cmake -DUSE_IO_URING=ON), and only used if
+ * enabled in the configuration ("io_uring yes;").
+ *
+ * Operations are queued by the caller and submitted in one batch at the end
+ * of the current event loop iteration. Completions are signalled to the main
+ * event loop via an eventfd, the callbacks of the operations are invoked in
+ * the main thread.
+ */
+
+/* Use io_uring if available. Set by config parser */
+extern bool use_io_uring;
+
+/**
+ * A single operation. Owned by the caller, it must stay valid until its
+ * callback has been invoked.
+ */
+struct uring_op {
+	/** Called in the main thread with the result (bytes or -errno) */
+	void (*cb)(void *arg, int res);
+	void *arg;
+	/* Private */
+	struct msghdr msg;
+	struct iovec iov[2];
+#ifdef HAVE_LIBURING
+	struct __kernel_timespec timeout;
+#endif
+};
+
+/**
+ * Set up the ring. Has to be called after daemonizing.
+ * @return false if io_uring is disabled or not available
+ */
+bool uring_init(void);
+/**
+ * @return true if operations can be submitted
+ */
+bool uring_active(void);
+/**
+ * Register buffers with the kernel, so reads into them do not need to map
+ * the pages for every operation. Can only be called once.
+ * @return false on failure
+ */
+bool uring_register_buffers(const struct iovec *iov, int n);
+/**
+ * Queue a read into a registered buffer, cancelled (with -ECANCELED) if it
+ * does not complete within the timeout. May be called from any thread.
+ * @param buf Index of the buffer, see uring_register_buffers()
+ * @param timeout Timeout in ms, 0 for none
+ * @return false if no operation could be queued
+ */
+bool uring_read(struct uring_op *op, int fd, int buf, size_t len, int timeout);
+/**
+ * Queue a sendmsg() of up to two buffers
+ * @return false if no operation could be queued
+ */
+bool uring_send(struct uring_op *op, int fd, const struct iovec *iov, int iovcnt);
+/**
+ * Request cancellation of an operation. Its callback is still called, with
+ * -ECANCELED or the result of the operation if it was already finished.
+ */
+void uring_cancel(struct uring_op *op);
+
+#endif